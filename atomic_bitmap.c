@@ -0,0 +1,77 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "atomic_bitmap.h"
+
+#define WORD(i) ((i) / ATOMIC_BITMAP_WORD_BITS)
+#define MASK(i) (UINT64_C(1) << ((i) % ATOMIC_BITMAP_WORD_BITS))
+
+atomic_bitmap_t* atomic_bitmap_init(size_t nbits) {
+    atomic_bitmap_t *bm = calloc(1, sizeof(atomic_bitmap_t));
+    if(bm == NULL) return NULL;
+    bm->nbits = nbits;
+    bm->nwords = ATOMIC_BITMAP_WORDS(nbits);
+    bm->words = calloc(bm->nwords > 0 ? bm->nwords : 1, sizeof(uint64_t));
+    if(bm->words == NULL) {
+        free(bm);
+        return NULL;
+    }
+    bm->epoch = 0;
+    return bm;
+}
+
+void atomic_bitmap_destroy(atomic_bitmap_t *bm) {
+    if(bm == NULL) return;
+    free(bm->words);
+    free(bm);
+}
+
+bool atomic_bitmap_set(atomic_bitmap_t *bm, size_t i) {
+    uint64_t old = __atomic_fetch_or(&bm->words[WORD(i)], MASK(i),
+                                     __ATOMIC_ACQ_REL);
+    if(!(old & MASK(i)))
+        __atomic_fetch_add(&bm->epoch, 1, __ATOMIC_RELEASE);
+    return (old & MASK(i)) != 0;
+}
+
+bool atomic_bitmap_clear(atomic_bitmap_t *bm, size_t i) {
+    uint64_t old = __atomic_fetch_and(&bm->words[WORD(i)], ~MASK(i),
+                                      __ATOMIC_ACQ_REL);
+    if(old & MASK(i))
+        __atomic_fetch_add(&bm->epoch, 1, __ATOMIC_RELEASE);
+    return (old & MASK(i)) != 0;
+}
+
+bool atomic_bitmap_test(atomic_bitmap_t *bm, size_t i) {
+    return (__atomic_load_n(&bm->words[WORD(i)], __ATOMIC_ACQUIRE)
+            & MASK(i)) != 0;
+}
+
+size_t atomic_bitmap_count(atomic_bitmap_t *bm) {
+    size_t count = 0;
+    for(size_t w = 0; w < bm->nwords; w++)
+        count += __builtin_popcountll(
+            __atomic_load_n(&bm->words[w], __ATOMIC_ACQUIRE));
+    return count;
+}
+
+long atomic_bitmap_next(atomic_bitmap_t *bm, size_t from) {
+    if(from >= bm->nbits) return -1;
+    size_t w = WORD(from);
+    // Mask out the bits below from in the first word
+    uint64_t word = __atomic_load_n(&bm->words[w], __ATOMIC_ACQUIRE)
+        & (~UINT64_C(0) << (from % ATOMIC_BITMAP_WORD_BITS));
+    while(1) {
+        if(word != 0) {
+            size_t i = w * ATOMIC_BITMAP_WORD_BITS + __builtin_ctzll(word);
+            return i < bm->nbits ? (long) i : -1;
+        }
+        if(++w >= bm->nwords) return -1;
+        word = __atomic_load_n(&bm->words[w], __ATOMIC_ACQUIRE);
+    }
+}
+
+unsigned long atomic_bitmap_epoch(atomic_bitmap_t *bm) {
+    return __atomic_load_n(&bm->epoch, __ATOMIC_ACQUIRE);
+}
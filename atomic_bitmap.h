@@ -0,0 +1,56 @@
+#ifndef atomic_bitmap_h_INCLUDED
+#define atomic_bitmap_h_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define ATOMIC_BITMAP_WORD_BITS 64
+#define ATOMIC_BITMAP_WORDS(nbits) \
+    (((nbits) + ATOMIC_BITMAP_WORD_BITS - 1) / ATOMIC_BITMAP_WORD_BITS)
+
+// Fixed size bitmap that can be read without locking.
+// Writers flip bits with atomic RMW operations and then bump the epoch,
+// readers scan the words with plain atomic loads.
+typedef struct atomic_bitmap_s {
+    size_t nbits;
+    size_t nwords;
+    uint64_t *words;
+    // Incremented after every bit that actually changed
+    unsigned long epoch;
+} atomic_bitmap_t;
+
+/* Returns NULL on failure. All bits start cleared */
+atomic_bitmap_t* atomic_bitmap_init(size_t nbits);
+
+void atomic_bitmap_destroy(atomic_bitmap_t *bm);
+
+/* Set bit i and return its previous value */
+bool atomic_bitmap_set(atomic_bitmap_t *bm, size_t i);
+
+/* Clear bit i and return its previous value */
+bool atomic_bitmap_clear(atomic_bitmap_t *bm, size_t i);
+
+/* Test bit i */
+bool atomic_bitmap_test(atomic_bitmap_t *bm, size_t i);
+
+/* Number of set bits */
+size_t atomic_bitmap_count(atomic_bitmap_t *bm);
+
+/* Index of the first set bit >= from, -1 if there is none */
+long atomic_bitmap_next(atomic_bitmap_t *bm, size_t from);
+
+/* Iterate i over the set bits, loading every word only once.
+ * Expands to two nested loops: do not break out of it */
+#define ATOMIC_BITMAP_FOREACH(bm, i) \
+    for(size_t _abm_w = 0; _abm_w < (bm)->nwords; _abm_w++) \
+    for(uint64_t _abm_word = __atomic_load_n(&(bm)->words[_abm_w], \
+                                             __ATOMIC_ACQUIRE); \
+        _abm_word != 0 && ((i) = _abm_w * ATOMIC_BITMAP_WORD_BITS \
+                           + __builtin_ctzll(_abm_word), 1); \
+        _abm_word &= _abm_word - 1)
+
+/* Current epoch, changes whenever a bit is flipped */
+unsigned long atomic_bitmap_epoch(atomic_bitmap_t *bm);
+
+#endif // atomic_bitmap_h_INCLUDED
@@ -0,0 +1,202 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "util.h"
+#include "cashcust.h"
+#include "atomic_bitmap.h"
+
+// Compares the old layout of the cashier state (separately allocated,
+// tightly packed parallel arrays) with cashier_table_t (dense read-mostly
+// arrays plus one padded slot per cashier).
+// Writer threads play the cashiers: each one repeatedly locks a cashier
+// it owns, updates its counters and queue length and unlocks it.
+// Scanner threads play the customers: they look for the shortest open
+// queue, like customer_reschedule does.
+//
+// usage: bench_cashier_layout [cashiers] [writers] [scanners] [ms]
+
+typedef struct packed_layout_s {
+    lock_t *mtx_arr;
+    bool *isopen_arr;
+    long *times_closed_arr;
+    long *queue_len_arr;
+} packed_layout_t;
+
+typedef struct bench_opt_s {
+    int id;
+    int num_cashiers;
+    int num_writers;
+    packed_layout_t *packed;
+    cashier_table_t *table;
+    long ops;
+} bench_opt_t;
+
+static volatile int bench_stop = 0;
+
+static void* packed_writer(void *arg) {
+    bench_opt_t *opt = (bench_opt_t*) arg;
+    packed_layout_t *p = opt->packed;
+    long ops = 0;
+    while(!bench_stop) {
+        for(int i = opt->id; i < opt->num_cashiers; i += opt->num_writers) {
+            MTX_LOCK_DIE(&p->mtx_arr[i]);
+            p->times_closed_arr[i]++;
+            __atomic_store_n(&p->queue_len_arr[i],
+                             p->times_closed_arr[i] & 7, __ATOMIC_RELEASE);
+            MTX_UNLOCK_DIE(&p->mtx_arr[i]);
+            ops++;
+        }
+    }
+    opt->ops = ops;
+    return NULL;
+}
+
+static void* packed_scanner(void *arg) {
+    bench_opt_t *opt = (bench_opt_t*) arg;
+    packed_layout_t *p = opt->packed;
+    long ops = 0, min = 0, len = 0;
+    int min_id = -1;
+    while(!bench_stop) {
+        min_id = -1;
+        for(int i = 0; i < opt->num_cashiers; i++) {
+            if(!__atomic_load_n(&p->isopen_arr[i], __ATOMIC_ACQUIRE))
+                continue;
+            len = __atomic_load_n(&p->queue_len_arr[i], __ATOMIC_ACQUIRE);
+            if(min_id < 0 || len < min) {
+                min_id = i;
+                min = len;
+            }
+        }
+        ops++;
+    }
+    opt->ops = ops;
+    return NULL;
+}
+
+static void* table_writer(void *arg) {
+    bench_opt_t *opt = (bench_opt_t*) arg;
+    cashier_table_t *t = opt->table;
+    long ops = 0;
+    while(!bench_stop) {
+        for(int i = opt->id; i < opt->num_cashiers; i += opt->num_writers) {
+            MTX_LOCK_DIE(&t->slots[i].mtx);
+            t->slots[i].times_closed++;
+            __atomic_store_n(&t->queue_len[i],
+                             t->slots[i].times_closed & 7, __ATOMIC_RELEASE);
+            MTX_UNLOCK_DIE(&t->slots[i].mtx);
+            ops++;
+        }
+    }
+    opt->ops = ops;
+    return NULL;
+}
+
+static void* table_scanner(void *arg) {
+    bench_opt_t *opt = (bench_opt_t*) arg;
+    cashier_table_t *t = opt->table;
+    long ops = 0, min = 0, len = 0, i;
+    int min_id = -1;
+    while(!bench_stop) {
+        min_id = -1;
+        ATOMIC_BITMAP_FOREACH(t->open_bm, i) {
+            len = __atomic_load_n(&t->queue_len[i], __ATOMIC_ACQUIRE);
+            if(min_id < 0 || len < min) {
+                min_id = i;
+                min = len;
+            }
+        }
+        ops++;
+    }
+    opt->ops = ops;
+    return NULL;
+}
+
+static void run(const char *name, void* (*writer)(void*),
+                void* (*scanner)(void*), bench_opt_t *base,
+                int num_writers, int num_scanners, long ms) {
+    int n = num_writers + num_scanners;
+    pthread_t *tid = calloc(n, sizeof(pthread_t));
+    bench_opt_t *opt = calloc(n, sizeof(bench_opt_t));
+    long writes = 0, scans = 0;
+    struct timespec start, end;
+
+    bench_stop = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < n; i++) {
+        opt[i] = *base;
+        opt[i].id = i < num_writers ? i : i - num_writers;
+        if(pthread_create(&tid[i], NULL,
+                          i < num_writers ? writer : scanner, &opt[i]) != 0)
+            ERR_DIE("Creating bench thread\n");
+    }
+    msleep(ms);
+    bench_stop = 1;
+    for(int i = 0; i < n; i++) {
+        pthread_join(tid[i], NULL);
+        if(i < num_writers) writes += opt[i].ops;
+        else scans += opt[i].ops;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec)
+        + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%-8s cashiers %d writers %d scanners %d "
+           "cashier_updates/s %.0f scans/s %.0f\n",
+           name, base->num_cashiers, num_writers, num_scanners,
+           writes / secs, scans / secs);
+    free(tid);
+    free(opt);
+}
+
+int main(int argc, char *argv[]) {
+    int num_cashiers = argc > 1 ? atoi(argv[1]) : 64;
+    int num_writers = argc > 2 ? atoi(argv[2]) : 4;
+    int num_scanners = argc > 3 ? atoi(argv[3]) : 2;
+    long ms = argc > 4 ? atol(argv[4]) : 1000;
+    packed_layout_t packed;
+    cashier_table_t *table;
+
+    if(num_cashiers <= 0 || num_writers <= 0 || num_scanners < 0 || ms <= 0)
+        ERR_DIE("usage: %s [cashiers] [writers] [scanners] [ms]\n", argv[0]);
+
+    // Old layout: one calloc per field, neighbours share cache lines
+    packed.mtx_arr = calloc(num_cashiers, sizeof(lock_t));
+    packed.isopen_arr = calloc(num_cashiers, sizeof(bool));
+    packed.times_closed_arr = calloc(num_cashiers, sizeof(long));
+    packed.queue_len_arr = calloc(num_cashiers, sizeof(long));
+    for(int i = 0; i < num_cashiers; i++) {
+        lock_init(&packed.mtx_arr[i]);
+        packed.isopen_arr[i] = true;
+    }
+
+    if((table = cashier_table_init(num_cashiers)) == NULL)
+        ERR_DIE("Allocating cashier table\n");
+    for(int i = 0; i < num_cashiers; i++) {
+        atomic_bitmap_set(table->open_bm, i);
+        table->queue_len[i] = 0;
+    }
+
+    bench_opt_t base = {0};
+    base.num_cashiers = num_cashiers;
+    base.num_writers = num_writers;
+    base.packed = &packed;
+    base.table = table;
+
+    run("packed", packed_writer, packed_scanner, &base,
+        num_writers, num_scanners, ms);
+    run("table", table_writer, table_scanner, &base,
+        num_writers, num_scanners, ms);
+
+    for(int i = 0; i < num_cashiers; i++)
+        lock_destroy(&packed.mtx_arr[i]);
+    free(packed.mtx_arr);
+    free(packed.isopen_arr);
+    free(packed.times_closed_arr);
+    free(packed.queue_len_arr);
+    cashier_table_destroy(table);
+    return 0;
+}
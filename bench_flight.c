@@ -0,0 +1,72 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "util.h"
+#include "flight.h"
+
+// Cost of a flight recorder event, recorded by threads at once like the
+// customer state changes, with the recorder on and off.
+//
+// usage: bench_flight [threads] [events_per_thread] [path]
+
+typedef struct bench_opt_s {
+    int id;
+    long events;
+    uint64_t ns;
+} bench_opt_t;
+
+static void* worker(void *arg) {
+    bench_opt_t *opt = (bench_opt_t*) arg;
+    uint64_t start = now_ns();
+    for(long i = 0; i < opt->events; i++)
+        flight_record(FLIGHT_CUST_STATE, opt->id, i & 7);
+    opt->ns = now_ns() - start;
+    return NULL;
+}
+
+static void run(const char *label, int num_threads, long events) {
+    pthread_t *tid = calloc(num_threads, sizeof(pthread_t));
+    bench_opt_t *opt = calloc(num_threads, sizeof(bench_opt_t));
+    double ns = 0;
+    if(tid == NULL || opt == NULL) ERR_DIE("Allocating bench state\n");
+
+    for(int i = 0; i < num_threads; i++) {
+        opt[i].id = i;
+        opt[i].events = events;
+        if(pthread_create(&tid[i], NULL, worker, &opt[i]) != 0)
+            ERR_DIE("Creating bench thread\n");
+    }
+    for(int i = 0; i < num_threads; i++) {
+        pthread_join(tid[i], NULL);
+        ns += opt[i].ns;
+    }
+
+    // Wall time of a thread per event, which with more threads than
+    // CPUs includes the time the others ran
+    printf("%-4s threads %d events %ld ns/event %.2f\n", label, num_threads,
+           num_threads * events, ns / (num_threads * events));
+    free(tid);
+    free(opt);
+}
+
+int main(int argc, char *argv[]) {
+    int num_threads = argc > 1 ? atoi(argv[1]) : 4;
+    long events = argc > 2 ? atol(argv[2]) : 10000000;
+    const char *path = argc > 3 ? argv[3] : "./bench.flight";
+
+    if(num_threads <= 0 || events <= 0)
+        ERR_DIE("usage: %s [threads] [events_per_thread] [path]\n", argv[0]);
+
+    run("off", num_threads, events);
+    if(flight_init(path, "bench_flight", DEFAULT_FLIGHT_EVENTS,
+                   num_threads + 1) != 0)
+        ERR_DIE("Starting the flight recorder at %s\n", path);
+    run("on", num_threads, events);
+    flight_destroy(0);
+    unlink(path);
+    return 0;
+}
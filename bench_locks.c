@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "util.h"
+#include "lock.h"
+#include "conc_lqueue.h"
+#include "token_bucket.h"
+
+// Compares the lock backends of lock.h on the critical sections the
+// supermarket runs most:
+//
+// slot    a cashier slot: lock one of the cashiers, bump its counters,
+//         publish its queue length and unlock, like the cashier and
+//         customer threads do around cashier_table_t slots. Runs every
+//         backend in the same process
+// queue   a customer queue: half the threads conc_lqueue_enqueue and
+//         half conc_lqueue_dequeue_nonblock on a single conc_lqueue_t
+// bucket  the admission bucket: every thread token_bucket_take's one
+//         token at a time from a single token_bucket_t
+//
+// queue and bucket call the real functions, so they run on the backend
+// this binary was built with: make clean bench LOCK_BACKEND=<backend>
+//
+// usage: bench_locks [threads] [ms] [cashiers]
+
+typedef struct backend_s {
+    const char *name;
+    void (*init)(void *l);
+    void (*acquire)(void *l);
+    void (*release)(void *l);
+} backend_t;
+
+// One lock per cache line, as in the padded cashier slots
+typedef struct bench_lock_s {
+    union {
+        pthread_mutex_t mutex;
+        lock_word_t word;
+    };
+    long counter;
+    long queue_len;
+} __attribute__((aligned(CACHE_LINE_SIZE))) bench_lock_t;
+
+typedef struct bench_opt_s {
+    int id;
+    int num_threads;
+    int num_locks;
+    const backend_t *backend;
+    bench_lock_t *locks;
+    conc_lqueue_t *queue;
+    token_bucket_t *bucket;
+    long ops;
+} bench_opt_t;
+
+static volatile int bench_stop = 0;
+
+static void pthread_init(void *l) { pthread_mutex_init(l, NULL); }
+static void pthread_acquire(void *l) { pthread_mutex_lock(l); }
+static void pthread_release(void *l) { pthread_mutex_unlock(l); }
+static void word_init(void *l) { memset(l, 0, sizeof(lock_word_t)); }
+static void futex_acquire(void *l) { lock_futex_acquire(l); }
+static void futex_release(void *l) { lock_futex_release(l); }
+static void adaptive_acquire(void *l) { lock_adaptive_acquire(l); }
+static void ticket_acquire(void *l) { lock_ticket_acquire(l); }
+static void ticket_release(void *l) { lock_ticket_release(l); }
+
+static const backend_t backends[] = {
+    { "pthread", pthread_init, pthread_acquire, pthread_release },
+    { "futex", word_init, futex_acquire, futex_release },
+    { "adaptive", word_init, adaptive_acquire, futex_release },
+    { "ticket", word_init, ticket_acquire, ticket_release },
+};
+
+// The backend of lock_t, which queue and bucket run on. backends[] is
+// in the order of the LOCK_* values
+static const backend_t *build_backend = &backends[LOCK_BACKEND];
+
+static void* slot_worker(void *arg) {
+    bench_opt_t *opt = (bench_opt_t*) arg;
+    unsigned int seed = opt->id + 1;
+    bench_lock_t *s;
+    long ops = 0;
+    while(!bench_stop) {
+        s = &opt->locks[rand_r(&seed) % opt->num_locks];
+        opt->backend->acquire(s);
+        s->counter++;
+        __atomic_store_n(&s->queue_len, s->counter & 7, __ATOMIC_RELEASE);
+        opt->backend->release(s);
+        ops++;
+    }
+    opt->ops = ops;
+    return NULL;
+}
+
+static void* queue_worker(void *arg) {
+    bench_opt_t *opt = (bench_opt_t*) arg;
+    bool producer = opt->id % 2 == 0;
+    void *val;
+    long ops = 0;
+    while(!bench_stop) {
+        // Producers stop at a bound so the queue does not grow forever
+        if(producer && conc_lqueue_getsize(opt->queue) < 1024) {
+            if(conc_lqueue_enqueue(opt->queue, &ops) != 0)
+                ERR_DIE("Enqueuing in the bench queue\n");
+            ops++;
+        } else if(!producer
+                  && conc_lqueue_dequeue_nonblock(opt->queue, &val) == 0) {
+            ops++;
+        }
+    }
+    opt->ops = ops;
+    return NULL;
+}
+
+static void* bucket_worker(void *arg) {
+    bench_opt_t *opt = (bench_opt_t*) arg;
+    long ops = 0;
+    while(!bench_stop) {
+        token_bucket_take(opt->bucket, 1);
+        ops++;
+    }
+    opt->ops = ops;
+    return NULL;
+}
+
+static void run(const char *workload, void* (*worker)(void*),
+                const backend_t *backend, int num_threads, int num_locks,
+                long ms) {
+    pthread_t *tid = calloc(num_threads, sizeof(pthread_t));
+    bench_opt_t *opt = calloc(num_threads, sizeof(bench_opt_t));
+    bench_lock_t *locks = NULL;
+    conc_lqueue_t *queue = conc_lqueue_init();
+    // A token every us, as a busy admission rate
+    token_bucket_t *bucket = token_bucket_init(1e6, 10);
+    struct timespec start, end;
+    long ops = 0;
+    void *val;
+
+    if(tid == NULL || opt == NULL || queue == NULL || bucket == NULL
+       || posix_memalign((void**) &locks, CACHE_LINE_SIZE,
+                         num_locks * sizeof(bench_lock_t)) != 0)
+        ERR_DIE("Allocating bench state\n");
+    memset(locks, 0, num_locks * sizeof(bench_lock_t));
+    for(int i = 0; i < num_locks; i++) backend->init(&locks[i]);
+
+    bench_stop = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < num_threads; i++) {
+        opt[i].id = i;
+        opt[i].num_threads = num_threads;
+        opt[i].num_locks = num_locks;
+        opt[i].backend = backend;
+        opt[i].locks = locks;
+        opt[i].queue = queue;
+        opt[i].bucket = bucket;
+        if(pthread_create(&tid[i], NULL, worker, &opt[i]) != 0)
+            ERR_DIE("Creating bench thread\n");
+    }
+    msleep(ms);
+    bench_stop = 1;
+    for(int i = 0; i < num_threads; i++) {
+        pthread_join(tid[i], NULL);
+        ops += opt[i].ops;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec)
+        + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%-7s %-9s threads %d locks %d ops/s %.0f\n", workload,
+           backend->name, num_threads, num_locks, ops / secs);
+    while(conc_lqueue_dequeue_nonblock(queue, &val) == 0);
+    conc_lqueue_free(queue);
+    token_bucket_destroy(bucket);
+    free(locks);
+    free(tid);
+    free(opt);
+}
+
+int main(int argc, char *argv[]) {
+    int num_threads = argc > 1 ? atoi(argv[1]) : 4;
+    long ms = argc > 2 ? atol(argv[2]) : 500;
+    int num_cashiers = argc > 3 ? atoi(argv[3]) : 8;
+    int num_backends = sizeof(backends) / sizeof(backends[0]);
+
+    if(num_threads <= 0 || ms <= 0 || num_cashiers <= 0)
+        ERR_DIE("usage: %s [threads] [ms] [cashiers]\n", argv[0]);
+
+    for(int b = 0; b < num_backends; b++)
+        run("slot", slot_worker, &backends[b], num_threads, num_cashiers, ms);
+    run("queue", queue_worker, build_backend, num_threads, 1, ms);
+    run("bucket", bucket_worker, build_backend, num_threads, 1, ms);
+    return 0;
+}
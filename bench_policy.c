@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <time.h>
+
+#include "util.h"
+#include "policy.h"
+
+// Compares the scaling decision of the manager computed by rescanning
+// every cashier after each queue size change, as conn_worker used to,
+// with policy_t which keeps the aggregates up to date incrementally.
+// Both are fed the same random stream of single cashier changes and
+// their decisions are checked to be the same.
+//
+// usage: bench_policy [cashiers] [updates]
+
+#define UNDERCROWDED_TRESHOLD 3
+#define OVERCROWDED_TRESHOLD 10
+
+typedef struct change_s {
+    int id;
+    long queue_size;
+} change_t;
+
+// The old decision, a full scan of the queue sizes
+static policy_action_t rescan_decide(long *queue_size, int n, int *id) {
+    int overcrowded_cashier = -1, first_closed = -1, least_crowded = -1;
+    int undercrowded_count = 0, open_cashiers = 0;
+    long least_crowded_size = LONG_MAX;
+    for(int i = 0; i < n; i++) {
+        if(queue_size[i] == -1) {
+            if(first_closed == -1) first_closed = i;
+        } else {
+            if(queue_size[i] < least_crowded_size) {
+                least_crowded = i;
+                least_crowded_size = queue_size[i];
+            }
+            open_cashiers++;
+        }
+        if(queue_size[i] > 0 && queue_size[i] >= OVERCROWDED_TRESHOLD)
+            overcrowded_cashier = i;
+        else if(queue_size[i] >= 0 && queue_size[i] <= 1)
+            undercrowded_count++;
+    }
+    if(undercrowded_count >= UNDERCROWDED_TRESHOLD) {
+        if(open_cashiers > 1) {
+            *id = least_crowded;
+            return POLICY_CLOSE;
+        }
+    } else if(first_closed != -1 && overcrowded_cashier >= 0) {
+        *id = first_closed;
+        return POLICY_OPEN;
+    }
+    return POLICY_NONE;
+}
+
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9
+        + (end->tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char *argv[]) {
+    int num_cashiers = argc > 1 ? atoi(argv[1]) : 10000;
+    long updates = argc > 2 ? atol(argv[2]) : 20000;
+    unsigned int seed = 42;
+    long *queue_size, mismatches = 0, acted = 0;
+    int *rescan_ids, *policy_ids;
+    policy_action_t *rescan_actions, *policy_actions;
+    change_t *changes;
+    policy_t *policy;
+    struct timespec start, end;
+    double rescan_ns, policy_ns;
+
+    if(num_cashiers <= 1 || updates <= 0)
+        ERR_DIE("usage: %s [cashiers] [updates]\n", argv[0]);
+
+    // Most lines busy, some closed, a few close to either treshold
+    changes = calloc(updates, sizeof(change_t));
+    for(long u = 0; u < updates; u++) {
+        changes[u].id = RAND_RANGE(&seed, 0, num_cashiers - 1);
+        changes[u].queue_size = RAND_RANGE(&seed, -1, 2 * OVERCROWDED_TRESHOLD);
+    }
+    queue_size = calloc(num_cashiers, sizeof(long));
+    for(int i = 0; i < num_cashiers; i++) queue_size[i] = i < 1 ? 0 : -1;
+    rescan_ids = calloc(updates, sizeof(int));
+    policy_ids = calloc(updates, sizeof(int));
+    rescan_actions = calloc(updates, sizeof(policy_action_t));
+    policy_actions = calloc(updates, sizeof(policy_action_t));
+    if((policy = policy_init(num_cashiers, 1, UNDERCROWDED_TRESHOLD,
+                             OVERCROWDED_TRESHOLD)) == NULL)
+        ERR_DIE("Allocating policy\n");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(long u = 0; u < updates; u++) {
+        queue_size[changes[u].id] = changes[u].queue_size;
+        rescan_actions[u] = rescan_decide(queue_size, num_cashiers,
+                                          &rescan_ids[u]);
+        // Carried out, as policy_decide assumes
+        if(rescan_actions[u] == POLICY_OPEN) queue_size[rescan_ids[u]] = 0;
+        else if(rescan_actions[u] == POLICY_CLOSE)
+            queue_size[rescan_ids[u]] = -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    rescan_ns = elapsed_ns(&start, &end);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(long u = 0; u < updates; u++) {
+        policy_update(policy, changes[u].id, changes[u].queue_size, -1);
+        policy_actions[u] = policy_decide(policy, &policy_ids[u]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    policy_ns = elapsed_ns(&start, &end);
+
+    for(long u = 0; u < updates; u++) {
+        if(rescan_actions[u] != POLICY_NONE) acted++;
+        if(rescan_actions[u] != policy_actions[u]
+           || (rescan_actions[u] != POLICY_NONE
+               && rescan_ids[u] != policy_ids[u]))
+            mismatches++;
+    }
+
+    printf("rescan      cashiers %d updates %ld ns/decision %.1f\n",
+           num_cashiers, updates, rescan_ns / updates);
+    printf("incremental cashiers %d updates %ld ns/decision %.1f\n",
+           num_cashiers, updates, policy_ns / updates);
+    printf("decisions acting %ld mismatches %ld\n", acted, mismatches);
+
+    policy_destroy(policy);
+    free(changes);
+    free(queue_size);
+    free(rescan_ids);
+    free(policy_ids);
+    free(rescan_actions);
+    free(policy_actions);
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
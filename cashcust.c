@@ -11,87 +11,430 @@
 #include "cashcust.h"
 #include "config.h"
 #include "conc_lqueue.h"
+#include "exit_batch.h"
+#include "outmsg.h"
+#include "trace.h"
+#include "flight.h"
 
 volatile sig_atomic_t should_quit = 0;
 volatile sig_atomic_t should_close = 0;
 
+// Trace names of the customer_state_t phases
+static const char *customer_state_names[] = {
+    "WAIT_BUY", "BUY", "WAIT_PAY", "PAYING", "TERMINATED", "CAN_EXIT"
+};
+
+// End the current phase of the customer in the trace
+static void customer_trace_phase(customer_opt_t *this, uint32_t state) {
+    uint64_t now = now_ns(),
+             since = __atomic_exchange_n(&this->state_since, now,
+                                         __ATOMIC_RELAXED);
+    trace_span("customer", customer_state_names[state],
+               TRACE_TRACK_CUSTOMER(this->id), since, now,
+               "products", this->products);
+}
+
+// ========== Queue Size Reports ==========
+
+// Band of a queue length in the manager policy: closed, at most one
+// customer (undercrowded), normal or overcrowded
+static int report_band(cashier_poll_opt_t *p, long len) {
+    if(len < 0) return -1;
+    if(len <= 1) return 0;
+    return len >= p->overcrowded_treshold ? 2 : 1;
+}
+
+// Whether a wait moved enough since the last reported one to report it
+static bool report_wait_moved(cashier_poll_opt_t *p, long wait, long last) {
+    return (wait > p->wait_target) != (last > p->wait_target)
+        || labs(wait - last) >= p->wait_band;
+}
+
+void cashier_poll_kick(cashier_poll_opt_t *p) {
+    if(p == NULL) return;
+    if(__atomic_exchange_n(&p->dirty, 1, __ATOMIC_RELEASE) == 0)
+        futex_wake(&p->dirty, 1);
+}
+
+// Notify callback of the cashier queues, called with their mutex held
+static void cashier_queue_changed(void *arg, long len) {
+    cashier_opt_t *c = (cashier_opt_t *) arg;
+    cashier_poll_opt_t *p = c->table->reporter;
+    long peak, last;
+    // Emptying the queue of a closing cashier keeps it closed
+    stats_queue(c->table->stats, c->id,
+                atomic_bitmap_test(c->table->open_bm, c->id) ? len : -1);
+    if(p == NULL) return;
+    peak = __atomic_load_n(&p->peak[c->id], __ATOMIC_RELAXED);
+    while(len > peak
+          && !__atomic_compare_exchange_n(&p->peak[c->id], &peak, len, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    last = __atomic_load_n(&p->reported[c->id], __ATOMIC_RELAXED);
+    if(report_band(p, len) == report_band(p, last)
+       && labs(len - last) < p->delta
+       && !report_wait_moved(p, cashier_estimated_wait(c->table, c->id),
+                             __atomic_load_n(&p->reported_wait[c->id],
+                                             __ATOMIC_RELAXED)))
+        return;
+    __atomic_fetch_add(&p->events, 1, __ATOMIC_RELAXED);
+    cashier_poll_kick(p);
+}
+
+cashier_poll_opt_t* cashier_poll_init(cashier_table_t *t,
+                                      conc_lqueue_t *ctlqueue,
+                                      long overcrowded_treshold, long delta,
+                                      long wait_target, long wait_band,
+                                      long min_interval, long idle) {
+    cashier_poll_opt_t *p = calloc(1, sizeof(cashier_poll_opt_t));
+    if (p == NULL) return NULL;
+    p->reported = calloc(t->size, sizeof(long));
+    p->reported_wait = calloc(t->size, sizeof(long));
+    p->peak = calloc(t->size, sizeof(long));
+    if (p->reported == NULL || p->reported_wait == NULL || p->peak == NULL) {
+        cashier_poll_destroy(p);
+        return NULL;
+    }
+    for (int i = 0; i < t->size; i++)
+        p->reported[i] = p->reported_wait[i] = p->peak[i] = -1;
+    p->cashiers = t;
+    p->ctlqueue = ctlqueue;
+    p->overcrowded_treshold = overcrowded_treshold;
+    p->delta = delta;
+    p->wait_target = wait_target;
+    p->wait_band = wait_band;
+    p->min_interval = min_interval;
+    p->idle = idle;
+    t->reporter = p;
+    return p;
+}
+
+void cashier_poll_destroy(cashier_poll_opt_t *p) {
+    if (p == NULL) return;
+    free(p->reported);
+    free(p->reported_wait);
+    free(p->peak);
+    free(p);
+}
+
+static void customer_wake_waiters(customer_opt_t *this) {
+    coro_t *coro;
+    if(__atomic_load_n(&this->state_waiters, __ATOMIC_SEQ_CST) == 0)
+        return;
+    if((coro = __atomic_load_n(&this->coro, __ATOMIC_SEQ_CST)) != NULL)
+        coro_unpark(coro);
+    else
+        futex_wake(&this->state, INT_MAX);
+}
+
+// Take a reference, unless the customer already left
+static bool customer_ref(customer_opt_t *this) {
+    uint32_t refs = __atomic_load_n(&this->refs, __ATOMIC_RELAXED);
+    do {
+        if(refs == 0) return false;
+    } while(!__atomic_compare_exchange_n(&this->refs, &refs, refs + 1, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    return true;
+}
+
+static void customer_unref(customer_opt_t *this) {
+    if(__atomic_sub_fetch(&this->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    // The slot can be reused from now on
+    __atomic_store_n(this->customer_terminated, true, __ATOMIC_RELEASE);
+}
 
 int customer_set_state(customer_opt_t *this, customer_state_t state) {
-                       // customer_state_t *extstate) {
-    if(should_quit) return 1;
-    MTX_LOCK_RET(this->state_mtx);
-    *(this->state) = state;
-    // if(extstate != NULL) *extstate = *(this->state);
-    COND_SIGNAL_RET(this->state_change_event);
-    LOG_DEBUG("Set customer %d state to %d\n", this->id, *(this->state));
-    MTX_UNLOCK_RET(this->state_mtx);
+    if(should_quit || !customer_ref(this)) return 1;
+    uint32_t old = __atomic_load_n(&this->state, __ATOMIC_RELAXED), new;
+    // Only loops if the customer is being kicked at the same time
+    do {
+        new = (old & ~CUSTOMER_STATE_MASK) | state;
+    } while(!__atomic_compare_exchange_n(&this->state, &old, new, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    if((old & CUSTOMER_STATE_MASK) != state) {
+        stats_add(this->cashiers->stats,
+                  STATS_CUST_WAIT_BUY + (old & CUSTOMER_STATE_MASK), -1);
+        stats_add(this->cashiers->stats, STATS_CUST_WAIT_BUY + state, 1);
+        flight_record(FLIGHT_CUST_STATE, this->id, state);
+        if(trace_on()) customer_trace_phase(this, old & CUSTOMER_STATE_MASK);
+    }
+    LOG_DEBUG("Set customer %d state to %d\n", this->id, state);
+    customer_wake_waiters(this);
+    customer_unref(this);
+    return 0;
+}
+
+customer_state_t customer_get_state(customer_opt_t *this) {
+    return __atomic_load_n(&this->state, __ATOMIC_ACQUIRE)
+        & CUSTOMER_STATE_MASK;
+}
+
+static int wait_state(customer_opt_t *this, customer_state_t state,
+                      bool at_least, bool close_aborts) {
+    uint32_t curr, reached;
+    coro_t *self = coro_self();
+    if(self != NULL)
+        __atomic_store_n(&this->coro, self, __ATOMIC_SEQ_CST);
+    while((reached = (curr = __atomic_load_n(&this->state, __ATOMIC_SEQ_CST))
+           & CUSTOMER_STATE_MASK) != state
+          && !(at_least && reached > state)) {
+        if(should_quit || (close_aborts && should_close)
+           || (curr & CUSTOMER_KICKED)
+           || (close_aborts && (curr & CUSTOMER_DRAINED)))
+            return 1;
+        // The waiter count is raised before sleeping, and futex_wait
+        // does not sleep if the word moved from curr in the meantime,
+        // so a transition can never be missed. A coroutine rechecks the
+        // word after raising the count, an unpark that comes after that
+        // leaves a permit and its park returns at once
+        __atomic_fetch_add(&this->state_waiters, 1, __ATOMIC_SEQ_CST);
+        if(self == NULL)
+            futex_wait(&this->state, curr, -1);
+        else if(__atomic_load_n(&this->state, __ATOMIC_SEQ_CST) == curr)
+            coro_park();
+        __atomic_fetch_sub(&this->state_waiters, 1, __ATOMIC_SEQ_CST);
+    }
     return 0;
 }
 
+int customer_wait_state(customer_opt_t *this, customer_state_t state,
+                        bool close_aborts) {
+    return wait_state(this, state, false, close_aborts);
+}
+
+int customer_wait_state_at_least(customer_opt_t *this,
+                                 customer_state_t state, bool close_aborts) {
+    return wait_state(this, state, true, close_aborts);
+}
+
+void customer_kick(customer_opt_t *this) {
+    __atomic_fetch_or(&this->state, CUSTOMER_KICKED, __ATOMIC_SEQ_CST);
+    customer_wake_waiters(this);
+}
+
+void customer_drain(customer_opt_t *this) {
+    // The word has to move, should_close alone would not wake a waiter
+    // that checked it just before sleeping
+    __atomic_fetch_or(&this->state, CUSTOMER_DRAINED, __ATOMIC_SEQ_CST);
+    customer_wake_waiters(this);
+}
+
+// Account for products entering (or leaving, if negative) a line
+static void cashier_add_work(cashier_table_t *t, int id, long products) {
+    cashier_poll_opt_t *p = t->reporter;
+    __atomic_fetch_add(&t->remaining_work[id], products, __ATOMIC_RELAXED);
+    // The line may keep its length while its wait moves
+    if(p == NULL || !atomic_bitmap_test(t->open_bm, id)
+       || !report_wait_moved(p, cashier_estimated_wait(t, id),
+                             __atomic_load_n(&p->reported_wait[id],
+                                             __ATOMIC_RELAXED)))
+        return;
+    __atomic_fetch_add(&p->events, 1, __ATOMIC_RELAXED);
+    cashier_poll_kick(p);
+}
+
 void cashier_init(cashier_opt_t *c, int id,
-                  bool *isopen,
-                  pthread_mutex_t *state_mtx,
+                  cashier_table_t *table,
                   long time_per_prod, 
-                  long *times_closed,
                   FILE *logfile) {
+    unsigned int seed = clock() + id;
     c->id = id;
-    c->custqueue = conc_lqueue_init(c->custqueue);
-    c->isopen = isopen;
-    c->state_mtx = state_mtx;
-    c->time_per_prod = time_per_prod;
-    c->times_closed = times_closed;
+    // The line belongs to the slot and outlives the cashier thread:
+    // customers may still hold it when the cashier leaves
+    if (c->custqueue == NULL) c->custqueue = conc_lqueue_init();
+    c->table = table;
+    // Time needed to initially process a customer
+    // The queue reporter estimates the wait of the slot at any time
+    __atomic_store_n(&c->start_time,
+                     RAND_RANGE(&seed, CASHIER_START_TIME_MIN,
+                                CASHIER_START_TIME_MAX), __ATOMIC_RELAXED);
+    __atomic_store_n(&c->time_per_prod, time_per_prod, __ATOMIC_RELAXED);
     c->logfile = logfile;
+    __atomic_store_n(&table->queue_len[id], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&table->remaining_work[id], 0, __ATOMIC_RELAXED);
+    stats_queue(table->stats, id, 0);
+    conc_lqueue_set_notify(c->custqueue, cashier_queue_changed, c);
+    conc_lqueue_mirror_size(c->custqueue, &table->queue_len[id]);
+}
+
+cashier_table_t* cashier_table_init(int size) {
+    cashier_table_t *t = calloc(1, sizeof(cashier_table_t));
+    void *slots = NULL, *queue_len = NULL, *remaining_work = NULL;
+    if (t == NULL) return NULL;
+    t->size = size;
+    t->open_bm = atomic_bitmap_init(size);
+    // Every slot must start on a cache line boundary, and the dense
+    // arrays should not share their first line with other allocations
+    t->arrivals = counter_init();
+    t->served = counter_init();
+    t->service_ms = counter_init();
+    if (t->open_bm == NULL || t->arrivals == NULL || t->served == NULL
+        || t->service_ms == NULL
+        || posix_memalign(&slots, CACHE_LINE_SIZE,
+                          size * sizeof(cashier_slot_t)) != 0
+        || posix_memalign(&queue_len, CACHE_LINE_SIZE,
+                          size * sizeof(long)) != 0
+        || posix_memalign(&remaining_work, CACHE_LINE_SIZE,
+                          size * sizeof(long)) != 0) {
+        atomic_bitmap_destroy(t->open_bm);
+        counter_destroy(t->arrivals);
+        counter_destroy(t->served);
+        counter_destroy(t->service_ms);
+        free(slots);
+        free(queue_len);
+        free(remaining_work);
+        free(t);
+        return NULL;
+    }
+    memset(slots, 0, size * sizeof(cashier_slot_t));
+    t->slots = slots;
+    t->queue_len = queue_len;
+    t->remaining_work = remaining_work;
+
+    for (int i = 0; i < size; i++) {
+        t->queue_len[i] = -1;
+        t->remaining_work[i] = 0;
+        if (lock_init(&t->slots[i].mtx) != 0
+            || pthread_attr_init(&t->slots[i].attr) != 0) {
+            ERR("Initializing cashier %d\n", i);
+            cashier_table_destroy(t);
+            return NULL;
+        }
+    }
+    return t;
+}
+
+void cashier_table_destroy(cashier_table_t *t) {
+    if (t == NULL) return;
+    for (int i = 0; i < t->size; i++) {
+        cashier_destroy(&t->slots[i].opt);
+        lock_destroy(&t->slots[i].mtx);
+        pthread_attr_destroy(&t->slots[i].attr);
+    }
+    atomic_bitmap_destroy(t->open_bm);
+    counter_destroy(t->arrivals);
+    counter_destroy(t->served);
+    counter_destroy(t->service_ms);
+    free(t->slots);
+    free(t->queue_len);
+    free(t->remaining_work);
+    free(t);
+}
+
+long cashier_estimated_wait(cashier_table_t *t, int id) {
+    cashier_opt_t *ca = &t->slots[id].opt;
+    long len = __atomic_load_n(&t->queue_len[id], __ATOMIC_RELAXED);
+    long work = __atomic_load_n(&t->remaining_work[id], __ATOMIC_RELAXED);
+    if (len < 0) return -1;
+    if (work < 0) work = 0;
+    return len * __atomic_load_n(&ca->start_time, __ATOMIC_RELAXED)
+        + work * __atomic_load_n(&ca->time_per_prod, __ATOMIC_RELAXED);
 }
 
 void cashier_destroy(cashier_opt_t *c) {
     conc_lqueue_free(c->custqueue);
     c->custqueue = NULL;
-    free(c->custqueue);
+}
+
+// Append the size and estimated wait of a cashier to a delta report, starting a new frame
+// when the current one is full. Returns -1 on allocation failure
+static int report_append(cashier_poll_opt_t *this, outmsg_t **msg,
+                         size_t *used, int id, long len, long wait) {
+    char entry[64];
+    int n = snprintf(entry, sizeof(entry), " %d %ld %ld", id, len, wait);
+    if (*msg != NULL && *used + n + 2 > MSG_SIZE) {
+        snprintf((*msg)->frame + *used, MSG_SIZE - *used, "\n");
+        outmsg_enqueue(this->ctlqueue, *msg);
+        this->sent++;
+        *msg = NULL;
+    }
+    if (*msg == NULL) {
+        if ((*msg = outmsg_new()) == NULL) return -1;
+        *used = snprintf((*msg)->frame, MSG_SIZE, "%s", MSG_QUEUE_DELTA);
+    }
+    memcpy((*msg)->frame + *used, entry, n);
+    *used += n;
+    return 0;
+}
+
+// Send the load counters along with a report, if they moved since the
+// last one. Returns -1 on allocation failure
+static int report_load(cashier_poll_opt_t *this) {
+    cashier_table_t *t = this->cashiers;
+    long arrivals = counter_read(t->arrivals);
+    long served = counter_read(t->served);
+    outmsg_t *msg;
+    if(arrivals == this->reported_arrivals && served == this->reported_served)
+        return 0;
+    if((msg = outmsg_new()) == NULL) return -1;
+    snprintf(msg->frame, MSG_SIZE, "%s %ld %ld %ld\n", MSG_QUEUE_LOAD,
+             arrivals, served, (long) counter_read(t->service_ms));
+    outmsg_enqueue(this->ctlqueue, msg);
+    this->sent++;
+    this->reported_arrivals = arrivals;
+    this->reported_served = served;
+    return 0;
 }
 
 void* cashier_poll_worker(void* arg) {
     cashier_poll_opt_t *this = (cashier_poll_opt_t *) arg;
-    bool curr_isopen = false;
-    char *msgbuf = NULL;
-    char cipher[5] = {0};
-    cashier_opt_t *cash = NULL;
-    long enqueued_customers = -1;
+    cashier_table_t *t = this->cashiers;
+    outmsg_t *msg = NULL;
+    size_t used = 0;
+    long len, peak, elapsed, wait;
+    uint64_t last_sent = 0;
+    bool resync;
     
     while(!should_quit) {
-        msgbuf = calloc(1, MSG_SIZE);
-        snprintf(msgbuf, MSG_SIZE, "%s", MSG_QUEUE_SIZE);
-
-        LOG_DEBUG("Polling...\n");
-        // printf("%d \n", this->cashier_arr_size);
-        for (int i = 0; i < this->cashier_arr_size; i++) {
-            cash = &this->cashier_arr[i];
-            enqueued_customers = -1;
-            MTX_LOCK_GOTO(&this->cashier_mtx_arr[i],
-                          cashier_poll_exit);
-            curr_isopen = this->cashier_isopen_arr[i];
-            MTX_UNLOCK_GOTO(&this->cashier_mtx_arr[i],
-                            cashier_poll_exit);
-
-            if(curr_isopen) {
-                // LOG_DEBUG("Polling cashier %d\n", i);
-                // CONC_LQUEUE_ASSERT_EXISTS(cash->custqueue);
-                enqueued_customers = conc_lqueue_getsize(cash->custqueue);
+        // Sleep until a report is due, sent at least every idle ms
+        elapsed = (now_ns() - last_sent) / 1000000;
+        if(!__atomic_load_n(&this->dirty, __ATOMIC_ACQUIRE)
+           && elapsed < this->idle)
+            futex_wait(&this->dirty, 0, this->idle - elapsed);
+        if(should_quit) break;
+        // Let close changes pile up into a single report
+        elapsed = (now_ns() - last_sent) / 1000000;
+        if(elapsed < this->min_interval
+           && msleep(this->min_interval - elapsed) != 0)
+            break;
+        // Nothing asked for it: the idle report resends every cashier,
+        // in case the manager missed something
+        resync = __atomic_exchange_n(&this->dirty, 0, __ATOMIC_ACQ_REL) == 0;
+
+        LOG_DEBUG("Reporting queue sizes...\n");
+        for (int i = 0; i < t->size; i++) {
+            len = -1;
+            if(atomic_bitmap_test(t->open_bm, i)) {
+                len = __atomic_load_n(&t->queue_len[i], __ATOMIC_ACQUIRE);
+                // A burst that is already gone is reported as its peak
+                peak = __atomic_exchange_n(&this->peak[i], len,
+                                           __ATOMIC_RELAXED);
+                if(report_band(this, peak) > report_band(this, len))
+                    len = peak;
             }
-            snprintf(cipher, 5,
-                " %ld", enqueued_customers);
-
-            strncat(msgbuf, cipher, MSG_SIZE);
-
-            if(strlen(msgbuf) == MSG_SIZE) {
-                LOG_CRITICAL("Buffer overflow in queue size poll");
-                free(msgbuf);
+            wait = len < 0 ? -1 : cashier_estimated_wait(t, i);
+            if(!resync && len == this->reported[i]
+               && (len < 0
+                   || !report_wait_moved(this, wait, this->reported_wait[i])))
+                continue;
+            __atomic_store_n(&this->reported[i], len, __ATOMIC_RELAXED);
+            __atomic_store_n(&this->reported_wait[i], wait, __ATOMIC_RELAXED);
+            if(report_append(this, &msg, &used, i, len, wait) != 0) {
+                LOG_CRITICAL("Allocating queue size report\n");
                 goto cashier_poll_exit;
             }
         }
-        strncat(msgbuf, "\n", MSG_SIZE);
-
-        conc_lqueue_enqueue(this->outmsgqueue, (void*) msgbuf);
-        msleep(this->cashier_poll_time);
+        if(msg != NULL) {
+            // Scaling decisions depend on these, they take the control lane
+            snprintf(msg->frame + used, MSG_SIZE - used, "\n");
+            outmsg_enqueue(this->ctlqueue, msg);
+            this->sent++;
+            msg = NULL;
+        }
+        if(report_load(this) != 0) {
+            LOG_CRITICAL("Allocating load report\n");
+            goto cashier_poll_exit;
+        }
+        last_sent = now_ns();
     }
 
 cashier_poll_exit:
@@ -114,13 +457,17 @@ int cashier_reschedule_enqueued_customers(cashier_opt_t *ca) {
            if (RAND_RANGE(&seed, 0, 3) == 0) {
                customer_opt_t *cu = NULL;
                err = lqueue_remove_index(ca->custqueue->q, (void*) &cu, i);
+               CONC_LQUEUE_SYNC_SIZE(ca->custqueue);
 
                // printf("%d\n", err);
                if(err == 0) {
                    LOG_DEBUG("rescheduling customer %d\n", cu->id);
                    cu->requeue_count++;
+                   stats_add(ca->table->stats, STATS_REQUEUES, 1);
+                   cashier_add_work(ca->table, ca->id, -cu->products);
                    MTX_UNLOCK_RET(ca->custqueue->mutex);
                    customer_reschedule(cu);
+                   MTX_LOCK_RET(ca->custqueue->mutex);
                }
                else {
                    MTX_UNLOCK_RET(ca->custqueue->mutex);
@@ -134,19 +481,113 @@ int cashier_reschedule_enqueued_customers(cashier_opt_t *ca) {
     return 0;
 }
 
+int cashier_redistribute_customers(cashier_table_t *t, int id) {
+    int count = 0, targets = 0, err = 0;
+    long i, moved_work = 0;
+    cashier_opt_t *ca = &t->slots[id].opt;
+    node_t *head = NULL, *curr = NULL, *next = NULL,
+           *leftover_head = NULL, *leftover_tail = NULL;
+
+    if (!ca->custqueue) return -1;
+    // Take the whole line at once, the cashier is already marked as closed
+    head = conc_lqueue_take_all(ca->custqueue, &count);
+    if (head == NULL) return 0;
+    LOG_DEBUG("Redistributing %d customers of cashier %d\n", count, ca->id);
+
+    int *target_id = calloc(t->size, sizeof(int));
+    long *level = calloc(t->size, sizeof(long));
+    long *sub_work = calloc(t->size, sizeof(long));
+    int *sub_count = calloc(t->size, sizeof(int));
+    node_t **sub_head = calloc(t->size, sizeof(node_t*));
+    node_t **sub_tail = calloc(t->size, sizeof(node_t*));
+
+    if (target_id == NULL || level == NULL || sub_work == NULL
+        || sub_count == NULL || sub_head == NULL || sub_tail == NULL) {
+        // With no targets every customer is rescheduled one by one
+        ERR("Allocating the redistribution of cashier %d\n", id);
+    } else {
+        // Snapshot open cashiers and their queue sizes without locking
+        ATOMIC_BITMAP_FOREACH(t->open_bm, i) {
+            if (i == ca->id) continue;
+            target_id[targets] = i;
+            level[targets] = __atomic_load_n(&t->queue_len[i],
+                                             __ATOMIC_ACQUIRE);
+            targets++;
+        }
+    }
+
+    // Water-filling: walking the line in order, every customer goes to
+    // the currently lowest queue, so the open queues are levelled and
+    // customers keep their relative order in each target line.
+    for(curr = head; curr != NULL; curr = next) {
+        next = curr->next;
+        curr->next = NULL;
+        if (targets == 0) {
+            if (leftover_tail) leftover_tail->next = curr;
+            else leftover_head = curr;
+            leftover_tail = curr;
+            continue;
+        }
+        long products = ((customer_opt_t*) curr->val)->products;
+        moved_work += products;
+        int best = 0;
+        for(int k = 1; k < targets; k++)
+            if (level[k] < level[best]) best = k;
+        if (sub_tail[best]) sub_tail[best]->next = curr;
+        else sub_head[best] = curr;
+        sub_tail[best] = curr;
+        sub_count[best]++;
+        sub_work[best] += products;
+        level[best]++;
+    }
+    cashier_add_work(t, id, -moved_work);
+
+    // Splice every sub-list with a single pass on its target queue
+    for(int k = 0; k < targets; k++) {
+        i = target_id[k];
+        if (sub_count[k] == 0) continue;
+        // Lock out close operations while splicing
+        MTX_LOCK_EXT(&t->slots[i].mtx);
+        if (atomic_bitmap_test(t->open_bm, i)) {
+            err = conc_lqueue_splice(t->slots[i].opt.custqueue,
+                                     sub_head[k], sub_tail[k], sub_count[k]);
+            if (err == 0) cashier_add_work(t, i, sub_work[k]);
+        } else {
+            err = -1;
+        }
+        MTX_UNLOCK_EXT(&t->slots[i].mtx);
+        if (err != 0) {
+            // The target closed in the meantime, handle these later
+            if (leftover_tail) leftover_tail->next = sub_head[k];
+            else leftover_head = sub_head[k];
+            leftover_tail = sub_tail[k];
+        }
+    }
+
+    // Fall back to rescheduling one by one whatever could not be placed
+    for(curr = leftover_head; curr != NULL; curr = next) {
+        next = curr->next;
+        customer_reschedule((customer_opt_t*) curr->val);
+        free(curr);
+    }
+
+    free(target_id);
+    free(level);
+    free(sub_work);
+    free(sub_count);
+    free(sub_head);
+    free(sub_tail);
+    return 0;
+}
+
 void* customer_renqueue_worker(void *arg) {
     customer_renqueue_worker_t *opt = (customer_renqueue_worker_t*) arg;
+    cashier_table_t *t = opt->cashiers;
+    long i;
     while(!should_quit) {
-        for(int i = 0; i < opt->cashier_arr_size; i++) {
-            MTX_LOCK_EXT(&opt->cashier_mtx_arr[i]);
-            if(opt->cashier_isopen_arr[i] == true) {
-                MTX_UNLOCK_EXT(&opt->cashier_mtx_arr[i]);
-                // printf("removing and rescheduling customers of cashier %d\n", i);
-                cashier_reschedule_enqueued_customers(&opt->cashier_arr[i]);
-
-            } else {
-                MTX_UNLOCK_EXT(&opt->cashier_mtx_arr[i]);
-            }
+        ATOMIC_BITMAP_FOREACH(t->open_bm, i) {
+            // printf("removing and rescheduling customers of cashier %d\n", i);
+            cashier_reschedule_enqueued_customers(&t->slots[i].opt);
         }
         // TODO get S from config
         msleep(80);
@@ -157,61 +598,55 @@ void* customer_renqueue_worker(void *arg) {
 void* cashier_worker(void* arg) {
     cashier_opt_t this = *(cashier_opt_t *) arg;
     customer_opt_t *curr_cust = NULL;
-    // Time needed to initially process a customer,
-    long start_time,
-         pay_time;
-         // Number of enqueued customers
+    cashier_table_t *t = this.table;
+    long pay_time;
     int err = 0;
     clock_t start_clock;
     clock_t end_time;
     long customers_served = 0; 
     long total_products = 0;
+    uint64_t open_ns = trace_on() ? now_ns() : 0, service_ns = 0;
 
     start_clock = clock();
+    flight_record(FLIGHT_CASHIER_OPEN, this.id, 0);
 
     CONC_LQUEUE_ASSERT_EXISTS(this.custqueue);
 
-    // ========== Initialization ==========
-    unsigned int seed = clock();
-    srand(seed);
-
-    start_time = RAND_RANGE(&seed, CASHIER_START_TIME_MIN,
-                            CASHIER_START_TIME_MAX); 
-
     // ========== Main loop ==========
 
     while(!should_quit) {
         // printf("Cashier %d looping \n", this.id);
 
-        MTX_LOCK_GOTO(this.state_mtx,
-                      cashier_worker_exit_instantly);
-        if(!*(this.isopen)) {
-            MTX_UNLOCK_GOTO(this.state_mtx,
-                            cashier_worker_exit_instantly);
+        if(!atomic_bitmap_test(t->open_bm, this.id))
             goto cashier_worker_exit;
-        }
-        MTX_UNLOCK_GOTO(this.state_mtx, cashier_worker_exit_instantly);
 
         if((err = conc_lqueue_dequeue_nonblock(this.custqueue, 
                                         (void *)&curr_cust)) == 0) {
             customers_served++;
+            flight_record(FLIGHT_SERVICE, this.id, curr_cust->id);
+            cashier_add_work(t, this.id, -curr_cust->products);
             customer_set_state(curr_cust, PAYING);
-            pay_time = start_time + (curr_cust->products * 
+            pay_time = this.start_time + (curr_cust->products * 
                 this.time_per_prod);
+            counter_add(t->served, 1);
+            counter_add(t->service_ms, pay_time);
+            stats_add(t->stats, STATS_SERVICES, 1);
+            stats_add(t->stats, STATS_PRODUCTS, curr_cust->products);
             total_products += curr_cust->products;
             fprintf(this.logfile,
                 "cashier %d customer %ld service_time %ld\n",
                 this.id, customers_served, pay_time);
+            if(trace_on()) service_ns = now_ns();
             msleep(pay_time);
+            if(trace_on())
+                trace_span("cashier", "service", TRACE_TRACK_CASHIER(this.id),
+                           service_ns, now_ns(), "products",
+                           curr_cust->products);
             customer_set_state(curr_cust, TERMINATED);
         } else if(err == ELQUEUEEMPTY) {
-            if (should_close) {
-                // If the supermarket is gently shutting down, exit the thread
-                // when no more customers are in line (happens on SIGHUP)
-                LOG_DEBUG("Cashier %d shutting down...\n", this.id);
-                goto cashier_worker_exit;
-            }
-            msleep(start_time);
+            // Stays open on SIGHUP too: the customers still shopping
+            // get in line later, the cashier stops once they are gone
+            msleep(this.start_time);
         } else {
             LOG_CRITICAL("Unknown Error in cashier %d queue", this.id);
             goto cashier_worker_exit_instantly;
@@ -228,26 +663,27 @@ cashier_worker_exit:
     fprintf(this.logfile, "cashier %d customers_served %ld\n", this.id,
         customers_served);
 
-    *(this.times_closed) = *(this.times_closed) + 1;
-    cashier_destroy(&this);
+    t->slots[this.id].times_closed++;
+    flight_record(FLIGHT_CASHIER_CLOSE, this.id, customers_served);
+    if(trace_on())
+        trace_span("cashier", "open", TRACE_TRACK_CASHIER(this.id), open_ns,
+                   now_ns(), "served", customers_served);
     LOG_DEBUG("Cashier %d has closed\n", this.id);
 cashier_worker_exit_instantly:
+    // The main loop joins it from now on
+    __atomic_store_n(&t->slots[this.id].exited, 1, __ATOMIC_RELEASE);
     return (NULL);
 }
 
 void customer_init(customer_opt_t *c, int id,
                    int *customer_count,
-                   pthread_mutex_t *customer_count_mtx,
-                   cashier_opt_t *cashier_arr,
-                   bool *cashier_isopen_arr,
-                   pthread_mutex_t *cashier_mtx_arr,
+                   cashier_table_t *cashiers,
                    bool *customer_terminated,
                    long max_shopping_time, 
                    int product_cap,
-                   int cashier_arr_size,
-                   conc_lqueue_t *outmsgqueue,
-                   int *total_customers_served,
-                   int *total_products_bought,
+                   exit_batch_t *exit_batch,
+                   counter_t *total_customers_served,
+                   counter_t *total_products_bought,
                    FILE* logfile
                   ) {
     c->id = id;
@@ -255,37 +691,29 @@ void customer_init(customer_opt_t *c, int id,
     srand(seed);
     c->buying_time = RAND_RANGE(&seed, 10, max_shopping_time);
     c->products = RAND_RANGE(&seed, 0, product_cap);
-    c->schedule_cond = calloc(1, sizeof(pthread_cond_t));
-    c->state_mtx = calloc(1, sizeof(pthread_mutex_t));
-    c->state_change_event = calloc(1, sizeof(pthread_cond_t)); 
-    c->state = calloc(1, sizeof(customer_state_t));
-    *(c->state) = WAIT_BUY;
+    c->state = WAIT_BUY;
+    c->state_waiters = 0;
     c->customer_count = customer_count;
     c->customer_terminated = customer_terminated;
-    c->customer_count_mtx = customer_count_mtx;
-    c->cashier_arr = cashier_arr;
-    c->cashier_isopen_arr = cashier_isopen_arr,
-    c->cashier_mtx_arr = cashier_mtx_arr,
-    c->cashier_arr_size = cashier_arr_size;
+    c->cashiers = cashiers;
     c->total_customers_served = total_customers_served;
     c->total_products_bought= total_products_bought;
-    c->outmsgqueue = outmsgqueue;
+    c->exit_batch = exit_batch;
+    c->want_out_ns = 0;
+    c->state_since = trace_on() ? now_ns() : 0;
     c->requeue_count = 0;
+    c->coro = NULL;
     c->logfile = logfile;
-    pthread_cond_init(c->schedule_cond, NULL);
-    pthread_mutex_init(c->state_mtx, NULL);
-    pthread_cond_init(c->state_change_event, NULL);
+    stats_add(cashiers->stats, STATS_CUST_ENTERED, 1);
+    stats_add(cashiers->stats, STATS_CUST_WAIT_BUY, 1);
+    // Last, a transition may only start on an initialized customer
+    __atomic_store_n(&c->refs, 1, __ATOMIC_RELEASE);
     return;
 } 
 
 void customer_destroy(customer_opt_t *c) {
-    pthread_cond_destroy(c->schedule_cond);
-    pthread_cond_destroy(c->state_change_event);
-    pthread_mutex_destroy(c->state_mtx);
-    free(c->state);
-    free(c->state_mtx);
-    free(c->state_change_event);
-    free(c->schedule_cond);
+    c->state = WAIT_BUY;
+    c->state_waiters = 0;
 }
 
 
@@ -293,35 +721,49 @@ int customer_reschedule(customer_opt_t *this) {
     if(should_quit) return 1;
     LOG_DEBUG("Scheduling customer %d\n", this->id);
    
+    cashier_table_t *t = this->cashiers;
     bool rescheduled = false;
-    long min_queue_size = INT_MAX, curr_size = 0;
+    long min_queue_size = INT_MAX, curr_size = 0, i;
     int min_queue_id = -1;
 
     while (!rescheduled) {
-    for(int i = 0; i < this->cashier_arr_size; i++) {
-        MTX_LOCK_EXT(&this->cashier_mtx_arr[i]);
-        if(this->cashier_isopen_arr[i]) {
-            curr_size = conc_lqueue_getsize(this->cashier_arr[i].custqueue);
-            if(min_queue_id < 0 || curr_size < min_queue_size) { 
-                min_queue_id = i;
-                min_queue_size = curr_size;
-            }
+    if (should_quit) return 1;
+    // No cashier is open: poll the epoch every ms until a cashier opens
+    // or closes, instead of scanning the slots. msleep parks a
+    // coroutine, where a futex wait would block its carrier
+    unsigned long epoch = atomic_bitmap_epoch(t->open_bm);
+    if (atomic_bitmap_count(t->open_bm) == 0) {
+        while (!should_quit && atomic_bitmap_epoch(t->open_bm) == epoch)
+            msleep(1);
+        continue;
+    }
+    // Scan the open cashiers and their queue lengths without locking
+    min_queue_id = -1;
+    ATOMIC_BITMAP_FOREACH(t->open_bm, i) {
+        curr_size = __atomic_load_n(&t->queue_len[i], __ATOMIC_ACQUIRE);
+        if(min_queue_id < 0 || curr_size < min_queue_size) { 
+            min_queue_id = i;
+            min_queue_size = curr_size;
         }
-        MTX_UNLOCK_EXT(&this->cashier_mtx_arr[i]);
     }
 
     if(min_queue_id >= 0) {
         LOG_DEBUG("Enqueueing customer %d to cashier %d\n",
             this->id, min_queue_id);
-        MTX_LOCK_EXT(&this->cashier_mtx_arr[min_queue_id]);
-        if (this->cashier_isopen_arr[min_queue_id] == false) {
-            MTX_UNLOCK_EXT(&this->cashier_mtx_arr[min_queue_id]);
+        // Only the chosen cashier is locked, so it cannot close
+        // and drain its line before the customer is in it
+        MTX_LOCK_EXT(&t->slots[min_queue_id].mtx);
+        if (!atomic_bitmap_test(t->open_bm, min_queue_id)) {
+            MTX_UNLOCK_EXT(&t->slots[min_queue_id].mtx);
             continue;
         }
-        conc_lqueue_enqueue(this->cashier_arr[min_queue_id].custqueue,
-                            (void*) this);
+        // Set the state first, the cashier may pick the customer up
+        // as soon as it is in line
         customer_set_state(this, WAIT_PAY);
-        MTX_UNLOCK_EXT(&this->cashier_mtx_arr[min_queue_id]);
+        cashier_add_work(t, min_queue_id, this->products);
+        conc_lqueue_enqueue(t->slots[min_queue_id].opt.custqueue,
+                            (void*) this);
+        MTX_UNLOCK_EXT(&t->slots[min_queue_id].mtx);
         rescheduled = true;
     }
     }
@@ -333,11 +775,11 @@ int customer_reschedule(customer_opt_t *this) {
 
 void* customer_worker(void* arg) {
     customer_opt_t *this = (customer_opt_t *) arg;
-    char *msgbuf;
-    clock_t start_time;
-    start_time = clock();
-    clock_t queue_start_time;
-    clock_t queue_time;
+    // Wall clock times: clock() would count the CPU time of the whole
+    // process, not how long this customer waited
+    uint64_t start_time = now_ns();
+    uint64_t queue_start_time;
+    uint64_t queue_time;
 
 
     // ========== Initialization ==========
@@ -360,6 +802,7 @@ void* customer_worker(void* arg) {
 
     LOG_DEBUG("Customer %d is looking for a cashier...\n", this->id);
     if (should_quit) goto customer_worker_exit;
+    counter_add(this->cashiers->arrivals, 1);
 
     customer_reschedule(this);
 
@@ -367,100 +810,65 @@ void* customer_worker(void* arg) {
     if (should_quit) goto customer_worker_exit;
 
     LOG_DEBUG("Customer %d is in queue...\n", this->id);
-    queue_start_time = clock();
-    MTX_LOCK_GOTO(this->state_mtx, customer_worker_exit);
-    while(*(this->state) != PAYING) {
-        if(should_quit) {
-            MTX_UNLOCK_GOTO(this->state_mtx,
-                            customer_worker_exit);
-            goto customer_worker_exit;
-        }
-
-        COND_WAIT_GOTO(this->state_change_event, this->state_mtx,
-                       customer_worker_exit);
-    }
-    MTX_UNLOCK_GOTO(this->state_mtx, customer_worker_exit);
+    queue_start_time = now_ns();
+    // The cashier may be done with us before we look
+    if(customer_wait_state_at_least(this, PAYING, false) != 0)
+        goto customer_worker_exit;
     
     LOG_DEBUG("Customer %d is paying...\n", this->id);
-    queue_time = clock() - queue_start_time;
-
-    MTX_LOCK_GOTO(this->state_mtx, customer_worker_exit);
-    while(*(this->state) != TERMINATED) {
-        if(should_quit) {
-            MTX_UNLOCK_GOTO(this->state_mtx, customer_worker_exit);
-            goto customer_worker_exit;
-        }
+    queue_time = now_ns() - queue_start_time;
 
-        COND_WAIT_GOTO(this->state_change_event, this->state_mtx,
-                       customer_worker_exit);
-    }
-    MTX_UNLOCK_GOTO(this->state_mtx, customer_worker_exit);
+    if(customer_wait_state_at_least(this, TERMINATED, false) != 0)
+        goto customer_worker_exit;
 
 
     // ========== Ask manager to get out  ==========
 
-    msgbuf = calloc(1, MSG_SIZE);
-    snprintf(msgbuf, MSG_SIZE, "%s %d %s\n",
-             MSG_CUST_HEADER, this->id, MSG_WANT_OUT);
-    if (conc_lqueue_enqueue(this->outmsgqueue, (void*) msgbuf) != 0) {
-        ERR("Error enqueueing message: %s", msgbuf);
-        free(msgbuf);
+    this->want_out_ns = now_ns();
+    if (exit_batch_lease_exit(this->exit_batch, this->id)) {
+        // The manager delegated the confirmation, no round trip
+        this->want_out_ns = 0;
+        customer_set_state(this, CAN_EXIT);
+    } else if (exit_batch_add(this->exit_batch, this->id) != 0) {
         goto customer_worker_exit;
     }
     
 customer_worker_wait_confirm:
     LOG_DEBUG("Customer %d is waiting for exit confirmation\n", this->id);
-    MTX_LOCK_GOTO(this->state_mtx, customer_worker_exit);
-    while(*(this->state) != CAN_EXIT) {
-        if(should_quit || should_close) {
-            MTX_UNLOCK_GOTO(this->state_mtx, customer_worker_exit);
-            goto customer_worker_exit;
-        }
-
-        COND_WAIT_GOTO(this->state_change_event, this->state_mtx,
-                       customer_worker_exit);
-    }
-    MTX_UNLOCK_GOTO(this->state_mtx,
-                    customer_worker_exit);
+    if(customer_wait_state(this, CAN_EXIT, true) != 0)
+        goto customer_worker_exit;
 
 
     // if customer is exiting normally, contribute to customers 
-    // served and products bought statistics
-    MTX_LOCK_GOTO(this->customer_count_mtx,
-                  customer_worker_exit);
+    // served and products bought statistics. The ticket only has to
+    // tell the log lines of this customer apart from the others
+    uint64_t ticket = counter_ticket(this->total_customers_served);
+    counter_add(this->total_products_bought, this->products);
     // Time elapsed in the supermarket
-    clock_t end_time  = clock() - start_time;
-    double  ms_in_supermarket = ((double)end_time)/CLOCKS_PER_SEC * 1000;
-    double  ms_in_queue = ((double)queue_time)/CLOCKS_PER_SEC * 1000;
-
+    uint64_t end_time = now_ns() - start_time;
+    double  ms_in_supermarket = ((double)end_time) / 1e6;
+    double  ms_in_queue = ((double)queue_time) / 1e6;
 
+    // A single call, so the lines of a customer stay together
     fprintf(this->logfile,
-        "customer %d ms_in_supermarket %.3f\n",
-        *(this->total_customers_served),
-        ms_in_supermarket);
-    fprintf(this->logfile,
-        "customer %d ms_in_queue %.3f\n",
-        *(this->total_customers_served),
-        ms_in_queue);
-    fprintf(this->logfile,
-        "customer %d products_bought %d\n",
-        *(this->total_customers_served),
-        this->products);
-    fprintf(this->logfile,
-        "customer %d requeue_count %d\n",
-        *(this->total_customers_served),
-        this->requeue_count++);
-    *(this->total_customers_served) = *(this->total_customers_served) + 1;
-    *(this->total_products_bought) = *(this->total_products_bought) 
-        + this->products;
-    MTX_UNLOCK_GOTO(this->customer_count_mtx, customer_worker_exit);
+        "customer %lu ms_in_supermarket %.3f\n"
+        "customer %lu ms_in_queue %.3f\n"
+        "customer %lu products_bought %d\n"
+        "customer %lu requeue_count %d\n",
+        ticket, ms_in_supermarket,
+        ticket, ms_in_queue,
+        ticket, this->products,
+        ticket, this->requeue_count);
 
 
 customer_worker_exit:
-    MTX_LOCK_EXT(this->customer_count_mtx);
-    *(this->customer_count) = *(this->customer_count) - 1;
-    *(this->customer_terminated) = true;
-    MTX_UNLOCK_EXT(this->customer_count_mtx);
+    if(trace_on()) customer_trace_phase(this, customer_get_state(this));
+    stats_add(this->cashiers->stats,
+              STATS_CUST_WAIT_BUY + customer_get_state(this), -1);
+    stats_add(this->cashiers->stats, STATS_CUST_EXITED, 1);
+    // The count first: once terminated is seen the customer is joined
+    __atomic_fetch_sub(this->customer_count, 1, __ATOMIC_RELEASE);
+    customer_unref(this);
 
     LOG_DEBUG("Customer %d has exited\n", this->id);
     return (NULL);
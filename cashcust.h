@@ -4,26 +4,71 @@
 #include <unistd.h>
 #include <pthread.h> 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <signal.h>
 #include "conc_lqueue.h"
+#include "atomic_bitmap.h"
+#include "coro.h"
+#include "stats.h"
+#include "counter.h"
+#include "util.h"
 
 // ========== Cashier Data Types ==========
 
+struct cashier_table_s;
+
 // Data type for cashier thread.
 typedef struct cashier_opt_s {
     int id;
     // Concurrent customer queue
     conc_lqueue_t *custqueue;
-    // Cashier state 
-    bool *isopen;
-    pthread_mutex_t *state_mtx;
+    // Table holding the state of all the cashiers
+    struct cashier_table_s *table;
     // Various time units
+    long start_time;
     long time_per_prod;
-    long *times_closed;
     FILE *logfile;
 } cashier_opt_t;
 
+// Per-cashier fields that are written on the hot path by one thread,
+// or on open/close. Every slot starts on its own cache line so that
+// neighbouring cashiers do not false share.
+typedef struct cashier_slot_s {
+    lock_t mtx;
+    pthread_t tid;
+    pthread_attr_t attr;
+    // Set while tid is a thread nobody joined yet, and once it stopped
+    int joinable;
+    int exited;
+    long times_closed;
+    cashier_opt_t opt;
+} __attribute__((aligned(CACHE_LINE_SIZE))) cashier_slot_t;
+
+// State of all the cashiers. Fields scanned on every routing decision
+// and poll are kept in dense arrays (structure of arrays), so a scan
+// touches as few cache lines as possible and never a cashier mutex.
+typedef struct cashier_table_s {
+    int size;
+    // Read-mostly, densely packed
+    atomic_bitmap_t *open_bm;
+    // Customers in line, mirrored from the queues
+    long *queue_len;
+    // Products still to be scanned by the customers in line
+    long *remaining_work;
+    // Write-hot, one padded slot per cashier
+    cashier_slot_t *slots;
+    // Told about queue changes, set once before any cashier opens
+    struct cashier_poll_opt_s *reporter;
+    // Load counters reported to the manager: customers that joined a
+    // line, customers served and ms spent serving them
+    counter_t *arrivals;
+    counter_t *served;
+    counter_t *service_ms;
+    // Live counters for smstat, NULL if none
+    stats_t *stats;
+} cashier_table_t;
+
 // ========== Customer Data Types ==========
 
 typedef enum {
@@ -35,6 +80,13 @@ typedef enum {
     CAN_EXIT    // 5 - Is allowed to leave
 } customer_state_t;
 
+// The customer state word holds a customer_state_t in the low bits.
+// CUSTOMER_KICKED is or'ed in on shutdown to release any waiter,
+// CUSTOMER_DRAINED on SIGHUP to release those a drain aborts.
+#define CUSTOMER_STATE_MASK 0xffu
+#define CUSTOMER_KICKED (1u << 31)
+#define CUSTOMER_DRAINED (1u << 30)
+
 // This is the data structure that a customer thread
 // receives in input from the supermarket process.
 // After initialization, a customer waits for buying_time milliseconds
@@ -46,77 +98,135 @@ typedef struct customer_opt_s {
     int id;
     long buying_time;
     int products;
-    // Wait on this condition variable until a reschedule event is sent
-    pthread_cond_t *schedule_cond;
-    customer_state_t *state;
-    pthread_mutex_t *state_mtx;
-    pthread_cond_t *state_change_event;
-    // Number of customers in the supermarket
+    // State word, waiters block on it with futex_wait
+    uint32_t state;
+    // Number of threads blocked on state, transitions only
+    // pay for a futex_wake when this is not zero
+    uint32_t state_waiters;
+    // Set when the customer waits from a coroutine, transitions
+    // unpark it instead of waking the futex
+    coro_t *coro;
+    // Number of customers in the supermarket, and the flag telling the
+    // supermarket this one can be joined, both updated atomically
     int *customer_count;
-    pthread_mutex_t *customer_count_mtx;
     bool *customer_terminated;
-    // Array of cashiers to choose where to enqueue the customer
-    cashier_opt_t *cashier_arr;
-    bool *cashier_isopen_arr;
-    pthread_mutex_t *cashier_mtx_arr;
-    int cashier_arr_size;
-    conc_lqueue_t *outmsgqueue;
-    int *total_customers_served;
-    int *total_products_bought;
+    // The customer's own reference and one per transition in progress.
+    // Whoever drops the last sets customer_terminated, so the slot is
+    // not reused while a cashier is still waking it up
+    uint32_t refs;
+    // Cashiers to choose where to enqueue the customer
+    cashier_table_t *cashiers;
+    // Exit requests are sent to the manager in batches
+    struct exit_batch_s *exit_batch;
+    // CLOCK_MONOTONIC ns when the customer asked to get out
+    uint64_t want_out_ns;
+    // CLOCK_MONOTONIC ns when the current state began, while tracing
+    uint64_t state_since;
+    counter_t *total_customers_served;
+    counter_t *total_products_bought;
     int requeue_count;
     FILE *logfile;
 } customer_opt_t;
 
+// Queue size reporter. Instead of polling, it sleeps until a queue
+// moves into another band of the manager policy (closed, at most one
+// customer, normal, overcrowded) or changes by at least delta since the
+// last report, or until its estimated wait crosses wait_target or moves
+// by at least wait_band ms. Reports are at least min_interval ms apart,
+// changes in between are coalesced, and one is sent anyway after idle
+// ms.
 typedef struct cashier_poll_opt_s {
-    cashier_opt_t *cashier_arr;
-    pthread_mutex_t *cashier_mtx_arr;
-    bool *cashier_isopen_arr;
-    int cashier_arr_size;
-    long cashier_poll_time;
-    conc_lqueue_t *outmsgqueue;
-
+    cashier_table_t *cashiers;
+    // High priority outbound queue
+    conc_lqueue_t *ctlqueue;
+    long overcrowded_treshold;
+    long delta;
+    long wait_target;
+    long wait_band;
+    long min_interval;
+    long idle;
+    // Futex word, set when a report is due
+    uint32_t dirty;
+    // Lengths and waits in the last report, and highest lengths seen
+    // since then
+    long *reported;
+    long *reported_wait;
+    long *peak;
+    // Load counters in the last report
+    long reported_arrivals;
+    long reported_served;
+    // Counters for the log
+    uint64_t sent;
+    uint64_t events;
 } cashier_poll_opt_t;
 
 typedef struct customer_renqueue_worker_t {
-    bool* cashier_isopen_arr;
-    pthread_mutex_t *cashier_mtx_arr;
-    int cashier_arr_size;
-    cashier_opt_t *cashier_arr;
+    cashier_table_t *cashiers;
 } customer_renqueue_worker_t;
 
+// Returns NULL on failure. The reporter attaches itself to the table
+cashier_poll_opt_t* cashier_poll_init(cashier_table_t *t,
+                                      conc_lqueue_t *ctlqueue,
+                                      long overcrowded_treshold, long delta,
+                                      long wait_target, long wait_band,
+                                      long min_interval, long idle);
+void cashier_poll_destroy(cashier_poll_opt_t *p);
+// Ask for a report now, e.g. after a cashier opened or closed
+void cashier_poll_kick(cashier_poll_opt_t *p);
+
 // ========== Worker Function Declarations ==========
 void* cashier_poll_worker(void* arg);
 void* cashier_worker(void* arg);
 void* customer_worker(void* arg);
 void cashier_init(cashier_opt_t *c, int id,
-                  bool *isopen,
-                  pthread_mutex_t *state_mtx,
+                  cashier_table_t *table,
                   long time_per_prod,
-                  long *times_closed,
                   FILE *logfile
 );
 
+// Returns NULL on failure. All the cashiers start closed
+cashier_table_t* cashier_table_init(int size);
+void cashier_table_destroy(cashier_table_t *t);
+// Estimated time in ms to serve everybody in line at cashier id
+long cashier_estimated_wait(cashier_table_t *t, int id);
+
 
 void customer_init(customer_opt_t *c, int id,
                    int *customer_count,
-                   pthread_mutex_t *customer_count_mtx,
-                   cashier_opt_t *cashier_arr,
-                   bool *cashier_isopen_arr,
-                   pthread_mutex_t *cashier_mtx_arr,
+                   cashier_table_t *cashiers,
                    bool *customer_terminated,
                    long max_shopping_time, 
                    int product_cap,
-                   int cashier_arr_size,
-                   conc_lqueue_t *outmsgqueue,
-                   int *total_customers_served,
-                   int *total_products_bought,
+                   struct exit_batch_s *exit_batch,
+                   counter_t *total_customers_served,
+                   counter_t *total_products_bought,
                    FILE *logfile
 );
 
 void cashier_destroy(cashier_opt_t *c);
 void customer_destroy(customer_opt_t *c);
+// Move the customer to state and wake its waiters. Returns 1, changing
+// nothing, if the supermarket is quitting or the customer already left
+int customer_set_state(customer_opt_t *this, customer_state_t state);
+customer_state_t customer_get_state(customer_opt_t *this);
+// Block until the customer is in state. Returns 0 on success, 1 if the
+// customer was kicked or the supermarket is quitting (or closing, if
+// close_aborts is set)
+int customer_wait_state(customer_opt_t *this, customer_state_t state,
+                        bool close_aborts);
+// Same, but also returns once the customer is past state, as a later
+// transition may come before the wait starts
+int customer_wait_state_at_least(customer_opt_t *this,
+                                 customer_state_t state, bool close_aborts);
+// Release every waiter of the customer, used on shutdown
+void customer_kick(customer_opt_t *this);
+// Release the waiters that a drain aborts, used on SIGHUP
+void customer_drain(customer_opt_t *this);
 int customer_reschedule(customer_opt_t *this);
 int cashier_reschedule_enqueued_customers(cashier_opt_t *ca);
+// Move the whole line of a closed cashier onto the open ones, balancing
+// queue lengths and taking each target queue lock once
+int cashier_redistribute_customers(cashier_table_t *t, int id);
 void* customer_renqueue_worker(void *arg);
 
 #endif // customer_h_INCLUDED
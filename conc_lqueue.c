@@ -22,6 +22,7 @@ int conc_lqueue_enqueue(conc_lqueue_t* cq, void* val) {
         return err;
     }
     LOG_NEVER("successfuly put element %p\n", (void*) val);
+    CONC_LQUEUE_SYNC_SIZE(cq);
     COND_SIGNAL_RET(cq->produce_event);
     MTX_UNLOCK_RET(cq->mutex);
     LOG_NEVER("unlocked after enqueue\n");
@@ -46,6 +47,7 @@ int conc_lqueue_dequeue(conc_lqueue_t* cq, void** val) {
         COND_WAIT_RET(cq->produce_event, cq->mutex);
     }
     if(conc_lqueue_abort_all_operations != 0) err = ELQUEUEABORTED;
+    else CONC_LQUEUE_SYNC_SIZE(cq);
     MTX_UNLOCK_RET(cq->mutex);
 
     LOG_NEVER("successfully popped element %p\n", *val);
@@ -70,6 +72,7 @@ int conc_lqueue_dequeue_nonblock(conc_lqueue_t* cq, void** val) {
         MTX_UNLOCK_RET(cq->mutex);
         return ELQUEUEEMPTY;
     }
+    CONC_LQUEUE_SYNC_SIZE(cq);
     MTX_UNLOCK_RET(cq->mutex);
 
     LOG_NEVER("successfully popped element %p\n", *val);
@@ -104,10 +107,13 @@ conc_lqueue_t* conc_lqueue_init() {
         free(cq);
         return NULL;
     } 
-    cq->mutex = calloc(1, sizeof(pthread_mutex_t));
-    cq->produce_event = calloc(1, sizeof(pthread_cond_t));
-    pthread_mutex_init(cq->mutex, NULL);
-    pthread_cond_init(cq->produce_event, NULL);
+    cq->size_mirror = NULL;
+    cq->notify = NULL;
+    cq->notify_arg = NULL;
+    cq->mutex = calloc(1, sizeof(lock_t));
+    cq->produce_event = calloc(1, sizeof(lock_cond_t));
+    lock_init(cq->mutex);
+    lock_cond_init(cq->produce_event);
 
     return cq;
 }
@@ -115,13 +121,13 @@ conc_lqueue_t* conc_lqueue_init() {
 long conc_lqueue_getsize(conc_lqueue_t* cq) {
     long len = -1;
     if (cq == NULL) return len;
-    if(pthread_mutex_lock(cq->mutex) != 0) {
+    if(MTX_LOCK_CALL(cq->mutex) != 0) {
         LOG_CRITICAL("error locking mutex %p\n", (void*) cq->mutex);
         return len;
     }
     LOG_NEVER("MUTEX %p locked\n", (void*)cq->mutex);
     len = cq->q->count;
-    if(pthread_mutex_unlock(cq->mutex) != 0) {
+    if(MTX_UNLOCK_CALL(cq->mutex) != 0) {
         LOG_CRITICAL("error unlocking mutex %p\n", (void*) cq->mutex);
         return len;
     }
@@ -129,11 +135,29 @@ long conc_lqueue_getsize(conc_lqueue_t* cq) {
     return len;
 }
 
+int conc_lqueue_mirror_size(conc_lqueue_t* cq, long* dst) {
+    if(cq == NULL) return -1;
+    MTX_LOCK_RET(cq->mutex);
+    cq->size_mirror = dst;
+    CONC_LQUEUE_SYNC_SIZE(cq);
+    MTX_UNLOCK_RET(cq->mutex);
+    return 0;
+}
+
+int conc_lqueue_set_notify(conc_lqueue_t* cq,
+                           void (*notify)(void* arg, long count), void* arg) {
+    if(cq == NULL) return -1;
+    MTX_LOCK_RET(cq->mutex);
+    cq->notify = notify;
+    cq->notify_arg = arg;
+    MTX_UNLOCK_RET(cq->mutex);
+    return 0;
+}
 
 void conc_lqueue_destroy(conc_lqueue_t* cq) {
     if (cq == NULL) return;
-    if(cq->mutex) pthread_mutex_destroy(cq->mutex);
-    if(cq->produce_event) pthread_cond_destroy(cq->produce_event);
+    if(cq->mutex) lock_destroy(cq->mutex);
+    if(cq->produce_event) lock_cond_destroy(cq->produce_event);
     free(cq->mutex);
     free(cq->produce_event);
     lqueue_destroy(cq->q);
@@ -142,8 +166,8 @@ void conc_lqueue_destroy(conc_lqueue_t* cq) {
 }
 void conc_lqueue_free(conc_lqueue_t* cq) {
     if (cq == NULL) return;
-    if(cq->mutex) pthread_mutex_destroy(cq->mutex);
-    if(cq->produce_event) pthread_cond_destroy(cq->produce_event);
+    if(cq->mutex) lock_destroy(cq->mutex);
+    if(cq->produce_event) lock_cond_destroy(cq->produce_event);
     free(cq->mutex);
     free(cq->produce_event);
     lqueue_free(cq->q);
@@ -156,8 +180,39 @@ int conc_lqueue_remove_index(conc_lqueue_t* cq, void** val, int ind) {
     int err = 0;
     MTX_LOCK_RET(cq->mutex);
     err = lqueue_remove_index(cq->q, val, ind);
+    CONC_LQUEUE_SYNC_SIZE(cq);
     MTX_UNLOCK_RET(cq->mutex);
     return err;
 }
 
 
+
+node_t* conc_lqueue_take_all(conc_lqueue_t* cq, int* count) {
+    node_t *head = NULL;
+    if (count) *count = 0;
+    if(cq == NULL) return NULL;
+    if(MTX_LOCK_CALL(cq->mutex) != 0) {
+        LOG_CRITICAL("error locking mutex %p\n", (void*) cq->mutex);
+        return NULL;
+    }
+    head = lqueue_take_all(cq->q, count);
+    CONC_LQUEUE_SYNC_SIZE(cq);
+    if(MTX_UNLOCK_CALL(cq->mutex) != 0)
+        LOG_CRITICAL("error unlocking mutex %p\n", (void*) cq->mutex);
+    return head;
+}
+
+int conc_lqueue_splice(conc_lqueue_t* cq, node_t* head, node_t* tail, int count) {
+    if(!cq) return -1;
+    int err = 0;
+    MTX_LOCK_RET(cq->mutex);
+    if((err = lqueue_splice_tail(cq->q, head, tail, count)) != 0) {
+        LOG_NEVER("error in concurrent splice %p: %d\n", (void*) cq, err);
+        MTX_UNLOCK_RET(cq->mutex);
+        return err;
+    }
+    CONC_LQUEUE_SYNC_SIZE(cq);
+    COND_BROADCAST_RET(cq->produce_event);
+    MTX_UNLOCK_RET(cq->mutex);
+    return err;
+}
@@ -2,14 +2,22 @@
 #define _CONC_LQUEUE_H
 
 #include <pthread.h>
+#include "lock.h"
 #include "lqueue.h"
 #include "errno.h"
 #include "signal.h"
 
 typedef struct __conc_lqueue {
-    pthread_mutex_t* mutex;
-    pthread_cond_t* produce_event;
+    lock_t* mutex;
+    lock_cond_t* produce_event;
     lqueue_t* q;
+    /* If set, the element count is published here on every change
+     * so that it can be read without taking the mutex */
+    long* size_mirror;
+    /* If set, called with the new count on every change, with the
+     * mutex held: it must be short and must not touch the queue */
+    void (*notify)(void* arg, long count);
+    void* notify_arg;
 } conc_lqueue_t;
 
 /* Error code for closed buffer */
@@ -17,6 +25,14 @@ typedef struct __conc_lqueue {
 #define ELQUEUEEMPTY EWOULDBLOCK
 #define ELQUEUEABORTED -123
 
+/* Publish the count to the size mirror and the notify callback.
+ * Must hold the queue mutex */
+#define CONC_LQUEUE_SYNC_SIZE(cq) { if((cq)->size_mirror != NULL) \
+    {__atomic_store_n((cq)->size_mirror, (long) (cq)->q->count, \
+                      __ATOMIC_RELEASE);} \
+    if((cq)->notify != NULL) \
+    {(cq)->notify((cq)->notify_arg, (long) (cq)->q->count);} }
+
 #define CONC_LQUEUE_ASSERT_EXISTS(q) if(q == NULL) \
     {ERR_DIE("expected a queue to be allocated: %p\n", (void*) q);}
 
@@ -41,6 +57,14 @@ int conc_lqueue_close(conc_lqueue_t* cq);
 /* Get the number of elements enqueued */
 long conc_lqueue_getsize(conc_lqueue_t* cq);
 
+/* Keep *dst updated with the number of elements enqueued */
+int conc_lqueue_mirror_size(conc_lqueue_t* cq, long* dst);
+
+/* Call notify(arg, count) every time the number of elements changes.
+ * A NULL notify stops the calls */
+int conc_lqueue_set_notify(conc_lqueue_t* cq,
+                           void (*notify)(void* arg, long count), void* arg);
+
 /* Returns NULL on failure */
 conc_lqueue_t* conc_lqueue_init();
 
@@ -53,4 +77,11 @@ void conc_lqueue_free(conc_lqueue_t* cq);
  * and store the result in val */
 int conc_lqueue_remove_index(conc_lqueue_t* cq, void** val, int ind);
 
+/* Atomically detach every element from the queue.
+ * Returns the head of the detached list and stores its length in count */
+node_t* conc_lqueue_take_all(conc_lqueue_t* cq, int* count);
+
+/* Append a linked list of count elements in a single locked pass */
+int conc_lqueue_splice(conc_lqueue_t* cq, node_t* head, node_t* tail, int count);
+
 #endif
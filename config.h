@@ -5,25 +5,127 @@
 #define UNIX_MAX_PATH 108
 
 #define DEFAULT_SOCK_PATH "./orders.sock"
+// Where the manager answers queue size history queries
+#define DEFAULT_TSDB_SOCK_PATH "./tsdb.sock"
+// Where the manager serves its metrics in the Prometheus text format,
+// and the loopback TCP port to serve them on too, 0 for none
+#define DEFAULT_METRICS_SOCK_PATH "./metrics.sock"
+#define DEFAULT_METRICS_PORT 0
 #define DEFAULT_CONFIG_PATH "./config.ini"
 #define DEFAULT_LOG_PATH "./supermarket.log"
+// Live counters of the supermarket, read by smstat
+#define DEFAULT_STATS_PATH "./supermarket.stats"
+// Chrome trace JSON written at exit by the supermarket and by the
+// manager, empty for no tracing, and events kept per thread
+#define DEFAULT_TRACE_PATH ""
+#define DEFAULT_MANAGER_TRACE_PATH ""
+#define DEFAULT_TRACE_EVENTS 16384
+// Flight recorders of the supermarket and of the manager, read by
+// flightdump, empty for none, and events kept per thread
+#define DEFAULT_FLIGHT_PATH "./supermarket.flight"
+#define DEFAULT_MANAGER_FLIGHT_PATH "./manager.flight"
+#define DEFAULT_FLIGHT_EVENTS 1024
+// Flight recorder rings beyond one per customer thread or carrier, per
+// cashier and per manager worker, for every other thread
+#define FLIGHT_SPARE_RINGS 16
+// Shards of the counters of totals, threads beyond share them
+#define COUNTER_SHARDS 64
+// Counter slots in the stats segment, one per counter shard
+#define STATS_SLOTS COUNTER_SHARDS
+// Times the adaptive and ticket locks check the lock before parking
+#define LOCK_SPIN 100
 #define DEFAULT_MAX_CONN_ATTEMPTS 10
 #define DEFAULT_CONN_ATTEMPT_DELAY 500
 #define DEFAULT_NUM_CASHIERS 2
 #define DEFAULT_CUST_CAP 20 
 #define DEFAULT_CUST_BATCH 5
-#define DEFAULT_CASHIER_POLL_TIME 80
+// Queue size reports: at least min_interval ms apart, sent when a
+// queue crosses a policy treshold or moves by delta customers, when its
+// estimated wait crosses slo_p95_wait or moves by wait_band ms, and
+// after idle ms anyway
+#define DEFAULT_QUEUE_REPORT_MIN_INTERVAL 10
+#define DEFAULT_QUEUE_REPORT_DELTA 2
+#define DEFAULT_QUEUE_REPORT_WAIT_BAND 100
+#define DEFAULT_QUEUE_REPORT_IDLE 1000
 #define DEFAULT_TIME_PER_PROD 4
 #define DEFAULT_MAX_SHOPPING_TIME 500
 #define DEFAULT_PRODUCT_CAP 80 
 #define DEFAULT_SUPERMARKET_POLL_TIME 10
 #define DEFAULT_INITIAL_OPEN_CASHIERS 1
+// Carrier threads running the customers as coroutines.
+// 0 runs every customer on its own thread
+#define DEFAULT_CORO_CARRIERS 0
+// Stack size of a customer coroutine in KiB
+#define DEFAULT_CORO_STACK_SIZE 64
+// Threads applying the exit confirmations from the manager. Cashier
+// commands always get one more dispatcher of their own
+#define DEFAULT_INMSG_DISPATCHERS 2
+// Parsed messages each dispatcher can have pending
+#define DEFAULT_INMSG_RING_SIZE 256
+// Frames read from the socket with a single call
+#define INMSG_READ_FRAMES 64
+// Longest time in ms an exit request waits to be sent in a batch
+#define DEFAULT_EXIT_BATCH_WINDOW 5
+// Exit requests that fill a batch
+#define DEFAULT_EXIT_BATCH_MAX 32
+// IDs that always fit in a single message
+#define EXIT_BATCH_MAX_IDS 128
+// Exits the manager lets the supermarket approve on its own per lease.
+// 0 never grants a lease, every exit is confirmed by the manager
+#define DEFAULT_EXIT_LEASE_QUOTA 64
+// Duration in ms of an exit lease
+#define DEFAULT_EXIT_LEASE_MS 1000
 // Number of cashiers with <= 1 enqueued customer
 // necessary to close a cash register
 #define DEFAULT_UNDERCROWDED_CASH_TRESHOLD 2
 // Number of customers enqueued to a single cashier
 // necessary to open another one
 #define DEFAULT_OVERCROWDED_CASH_TRESHOLD 10
+// snapshot acts on the last queue sizes (S1/S2), smooth on their
+// EWMA with separate open and close tresholds and cooldowns, slo on
+// the estimated waits against a p95 target, predict as slo sizing the
+// cashiers for the forecast load as well
+#define DEFAULT_SCALING_POLICY "snapshot"
+// Weight in the EWMA of a queue size held for a scaling_ewma_period
+#define DEFAULT_SCALING_EWMA_ALPHA 0.3
+// ms a queue size has to last to weigh alpha in its EWMA
+#define DEFAULT_SCALING_EWMA_PERIOD 100
+// Smoothed queue size at which to open another cashier
+#define DEFAULT_SCALING_OPEN_TRESHOLD 10.0
+// Smoothed queue size at which a cashier counts as undercrowded
+#define DEFAULT_SCALING_CLOSE_TRESHOLD 1.0
+// ms a cashier is left alone after being opened or closed
+#define DEFAULT_SCALING_COOLDOWN 2000
+// ms the p95 of the estimated waits should stay under
+#define DEFAULT_SLO_P95_WAIT 500
+// A cashier closes only if the average wait would stay within this
+// share of the target
+#define DEFAULT_SLO_CLOSE_FRACTION 0.5
+// ms between two samples of the load at least
+#define DEFAULT_FORECAST_INTERVAL 250
+// ms ahead to size the cashiers for, about what a new cashier and the
+// report that asks for it take
+#define DEFAULT_FORECAST_HORIZON 2000
+// Holt smoothing weights of the arrival rate level and trend
+#define DEFAULT_FORECAST_ALPHA 0.5
+#define DEFAULT_FORECAST_BETA 0.3
+// Load samples kept by the manager per supermarket
+#define FORECAST_HISTORY 256
+// Customers the manager lets wait in line per open cashier before
+// slowing down admissions. 0 never limits admissions
+#define DEFAULT_ADMISSION_BACKLOG 0
+// Customers the supermarket may let in at once
+#define DEFAULT_ADMISSION_BURST 10
+// An entry rate is pushed at most this often, in ms
+#define ADMISSION_MIN_INTERVAL 100
+// Queue size history: blocks of TSDB_BLOCK_BYTES kept per cashier,
+// the oldest block is dropped when they are all full
+#define DEFAULT_TSDB_BLOCKS 16
+#define TSDB_BLOCK_BYTES 256
+// How often, in ms, the local query thread checks for shutdown
+#define QUERY_POLL_INTERVAL 200
+// History, metrics over a unix socket and over TCP
+#define QUERY_LISTENERS 3
 
 #define CASHIER_START_TIME_MIN 20
 #define CASHIER_START_TIME_MAX 80
@@ -46,11 +148,33 @@
 #define MSG_CONN_ESTABLISHED "conn_established\n"
 #define MSG_CASH_HEADER "cash"
 #define MSG_QUEUE_SIZE "queue_size"
+// Followed by cashier ID, queue size and estimated wait in ms,
+// for the changed ones
+#define MSG_QUEUE_DELTA "queue_delta"
+// Sent by the manager, followed by the customers per second the
+// supermarket may let in, negative for no limit, and the burst
+#define MSG_ADMISSION "admission"
+// Followed by the customers that joined a line, the customers served
+// and the ms spent serving them since the supermarket started
+#define MSG_QUEUE_LOAD "queue_load"
 #define MSG_CUST_HEADER "cust"
 // Request when customer wants to exit
 #define MSG_WANT_OUT "want_out"
 // Customer exit confirmation
 #define MSG_GET_OUT "get_out"
+// Many customers at once: followed by want_out or get_out and the
+// space separated customer IDs. Shares its prefix with MSG_CUST_HEADER,
+// so it must be matched first
+#define MSG_CUST_BATCH_HEADER "cust_batch"
+// Exit leases. The manager sends grant followed by the quota and the
+// duration in ms, or revoke. The supermarket sends report followed by
+// the IDs of customers it let out, and return with the last ones when
+// the lease is over
+#define MSG_LEASE_HEADER "exit_lease"
+#define MSG_LEASE_GRANT "grant"
+#define MSG_LEASE_REVOKE "revoke"
+#define MSG_LEASE_REPORT "report"
+#define MSG_LEASE_RETURN "return"
 
 #endif // config_h_INCLUDED
 
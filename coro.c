@@ -0,0 +1,327 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <ucontext.h>
+
+#include "util.h"
+#include "coro.h"
+#include "twheel.h"
+
+// Why a coroutine switched back to its carrier
+#define CORO_SWITCH_YIELD 0
+#define CORO_SWITCH_PARK 1
+#define CORO_SWITCH_EXIT 2
+
+// Coroutine running on the calling carrier thread. Coroutines migrate
+// between carriers, so it is only read on entry to the public functions
+// and never cached across a switch
+static __thread coro_t *coro_current = NULL;
+
+// ========== Run queue, scheduler mutex held ==========
+
+static void runq_push_locked(coro_sched_t *s, coro_t *c) {
+    c->next = NULL;
+    if(s->runq_tail == NULL) s->runq_head = c;
+    else s->runq_tail->next = c;
+    s->runq_tail = c;
+}
+
+static coro_t* runq_pop_locked(coro_sched_t *s) {
+    coro_t *c = s->runq_head;
+    if(c == NULL) return NULL;
+    s->runq_head = c->next;
+    if(s->runq_head == NULL) s->runq_tail = NULL;
+    c->next = NULL;
+    return c;
+}
+
+// ========== Park/unpark state machine ==========
+
+// Returns true if the caller has to put c in the run queue
+static bool coro_unpark_transition(coro_t *c) {
+    int st = __atomic_load_n(&c->state, __ATOMIC_ACQUIRE);
+    for(;;) {
+        switch(st) {
+        case CORO_RUNNING:
+        case CORO_PARKING:
+            // The carrier requeues a parking coroutine that got notified
+            if(__atomic_compare_exchange_n(&c->state, &st, CORO_NOTIFIED,
+                                           false, __ATOMIC_ACQ_REL,
+                                           __ATOMIC_ACQUIRE))
+                return false;
+            break;
+        case CORO_PARKED:
+            if(__atomic_compare_exchange_n(&c->state, &st, CORO_RUNNING,
+                                           false, __ATOMIC_ACQ_REL,
+                                           __ATOMIC_ACQUIRE))
+                return true;
+            break;
+        default:
+            return false;
+        }
+    }
+}
+
+void coro_unpark(coro_t *c) {
+    coro_sched_t *s = c->sched;
+    if(!coro_unpark_transition(c)) return;
+    MTX_LOCK_DIE(&s->mtx);
+    runq_push_locked(s, c);
+    COND_SIGNAL_DIE(&s->work_event);
+    MTX_UNLOCK_DIE(&s->mtx);
+}
+
+static void coro_switch_to_carrier(coro_t *c, int reason) {
+    c->reason = reason;
+    swapcontext(&c->ctx, c->carrier_ctx);
+}
+
+static void coro_park_self(coro_t *c) {
+    int st = CORO_RUNNING;
+    if(!__atomic_compare_exchange_n(&c->state, &st, CORO_PARKING, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        // Consume the permit left by an earlier unpark
+        __atomic_store_n(&c->state, CORO_RUNNING, __ATOMIC_RELEASE);
+        return;
+    }
+    coro_switch_to_carrier(c, CORO_SWITCH_PARK);
+}
+
+void coro_park(void) {
+    coro_t *c = coro_current;
+    if(c != NULL) coro_park_self(c);
+}
+
+void coro_yield(void) {
+    coro_t *c = coro_current;
+    if(c != NULL) coro_switch_to_carrier(c, CORO_SWITCH_YIELD);
+}
+
+coro_t* coro_self(void) {
+    return coro_current;
+}
+
+static void coro_sleep_fire(void *arg) {
+    coro_t *c = (coro_t *) arg;
+    __atomic_store_n(&c->sleeping, 0, __ATOMIC_RELEASE);
+    coro_unpark(c);
+}
+
+int coro_sleep(long msec) {
+    coro_t *c = coro_current;
+    twheel_t *tw;
+    struct timespec ts;
+    if(c == NULL) return msleep(msec);
+    tw = c->sched->timers;
+    // The wheel released every sleeper on shutdown: the carrier sleeps,
+    // so that loops sleeping again do not spin
+    if(twheel_cancelled(tw)) {
+        ts.tv_sec = msec / 1000;
+        ts.tv_nsec = (msec % 1000) * 1000000;
+        while(nanosleep(&ts, &ts) != 0 && errno == EINTR);
+        return 0;
+    }
+    __atomic_store_n(&c->sleeping, 1, __ATOMIC_RELAXED);
+    if(twheel_add(tw, &c->sleep_timer, msec, coro_sleep_fire, c) != 0) {
+        __atomic_store_n(&c->sleeping, 0, __ATOMIC_RELAXED);
+        return -1;
+    }
+    // Unrelated unparks may wake the coroutine early
+    while(__atomic_load_n(&c->sleeping, __ATOMIC_ACQUIRE))
+        coro_park_self(c);
+    // The callback may still be using the timer
+    twheel_cancel(tw, &c->sleep_timer);
+    if(c->sleep_timer.cancelled) {
+        errno = ECANCELED;
+        return -1;
+    }
+    return 0;
+}
+
+// ========== Carriers ==========
+
+// Drop a reference, freeing the coroutine with the last one
+static void coro_unref(coro_t *c) {
+    if(__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    free(c->stack);
+    free(c);
+}
+
+static void coro_entry(void) {
+    coro_t *c = coro_current;
+    c->fn(c->arg);
+    __atomic_store_n(&c->state, CORO_DONE, __ATOMIC_RELEASE);
+    coro_switch_to_carrier(c, CORO_SWITCH_EXIT);
+}
+
+// Run c until it switches back, then act on the reason it gave
+static void coro_run(coro_sched_t *s, coro_t *c, ucontext_t *carrier_ctx) {
+    int st = CORO_PARKING;
+    coro_current = c;
+    c->carrier_ctx = carrier_ctx;
+    swapcontext(carrier_ctx, &c->ctx);
+    coro_current = NULL;
+
+    switch(c->reason) {
+    case CORO_SWITCH_YIELD:
+        MTX_LOCK_DIE(&s->mtx);
+        runq_push_locked(s, c);
+        MTX_UNLOCK_DIE(&s->mtx);
+        break;
+    case CORO_SWITCH_PARK:
+        // Off its stack now: publish PARKED unless an unpark raced in
+        if(__atomic_compare_exchange_n(&c->state, &st, CORO_PARKED, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
+        __atomic_store_n(&c->state, CORO_RUNNING, __ATOMIC_RELEASE);
+        MTX_LOCK_DIE(&s->mtx);
+        runq_push_locked(s, c);
+        MTX_UNLOCK_DIE(&s->mtx);
+        break;
+    case CORO_SWITCH_EXIT:
+        __atomic_store_n(&c->done, 1, __ATOMIC_RELEASE);
+        futex_wake(&c->done, INT_MAX);
+        // A joiner may free it as soon as done is set
+        coro_unref(c);
+        break;
+    }
+}
+
+static void* coro_carrier(void *arg) {
+    coro_sched_t *s = (coro_sched_t *) arg;
+    ucontext_t carrier_ctx;
+    coro_t *c;
+
+    for(;;) {
+        MTX_LOCK_DIE(&s->mtx);
+        while((c = runq_pop_locked(s)) == NULL && !s->stop)
+            COND_WAIT_DIE(&s->work_event, &s->mtx);
+        MTX_UNLOCK_DIE(&s->mtx);
+        if(c == NULL) break;
+        coro_run(s, c, &carrier_ctx);
+    }
+    return NULL;
+}
+
+coro_sched_t* coro_sched_init(int num_carriers, size_t stack_size,
+                              twheel_t *timers) {
+    coro_sched_t *s;
+    if(num_carriers <= 0) return NULL;
+    if((s = calloc(1, sizeof(coro_sched_t))) == NULL) return NULL;
+    s->num_carriers = num_carriers;
+    s->stack_size = stack_size < CORO_MIN_STACK_SIZE
+        ? CORO_MIN_STACK_SIZE : stack_size;
+    if(lock_init(&s->mtx) != 0) {
+        free(s);
+        return NULL;
+    }
+    if(lock_cond_init(&s->work_event) != 0) {
+        lock_destroy(&s->mtx);
+        free(s);
+        return NULL;
+    }
+    s->timers = timers;
+    if(timers == NULL) {
+        s->own_timers = 1;
+        if((s->timers = twheel_init()) == NULL) {
+            s->own_timers = 0;
+            coro_sched_destroy(s);
+            return NULL;
+        }
+    }
+    if((s->carriers = calloc(num_carriers, sizeof(pthread_t))) == NULL) {
+        coro_sched_destroy(s);
+        return NULL;
+    }
+    for(int i = 0; i < num_carriers; i++) {
+        if(pthread_create(&s->carriers[i], NULL, coro_carrier, s) != 0) {
+            ERR("Creating coroutine carrier %d\n", i);
+            s->num_carriers = i;
+            coro_sched_destroy(s);
+            return NULL;
+        }
+    }
+    return s;
+}
+
+void coro_sched_destroy(coro_sched_t *s) {
+    if(s == NULL) return;
+    MTX_LOCK_DIE(&s->mtx);
+    s->stop = 1;
+    lock_cond_broadcast(&s->work_event);
+    MTX_UNLOCK_DIE(&s->mtx);
+    for(int i = 0; s->carriers != NULL && i < s->num_carriers; i++)
+        pthread_join(s->carriers[i], NULL);
+    lock_cond_destroy(&s->work_event);
+    lock_destroy(&s->mtx);
+    if(s->own_timers) twheel_destroy(s->timers);
+    free(s->carriers);
+    free(s);
+}
+
+// Point c at fn(arg), reusing its stack, and make it runnable
+static int coro_start(coro_t *c, void* (*fn)(void*), void *arg) {
+    coro_sched_t *s = c->sched;
+    if(getcontext(&c->ctx) != 0) return -1;
+    c->ctx.uc_stack.ss_sp = c->stack;
+    c->ctx.uc_stack.ss_size = c->stack_size;
+    c->ctx.uc_link = NULL;
+    makecontext(&c->ctx, coro_entry, 0);
+    c->fn = fn;
+    c->arg = arg;
+    c->sleeping = 0;
+    __atomic_store_n(&c->done, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&c->state, CORO_RUNNING, __ATOMIC_RELEASE);
+    // Held by the carrier that ends up running it
+    __atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+
+    MTX_LOCK_DIE(&s->mtx);
+    runq_push_locked(s, c);
+    COND_SIGNAL_DIE(&s->work_event);
+    MTX_UNLOCK_DIE(&s->mtx);
+    return 0;
+}
+
+coro_t* coro_spawn(coro_sched_t *s, void* (*fn)(void*), void *arg) {
+    coro_t *c = calloc(1, sizeof(coro_t));
+    if(c == NULL) return NULL;
+    // Stacks come from malloc: only the pages a coroutine touches get
+    // backed, and no extra mapping is created per coroutine
+    if((c->stack = malloc(s->stack_size)) == NULL) {
+        free(c);
+        return NULL;
+    }
+    c->stack_size = s->stack_size;
+    c->sched = s;
+    c->refs = 1;
+    if(coro_start(c, fn, arg) != 0) {
+        coro_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+int coro_respawn(coro_t *c, void* (*fn)(void*), void *arg) {
+    if(__atomic_load_n(&c->done, __ATOMIC_ACQUIRE) == 0) {
+        errno = EBUSY;
+        return -1;
+    }
+    return coro_start(c, fn, arg);
+}
+
+void coro_join(coro_t *c) {
+    if(c == NULL) return;
+    while(__atomic_load_n(&c->done, __ATOMIC_ACQUIRE) == 0)
+        futex_wait(&c->done, 0, -1);
+}
+
+void coro_free(coro_t *c) {
+    if(c == NULL) return;
+    coro_unref(c);
+}
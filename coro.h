@@ -0,0 +1,111 @@
+#ifndef coro_h_INCLUDED
+#define coro_h_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include "twheel.h"
+
+// Stackful coroutines multiplexed over a small pool of carrier threads
+// (M:N scheduling). Blocking code written for threads keeps working:
+// inside a coroutine, msleep and the customer state waits park the
+// coroutine and let the carrier run another one instead of blocking it.
+
+#define CORO_MIN_STACK_SIZE (16 * 1024)
+
+// Coroutine run states
+typedef enum coro_state_e {
+    CORO_RUNNING,   // 0 - Running or waiting in the run queue
+    CORO_NOTIFIED,  // 1 - Running with an unpark permit pending
+    CORO_PARKING,   // 2 - Switching back to the carrier to park
+    CORO_PARKED,    // 3 - Parked, only coro_unpark makes it runnable
+    CORO_DONE       // 4 - Returned from its function
+} coro_state_t;
+
+struct coro_sched_s;
+
+typedef struct coro_s {
+    ucontext_t ctx;
+    // Context of the carrier currently running the coroutine
+    ucontext_t *carrier_ctx;
+    void *stack;
+    size_t stack_size;
+    void* (*fn)(void*);
+    void *arg;
+    struct coro_sched_s *sched;
+    // coro_state_t, changed with CAS by the coroutine and its wakers
+    int state;
+    // Why the coroutine switched back to its carrier
+    int reason;
+    // Armed by coro_sleep, clears sleeping and unparks
+    twheel_timer_t sleep_timer;
+    int sleeping;
+    // Set to 1 once finished, coro_join blocks on it
+    uint32_t done;
+    // The owner's reference, plus one while a carrier runs it, dropped
+    // after the carrier wakes the joiners
+    uint32_t refs;
+    // Next in the run queue
+    struct coro_s *next;
+} coro_t;
+
+typedef struct coro_sched_s {
+    lock_t mtx;
+    lock_cond_t work_event;
+    coro_t *runq_head;
+    coro_t *runq_tail;
+    // Timing wheel the coroutines sleep on
+    twheel_t *timers;
+    int own_timers;
+    int stop;
+    int num_carriers;
+    pthread_t *carriers;
+    size_t stack_size;
+} coro_sched_t;
+
+/* Start num_carriers carrier threads. Coroutines get stack_size bytes
+ * of stack each and sleep on timers, or on a private wheel if NULL.
+ * Returns NULL on failure */
+coro_sched_t* coro_sched_init(int num_carriers, size_t stack_size,
+                              twheel_t *timers);
+
+/* Stop and join the carriers. Every coroutine must have been joined */
+void coro_sched_destroy(coro_sched_t *s);
+
+/* Create a coroutine running fn(arg) and make it runnable.
+ * Returns NULL on failure */
+coro_t* coro_spawn(coro_sched_t *s, void* (*fn)(void*), void *arg);
+
+/* Run fn(arg) again on a finished coroutine, reusing its memory. The
+ * caller makes sure nobody can still coro_unpark the previous run: its
+ * unpark would wake the new one */
+int coro_respawn(coro_t *c, void* (*fn)(void*), void *arg);
+
+/* Wait from a plain thread until the coroutine has returned */
+void coro_join(coro_t *c);
+
+/* Release a finished coroutine. Its memory goes once the carrier that
+ * ran it is done with it as well */
+void coro_free(coro_t *c);
+
+/* Coroutine running on the calling thread, NULL outside coroutines */
+coro_t* coro_self(void);
+
+/* Give the carrier to the next runnable coroutine */
+void coro_yield(void);
+
+/* Suspend the calling coroutine until coro_unpark is called on it.
+ * An unpark that comes first is remembered, and park may also return
+ * spuriously, so callers must recheck their condition in a loop */
+void coro_park(void);
+
+/* Make a parked coroutine runnable, or leave it a permit */
+void coro_unpark(coro_t *c);
+
+/* Park the calling coroutine for msec milliseconds. Returns -1 with
+ * errno set to ECANCELED if the timing wheel got cancelled meanwhile.
+ * Once it is, the carrier sleeps instead */
+int coro_sleep(long msec);
+
+#endif // coro_h_INCLUDED
@@ -0,0 +1,51 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "util.h"
+#include "counter.h"
+
+static __thread int thread_shard = -1;
+static int next_shard = 0;
+
+int counter_shard(void) {
+    if(thread_shard < 0)
+        thread_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED)
+            % COUNTER_SHARDS;
+    return thread_shard;
+}
+
+counter_t* counter_init(void) {
+    counter_t *c = calloc(1, sizeof(counter_t));
+    void *shards = NULL;
+    if(c == NULL) return NULL;
+    if(posix_memalign(&shards, CACHE_LINE_SIZE,
+                      COUNTER_SHARDS * CACHE_LINE_SIZE) != 0) {
+        free(c);
+        return NULL;
+    }
+    memset(shards, 0, COUNTER_SHARDS * CACHE_LINE_SIZE);
+    c->shards = shards;
+    return c;
+}
+
+void counter_destroy(counter_t *c) {
+    if(c == NULL) return;
+    free(c->shards);
+    free(c);
+}
+
+uint64_t counter_ticket(counter_t *c) {
+    int shard = counter_shard();
+    uint64_t seq = __atomic_fetch_add(&c->shards[shard * COUNTER_STRIDE], 1,
+                                      __ATOMIC_RELAXED);
+    return seq * COUNTER_SHARDS + shard;
+}
+
+int64_t counter_read(counter_t *c) {
+    int64_t sum = 0;
+    for(int i = 0; i < COUNTER_SHARDS; i++)
+        sum += __atomic_load_n(&c->shards[i * COUNTER_STRIDE],
+                               __ATOMIC_RELAXED);
+    return sum;
+}
@@ -0,0 +1,41 @@
+#ifndef counter_h_INCLUDED
+#define counter_h_INCLUDED
+
+#include <stdint.h>
+#include "config.h"
+#include "util.h"
+
+// Total split in COUNTER_SHARDS shards, each on its own cache line.
+// A thread always adds to the shard of its slot, picked round robin on
+// its first update, so threads updating the same total do not bounce
+// one line between them. Threads past COUNTER_SHARDS share shards,
+// hence the relaxed atomic adds. Reading sums the shards: the result
+// is exact once the writers are done, and otherwise the total at some
+// instant during the read.
+
+typedef struct counter_s {
+    int64_t *shards;
+} counter_t;
+
+#define COUNTER_STRIDE (CACHE_LINE_SIZE / sizeof(int64_t))
+
+/* Returns NULL on failure */
+counter_t* counter_init(void);
+
+void counter_destroy(counter_t *c);
+
+/* Slot of the calling thread, in [0, COUNTER_SHARDS) */
+int counter_shard(void);
+
+static inline void counter_add(counter_t *c, int64_t n) {
+    __atomic_fetch_add(&c->shards[counter_shard() * COUNTER_STRIDE], n,
+                       __ATOMIC_RELAXED);
+}
+
+/* Add 1 and return a number no other call on c returns. Numbers are
+ * not dense: each shard hands out its own sequence */
+uint64_t counter_ticket(counter_t *c);
+
+int64_t counter_read(counter_t *c);
+
+#endif // counter_h_INCLUDED
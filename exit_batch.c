@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "config.h"
+#include "outmsg.h"
+#include "exit_batch.h"
+
+// Send "header what id..." frames with the IDs, starting another frame
+// whenever the next ID would not fit in this one. The frames before the
+// last say more instead of what. Returns -1 on failure
+static int send_ids(exit_batch_t *b, const char *header, const char *more,
+                    const char *what, const int *ids, int count) {
+    outmsg_t *msg;
+    char idbuf[MSG_SIZE], *frame;
+    const char *w;
+    size_t word = strlen(more) > strlen(what) ? strlen(more) : strlen(what);
+    // Room for the header, either word, the newline and the terminator
+    int room = MSG_SIZE - (int) (strlen(header) + 1 + word) - 2;
+    int len, n, i = 0;
+    // At least one frame, a lease is returned even with no IDs
+    do {
+        if((msg = outmsg_new()) == NULL) return -1;
+        for(len = 0; i < count; i++) {
+            n = snprintf(idbuf + len, sizeof(idbuf) - len, " %d", ids[i]);
+            if(len + n > room) break;
+            len += n;
+        }
+        // Fits, len is at most room
+        w = i < count ? more : what;
+        frame = msg->frame;
+        memcpy(frame, header, strlen(header));
+        frame += strlen(header);
+        *frame++ = ' ';
+        memcpy(frame, w, strlen(w));
+        frame += strlen(w);
+        memcpy(frame, idbuf, len);
+        frame += len;
+        *frame++ = '\n';
+        *frame = '\0';
+        if(outmsg_enqueue(b->outmsgqueue, msg) != 0) return -1;
+    } while(i < count);
+    return 0;
+}
+
+// ========== Batches, batch mutex held ==========
+
+// Send the pending IDs
+static int exit_batch_flush(exit_batch_t *b) {
+    int count = b->count;
+    if(count == 0) return 0;
+    histogram_record(&b->batch_size, count);
+    b->count = 0;
+    return send_ids(b, MSG_CUST_BATCH_HEADER, MSG_WANT_OUT, MSG_WANT_OUT,
+                    b->ids, count);
+}
+
+// ========== Exit leases, batch mutex held ==========
+
+// Send the IDs let out under the lease, what is either MSG_LEASE_REPORT
+// or MSG_LEASE_RETURN
+static int lease_send(exit_batch_t *b, const char *what) {
+    int count = b->lease_count;
+    b->lease_count = 0;
+    // Only the last frame of a return gives the lease back
+    return send_ids(b, MSG_LEASE_HEADER, MSG_LEASE_REPORT, what,
+                    b->lease_ids, count);
+}
+
+static void lease_end(exit_batch_t *b) {
+    b->lease_active = 0;
+    b->lease_quota = 0;
+    lease_send(b, MSG_LEASE_RETURN);
+}
+
+static void lease_timeout(void *arg) {
+    exit_batch_t *b = (exit_batch_t *) arg;
+    uint64_t now = now_ns();
+    MTX_LOCK_DIE(&b->mtx);
+    b->lease_armed = 0;
+    if(b->lease_active) {
+        // A later grant may have pushed the expiry further
+        if(now < b->lease_expires_ns
+           && twheel_add(b->timers, &b->lease_timer,
+                         (b->lease_expires_ns - now + 999999) / 1000000,
+                         lease_timeout, b) == 0)
+            b->lease_armed = 1;
+        else
+            lease_end(b);
+    }
+    MTX_UNLOCK_DIE(&b->mtx);
+}
+
+void exit_batch_lease_grant(exit_batch_t *b, long quota, long msec) {
+    if(quota <= 0 || msec <= 0 || b->timers == NULL) return;
+    MTX_LOCK_DIE(&b->mtx);
+    b->lease_active = 1;
+    b->lease_quota = quota;
+    b->lease_expires_ns = now_ns() + (uint64_t) msec * 1000000ull;
+    b->lease_grants++;
+    // An armed timer re-arms itself for the new expiry
+    if(!b->lease_armed) {
+        if(twheel_add(b->timers, &b->lease_timer, msec, lease_timeout, b) == 0)
+            b->lease_armed = 1;
+        else
+            b->lease_active = 0;
+    }
+    MTX_UNLOCK_DIE(&b->mtx);
+}
+
+void exit_batch_lease_revoke(exit_batch_t *b) {
+    MTX_LOCK_DIE(&b->mtx);
+    b->lease_revokes++;
+    if(b->lease_active) lease_end(b);
+    MTX_UNLOCK_DIE(&b->mtx);
+}
+
+int exit_batch_lease_exit(exit_batch_t *b, int id) {
+    int res = 0;
+    MTX_LOCK_DIE(&b->mtx);
+    if(b->lease_active && b->lease_quota > 0
+       && now_ns() < b->lease_expires_ns) {
+        b->lease_quota--;
+        b->lease_exits++;
+        b->lease_ids[b->lease_count++] = id;
+        if(b->lease_quota == 0)
+            lease_end(b);
+        else if(b->lease_count == EXIT_BATCH_MAX_IDS)
+            lease_send(b, MSG_LEASE_REPORT);
+        res = 1;
+    }
+    MTX_UNLOCK_DIE(&b->mtx);
+    return res;
+}
+
+// ========== Batches ==========
+
+static void exit_batch_timeout(void *arg) {
+    exit_batch_t *b = (exit_batch_t *) arg;
+    MTX_LOCK_DIE(&b->mtx);
+    b->armed = 0;
+    exit_batch_flush(b);
+    MTX_UNLOCK_DIE(&b->mtx);
+}
+
+exit_batch_t* exit_batch_init(conc_lqueue_t *outmsgqueue, twheel_t *timers,
+                              long window, int max) {
+    exit_batch_t *b = calloc(1, sizeof(exit_batch_t));
+    if(b == NULL) return NULL;
+    if(lock_init(&b->mtx) != 0) {
+        free(b);
+        return NULL;
+    }
+    b->max = max < 1 ? 1 : (max > EXIT_BATCH_MAX_IDS ? EXIT_BATCH_MAX_IDS : max);
+    b->window = window;
+    b->timers = timers;
+    b->outmsgqueue = outmsgqueue;
+    histogram_init(&b->batch_size);
+    histogram_init(&b->confirm_us);
+    return b;
+}
+
+void exit_batch_destroy(exit_batch_t *b) {
+    if(b == NULL) return;
+    // The timeout may still be running on the wheel thread
+    if(b->timers != NULL) {
+        twheel_cancel(b->timers, &b->timer);
+        twheel_cancel(b->timers, &b->lease_timer);
+    }
+    lock_destroy(&b->mtx);
+    free(b);
+}
+
+int exit_batch_add(exit_batch_t *b, int id) {
+    int res = 0;
+    MTX_LOCK_RET(&b->mtx);
+    b->ids[b->count++] = id;
+    if(b->count >= b->max || b->window <= 0 || b->timers == NULL) {
+        res = exit_batch_flush(b);
+    } else if(!b->armed) {
+        // First ID of the batch starts the window. A cancelled wheel
+        // means shutdown, nothing is worth waiting for then
+        if(twheel_add(b->timers, &b->timer, b->window,
+                      exit_batch_timeout, b) == 0)
+            b->armed = 1;
+        else
+            res = exit_batch_flush(b);
+    }
+    MTX_UNLOCK_RET(&b->mtx);
+    return res;
+}
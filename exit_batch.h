@@ -0,0 +1,73 @@
+#ifndef exit_batch_h_INCLUDED
+#define exit_batch_h_INCLUDED
+
+#include <pthread.h>
+#include "conc_lqueue.h"
+#include "twheel.h"
+#include "histogram.h"
+#include "config.h"
+
+// Coalesces the exit requests of the customers into a single
+// MSG_CUST_BATCH_HEADER want_out frame. A batch is sent when it holds
+// max IDs or when the window has passed since its first ID was added,
+// whichever comes first. The manager confirms a batch with one frame.
+//
+// While the manager grants an exit lease, customers skip the request
+// altogether: up to quota of them may leave before the lease expires,
+// and their IDs are reported afterwards. The lease is returned when
+// its quota is used or its time is over, and the manager may revoke it
+// at any time.
+typedef struct exit_batch_s {
+    lock_t mtx;
+    int ids[EXIT_BATCH_MAX_IDS];
+    int count;
+    int max;
+    // Longest time in ms an ID waits before being sent
+    long window;
+    // Set while timer is pending for the current batch
+    int armed;
+    twheel_t *timers;
+    twheel_timer_t timer;
+    conc_lqueue_t *outmsgqueue;
+    // Number of IDs in each batch sent
+    histogram_t batch_size;
+    // Microseconds between a customer asking to leave and its confirm
+    histogram_t confirm_us;
+
+    // Set between a grant and the return or revoke of the lease
+    int lease_active;
+    long lease_quota;
+    uint64_t lease_expires_ns;
+    // Customers let out under the lease, not reported yet
+    int lease_ids[EXIT_BATCH_MAX_IDS];
+    int lease_count;
+    int lease_armed;
+    twheel_timer_t lease_timer;
+    // Counters for the log
+    uint64_t lease_grants;
+    uint64_t lease_revokes;
+    uint64_t lease_exits;
+} exit_batch_t;
+
+/* Returns NULL on failure. max is clamped to EXIT_BATCH_MAX_IDS,
+ * a window of 0 sends every request alone */
+exit_batch_t* exit_batch_init(conc_lqueue_t *outmsgqueue, twheel_t *timers,
+                              long window, int max);
+
+void exit_batch_destroy(exit_batch_t *b);
+
+/* Queue the exit request of a customer. Returns -1 if a batch
+ * could not be sent */
+int exit_batch_add(exit_batch_t *b, int id);
+
+/* Let a customer out under the current lease. Returns 1 if it may
+ * leave right away, 0 if it must ask the manager */
+int exit_batch_lease_exit(exit_batch_t *b, int id);
+
+/* Start a lease of quota exits for msec milliseconds */
+void exit_batch_lease_grant(exit_batch_t *b, long quota, long msec);
+
+/* End the lease now, the exits so far are still reported */
+void exit_batch_lease_revoke(exit_batch_t *b);
+
+#endif // exit_batch_h_INCLUDED
@@ -0,0 +1,216 @@
+// on_exit(3) and syscall(2) are not exposed under strict POSIX
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "util.h"
+#include "flight.h"
+
+#define ROUND_UP(n, a) (((n) + (a) - 1) / (a) * (a))
+
+int flight_enabled = 0;
+__thread flight_ring_t *flight_ring = NULL;
+__thread int32_t flight_tid = 0;
+uint64_t flight_mask = 0;
+
+// Set once the calling thread found no free ring
+static __thread int ring_lost = 0;
+
+static flight_header_t *flight_hdr = NULL;
+static pthread_key_t flight_key;
+static int flight_key_created = 0, flight_on_exit = 0;
+// Where the next thread starts looking for a free ring
+static uint32_t flight_next = 0;
+
+// Recorded before the default action, or whatever was there before
+static const int fatal_signals[] = {
+    SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGTERM
+};
+#define FATAL_SIGNALS (sizeof(fatal_signals) / sizeof(fatal_signals[0]))
+static struct sigaction fatal_old[FATAL_SIGNALS];
+
+static const char *type_names[FLIGHT_TYPES][3] = {
+    { "start", "pid", "ring_events" },
+    { "exit", "status", "" },
+    { "fatal", "signal", "addr" },
+    { "signal", "signal", "" },
+    { "cust_state", "customer", "state" },
+    { "service", "cashier", "customer" },
+    { "cashier_open", "cashier", "" },
+    { "cashier_close", "cashier", "served" },
+    { "msg_out", "", "" },
+    { "msg_in", "", "" },
+    { "decide_open", "cashier", "open" },
+    { "decide_close", "cashier", "open" },
+};
+
+static flight_ring_t* ring_at(uint32_t i) {
+    return (flight_ring_t *) ((char *) flight_hdr + flight_hdr->rings_offset
+                              + i * flight_hdr->ring_size);
+}
+
+// Runs when a thread holding a ring exits
+static void flight_ring_release(void *arg) {
+    flight_ring_t *r = (flight_ring_t *) arg;
+    flight_ring = NULL;
+    if(!__atomic_load_n(&flight_enabled, __ATOMIC_ACQUIRE)) return;
+    __atomic_store_n(&r->owner, 0, __ATOMIC_RELEASE);
+}
+
+flight_ring_t* flight_ring_get(void) {
+    uint32_t n = flight_hdr->num_rings,
+             start = __atomic_fetch_add(&flight_next, 1, __ATOMIC_RELAXED);
+    int32_t free_;
+    flight_ring_t *r;
+    if(ring_lost) return NULL;
+    if(flight_tid == 0) flight_tid = syscall(SYS_gettid);
+    for(uint32_t i = 0; i < n; i++) {
+        r = ring_at((start + i) % n);
+        free_ = 0;
+        if(__atomic_load_n(&r->owner, __ATOMIC_RELAXED) == 0
+           && __atomic_compare_exchange_n(&r->owner, &free_, flight_tid,
+                                          false, __ATOMIC_ACQUIRE,
+                                          __ATOMIC_RELAXED)) {
+            pthread_setspecific(flight_key, r);
+            // Stamp the first events of a thread starting late
+            flight_calibrate(r);
+            return flight_ring = r;
+        }
+    }
+    __atomic_fetch_add(&flight_hdr->lost_threads, 1, __ATOMIC_RELAXED);
+    ring_lost = 1;
+    return NULL;
+}
+
+void flight_calibrate(flight_ring_t *r) {
+    __atomic_store_n(&r->calib_ticks, flight_ticks(), __ATOMIC_RELAXED);
+    __atomic_store_n(&r->calib_ns, now_ns(), __ATOMIC_RELAXED);
+}
+
+static void flight_end_calibrate(void) {
+    flight_hdr->end_ticks = flight_ticks();
+    flight_hdr->end_ns = now_ns();
+}
+
+static void flight_at_exit(int status, void *arg) {
+    if(!__atomic_load_n(&flight_enabled, __ATOMIC_ACQUIRE)) return;
+    flight_record(FLIGHT_EXIT, status, 0);
+    flight_end_calibrate();
+    flight_hdr->exit_status = status;
+    __atomic_store_n(&flight_hdr->exited, 1, __ATOMIC_RELEASE);
+}
+
+// Only touches the mapping, and a ring the thread already holds
+static void flight_fatal(int sig, siginfo_t *info, void *ctx) {
+    // Sent signals have no address
+    int fault = info->si_code > 0;
+    uint64_t addr = fault ? (uint64_t) info->si_addr : 0;
+    size_t i;
+    if(__atomic_load_n(&flight_enabled, __ATOMIC_ACQUIRE)) {
+        if(flight_ring != NULL) flight_record(FLIGHT_FATAL, sig, addr);
+        flight_end_calibrate();
+        flight_hdr->fatal_tid = syscall(SYS_gettid);
+        flight_hdr->fatal_fault = fault;
+        flight_hdr->fatal_addr = addr;
+        __atomic_store_n(&flight_hdr->fatal_signal, sig, __ATOMIC_RELEASE);
+    }
+    for(i = 0; i < FATAL_SIGNALS && fatal_signals[i] != sig; i++);
+    if(i < FATAL_SIGNALS) sigaction(sig, &fatal_old[i], NULL);
+    // A fault happens again on return, a sent signal has to be raised
+    if(!fault) raise(sig);
+}
+
+int flight_init(const char *path, const char *process_name,
+                long ring_events, int num_rings) {
+    uint64_t cap = 1;
+    size_t ring_size, rings_offset, flight_size;
+    struct sigaction sa;
+    int fd;
+    if(ring_events <= 0 || num_rings <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    while(cap < (uint64_t) ring_events) cap <<= 1;
+    ring_size = sizeof(flight_ring_t) + cap * sizeof(flight_event_t);
+    rings_offset = ROUND_UP(sizeof(flight_header_t), CACHE_LINE_SIZE);
+    flight_size = rings_offset + num_rings * ring_size;
+    if(!flight_key_created) {
+        if(pthread_key_create(&flight_key, flight_ring_release) != 0)
+            return -1;
+        flight_key_created = 1;
+    }
+
+    // A new file, so a reader of the old one never sees it shrink
+    unlink(path);
+    if((fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644)) == -1) return -1;
+    if(ftruncate(fd, flight_size) == -1) goto flight_init_fail;
+    flight_hdr = mmap(NULL, flight_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+    if(flight_hdr == MAP_FAILED) goto flight_init_fail;
+    close(fd);
+
+    flight_hdr->num_rings = num_rings;
+    flight_hdr->ring_events = cap;
+    flight_hdr->num_types = FLIGHT_TYPES;
+    flight_hdr->event_size = sizeof(flight_event_t);
+    flight_hdr->rings_offset = rings_offset;
+    flight_hdr->ring_size = ring_size;
+    flight_hdr->pid = getpid();
+    strncpy(flight_hdr->process, process_name, FLIGHT_NAME_LEN - 1);
+    flight_hdr->start_ticks = flight_ticks();
+    flight_hdr->start_ns = now_ns();
+    for(int t = 0; t < FLIGHT_TYPES; t++) {
+        strncpy(flight_hdr->names[t], type_names[t][0], FLIGHT_NAME_LEN - 1);
+        strncpy(flight_hdr->args[t][0], type_names[t][1],
+                FLIGHT_NAME_LEN - 1);
+        strncpy(flight_hdr->args[t][1], type_names[t][2],
+                FLIGHT_NAME_LEN - 1);
+        flight_hdr->text[t] = t == FLIGHT_MSG_OUT || t == FLIGHT_MSG_IN;
+    }
+    flight_hdr->version = FLIGHT_VERSION;
+    // Readers check the magic last written
+    __atomic_store_n(&flight_hdr->magic, FLIGHT_MAGIC, __ATOMIC_RELEASE);
+    flight_mask = cap - 1;
+    __atomic_store_n(&flight_enabled, 1, __ATOMIC_RELEASE);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = flight_fatal;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    for(size_t i = 0; i < FATAL_SIGNALS; i++)
+        sigaction(fatal_signals[i], &sa, &fatal_old[i]);
+    if(!flight_on_exit && on_exit(flight_at_exit, NULL) == 0)
+        flight_on_exit = 1;
+    flight_record(FLIGHT_START, flight_hdr->pid, cap);
+    return 0;
+
+flight_init_fail:
+    close(fd);
+    unlink(path);
+    flight_hdr = NULL;
+    return -1;
+}
+
+void flight_destroy(int status) {
+    if(!__atomic_load_n(&flight_enabled, __ATOMIC_ACQUIRE)) return;
+    for(size_t i = 0; i < FATAL_SIGNALS; i++)
+        sigaction(fatal_signals[i], &fatal_old[i], NULL);
+    flight_record(FLIGHT_EXIT, status, 0);
+    flight_end_calibrate();
+    flight_hdr->exit_status = status;
+    __atomic_store_n(&flight_hdr->closed, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&flight_enabled, 0, __ATOMIC_RELEASE);
+    // Neither unmapped nor forgotten: a thread that saw recording on
+    // may still write its event, or be in a signal handler
+    // The main thread may record again after another flight_init
+    flight_ring = NULL;
+}
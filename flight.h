@@ -0,0 +1,169 @@
+#ifndef flight_h_INCLUDED
+#define flight_h_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "util.h"
+
+// Always-on flight recorder. Each thread appends fixed size binary
+// events to a ring of its own in a file mapped shared, so the latest
+// events are still in the file when the process dies, whether from
+// exit(), a fatal signal or SIGKILL. flightdump prints them.
+//
+// A thread takes a free ring on its first event and gives it back when
+// it exits, without a lock. Recording is a handful of stores: events
+// are stamped with the TSC where there is one, and every ring now and
+// then writes down a TSC and CLOCK_MONOTONIC pair for the decoder to
+// convert them. Events of threads that find no free ring are dropped
+// and counted.
+//
+// The file is self describing: the header has the layout and the names
+// of the event types and their arguments. A ring may be overwritten
+// while it is read, the decoder drops the oldest event of a full ring.
+
+#define FLIGHT_MAGIC 0x534d4652u
+#define FLIGHT_VERSION 2
+#define FLIGHT_NAME_LEN 16
+// A ring writes down a calibration pair every this many events
+#define FLIGHT_CALIB_EVERY 256
+
+typedef enum flight_type_e {
+    // pid, and the ring events of the file
+    FLIGHT_START,
+    // Exit status, recorded by flight_destroy or the thread calling exit()
+    FLIGHT_EXIT,
+    // Fatal signal, and the faulting address
+    FLIGHT_FATAL,
+    // Signal received and handled
+    FLIGHT_SIGNAL,
+    // Customer and the customer_state_t it moved to
+    FLIGHT_CUST_STATE,
+    // Cashier and the customer it serves, cashier and customers served
+    FLIGHT_SERVICE,
+    FLIGHT_CASHIER_OPEN,
+    FLIGHT_CASHIER_CLOSE,
+    // First 16 bytes of a frame sent or received
+    FLIGHT_MSG_OUT,
+    FLIGHT_MSG_IN,
+    // Policy decisions of the manager: cashier, open cashiers after it
+    FLIGHT_DECIDE_OPEN,
+    FLIGHT_DECIDE_CLOSE,
+    FLIGHT_TYPES
+} flight_type_t;
+
+typedef struct flight_event_s {
+    uint64_t ticks;
+    int32_t tid;
+    uint32_t type;
+    // Two arguments, or 16 bytes of text
+    int64_t a;
+    int64_t b;
+} flight_event_t;
+
+typedef struct flight_ring_s {
+    // Thread holding the ring, 0 if free
+    int32_t owner;
+    uint32_t reserved;
+    // Events written so far, only written by the holder
+    uint64_t head;
+    // Last calibration pair
+    uint64_t calib_ticks;
+    uint64_t calib_ns;
+    char pad[32];
+    flight_event_t events[];
+} flight_ring_t;
+
+typedef struct flight_header_s {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_rings;
+    // Power of two
+    uint32_t ring_events;
+    uint32_t num_types;
+    uint32_t event_size;
+    uint64_t rings_offset;
+    // Bytes between two rings
+    uint64_t ring_size;
+    int64_t pid;
+    char process[FLIGHT_NAME_LEN];
+    // Calibration pairs taken at start and at exit
+    uint64_t start_ticks;
+    uint64_t start_ns;
+    uint64_t end_ticks;
+    uint64_t end_ns;
+    // 1 once flight_destroy ran, 1 once exit() ran, and their status
+    int32_t closed;
+    int32_t exited;
+    int32_t exit_status;
+    // Fatal signal, thread and address, 0 if none
+    int32_t fatal_signal;
+    int32_t fatal_tid;
+    uint32_t lost_threads;
+    // 1 if the signal was a fault, whose address may well be 0, rather
+    // than sent by a process
+    int32_t fatal_fault;
+    uint64_t fatal_addr;
+    char names[FLIGHT_TYPES][FLIGHT_NAME_LEN];
+    // Argument names, empty if unused
+    char args[FLIGHT_TYPES][2][FLIGHT_NAME_LEN];
+    // 1 if the arguments hold text
+    uint8_t text[FLIGHT_TYPES];
+} flight_header_t;
+
+extern int flight_enabled;
+extern __thread flight_ring_t *flight_ring;
+extern __thread int32_t flight_tid;
+extern uint64_t flight_mask;
+
+static inline uint64_t flight_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+/* Ring of the calling thread, taking a free one. NULL if none */
+flight_ring_t* flight_ring_get(void);
+
+void flight_calibrate(flight_ring_t *r);
+
+/* Record an event. No-op unless recording */
+static inline void flight_record(flight_type_t type, int64_t a, int64_t b) {
+    flight_ring_t *r;
+    flight_event_t *e;
+    if(!__atomic_load_n(&flight_enabled, __ATOMIC_RELAXED)) return;
+    if((r = flight_ring) == NULL && (r = flight_ring_get()) == NULL) return;
+    if((r->head & (FLIGHT_CALIB_EVERY - 1)) == 0) flight_calibrate(r);
+    e = &r->events[r->head & flight_mask];
+    e->ticks = flight_ticks();
+    e->tid = flight_tid;
+    e->type = type;
+    e->a = a;
+    e->b = b;
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Record the first 16 bytes of text, zero padded */
+static inline void flight_record_text(flight_type_t type, const char *text) {
+    int64_t ab[2] = {0, 0};
+    if(!__atomic_load_n(&flight_enabled, __ATOMIC_RELAXED)) return;
+    memcpy(ab, text, strnlen(text, sizeof(ab)));
+    flight_record(type, ab[0], ab[1]);
+}
+
+/* Start recording to path, replacing any previous recording, keeping
+ * the last ring_events events (rounded up to a power of two) of up to
+ * num_rings threads at once. Also records the exit status and fatal
+ * signals. Returns 0, or -1 on failure */
+int flight_init(const char *path, const char *process_name,
+                long ring_events, int num_rings);
+
+/* Record a shutdown with the exit status the process is about to
+ * return and stop recording. The file is kept, and stays mapped until
+ * the process exits: threads still running may be in the middle of an
+ * event */
+void flight_destroy(int status);
+
+#endif // flight_h_INCLUDED
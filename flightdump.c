@@ -0,0 +1,220 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "util.h"
+#include "flight.h"
+
+// Prints what the flight recorder of a supermarket or a manager kept,
+// after a crash or while it still runs: how the process ended, then the
+// last events of every thread merged in time order, with their time
+// before the last event. The file is only read.
+//
+// usage: flightdump [-n last_events] [-t tid] [flight_path]
+
+typedef struct recording_s {
+    const flight_header_t *hdr;
+    size_t size;
+    // Converts ticks to ns: ns = start_ns + (ticks - start_ticks) * ratio
+    double ratio;
+} recording_t;
+
+static int recording_open(recording_t *rec, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    const flight_header_t *hdr;
+    if(fd == -1) {
+        perror(path);
+        return -1;
+    }
+    if(fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(flight_header_t)) {
+        fprintf(stderr, "%s: not a flight recording\n", path);
+        close(fd);
+        return -1;
+    }
+    hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(hdr == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    if(__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != FLIGHT_MAGIC
+       || hdr->version != FLIGHT_VERSION
+       || hdr->num_types > FLIGHT_TYPES
+       || hdr->event_size != sizeof(flight_event_t)
+       || hdr->ring_events == 0
+       || (hdr->ring_events & (hdr->ring_events - 1)) != 0
+       || hdr->ring_size < sizeof(flight_ring_t)
+          + (uint64_t) hdr->ring_events * sizeof(flight_event_t)
+       || hdr->rings_offset + (uint64_t) hdr->num_rings * hdr->ring_size
+          > (uint64_t) st.st_size) {
+        fprintf(stderr, "%s: not a version %d flight recording\n", path,
+                FLIGHT_VERSION);
+        munmap((void *) hdr, st.st_size);
+        return -1;
+    }
+    rec->hdr = hdr;
+    rec->size = st.st_size;
+    return 0;
+}
+
+static const flight_ring_t* ring_at(recording_t *rec, uint32_t i) {
+    return (const flight_ring_t *) ((const char *) rec->hdr
+                                    + rec->hdr->rings_offset
+                                    + i * rec->hdr->ring_size);
+}
+
+// Ticks per ns from the start and the latest calibration pair, 1 if
+// there is none far enough from the start
+static void recording_calibrate(recording_t *rec) {
+    uint64_t ticks = rec->hdr->end_ticks, ns = rec->hdr->end_ns, t;
+    const flight_ring_t *r;
+    for(uint32_t i = 0; i < rec->hdr->num_rings; i++) {
+        r = ring_at(rec, i);
+        if((t = __atomic_load_n(&r->calib_ticks, __ATOMIC_RELAXED)) > ticks) {
+            ticks = t;
+            ns = __atomic_load_n(&r->calib_ns, __ATOMIC_RELAXED);
+        }
+    }
+    rec->ratio = 1.0;
+    if(ticks > rec->hdr->start_ticks && ns > rec->hdr->start_ns + 1000000)
+        rec->ratio = (double) (ns - rec->hdr->start_ns)
+            / (ticks - rec->hdr->start_ticks);
+}
+
+static double to_ns(recording_t *rec, uint64_t ticks) {
+    return rec->hdr->start_ns
+        + ((double) ticks - rec->hdr->start_ticks) * rec->ratio;
+}
+
+// Copy the events the rings hold, dropping the oldest of a full ring,
+// which a crash may have left half overwritten
+static flight_event_t* recording_events(recording_t *rec, size_t *n,
+                                        int32_t tid) {
+    uint64_t cap = rec->hdr->ring_events, head, i;
+    const flight_ring_t *r;
+    flight_event_t *events, *e;
+    size_t max = (size_t) rec->hdr->num_rings * cap;
+    if((events = calloc(max > 0 ? max : 1, sizeof(flight_event_t))) == NULL)
+        return NULL;
+    *n = 0;
+    for(uint32_t ring = 0; ring < rec->hdr->num_rings; ring++) {
+        r = ring_at(rec, ring);
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        i = head >= cap ? head - cap + 1 : 0;
+        for(; i < head; i++) {
+            e = &events[*n];
+            *e = r->events[i & (cap - 1)];
+            if(e->type >= rec->hdr->num_types) continue;
+            if(tid != 0 && e->tid != tid) continue;
+            (*n)++;
+        }
+    }
+    return events;
+}
+
+static int by_ticks(const void *a, const void *b) {
+    const flight_event_t *x = a, *y = b;
+    if(x->ticks != y->ticks) return x->ticks < y->ticks ? -1 : 1;
+    return x->tid < y->tid ? -1 : (x->tid > y->tid ? 1 : 0);
+}
+
+static void print_outcome(recording_t *rec) {
+    const flight_header_t *hdr = rec->hdr;
+    printf("%s pid %ld, %u rings of %u events\n", hdr->process,
+           (long) hdr->pid, hdr->num_rings, hdr->ring_events);
+    if(hdr->fatal_signal != 0 && hdr->fatal_fault)
+        printf("killed by signal %d (%s) in thread %d, address %#lx\n",
+               hdr->fatal_signal, strsignal(hdr->fatal_signal),
+               hdr->fatal_tid, (unsigned long) hdr->fatal_addr);
+    else if(hdr->fatal_signal != 0)
+        printf("killed by signal %d (%s) sent to thread %d\n",
+               hdr->fatal_signal, strsignal(hdr->fatal_signal),
+               hdr->fatal_tid);
+    else if(hdr->closed)
+        printf("shut down with status %d\n", hdr->exit_status);
+    else if(hdr->exited)
+        printf("exit() with status %d\n", hdr->exit_status);
+    else if(kill(hdr->pid, 0) == 0)
+        printf("still running, or its pid was reused\n");
+    else
+        printf("no exit recorded: killed by SIGKILL, or the machine "
+               "went down\n");
+    if(hdr->lost_threads > 0)
+        printf("%u threads found no free ring, their events are lost\n",
+               hdr->lost_threads);
+}
+
+static void print_event(recording_t *rec, const flight_event_t *e,
+                        double end_ns) {
+    const flight_header_t *hdr = rec->hdr;
+    char text[17] = {0};
+    printf("%14.6f ms  tid %-7d %-14s", (to_ns(rec, e->ticks) - end_ns) / 1e6,
+           e->tid, hdr->names[e->type]);
+    if(hdr->text[e->type]) {
+        memcpy(text, &e->a, 8);
+        memcpy(text + 8, &e->b, 8);
+        // Frames end lines with a newline
+        text[strcspn(text, "\n")] = '\0';
+        printf(" \"%s\"", text);
+    } else {
+        if(hdr->args[e->type][0][0] != '\0')
+            printf(" %.*s=%ld", FLIGHT_NAME_LEN, hdr->args[e->type][0],
+                   (long) e->a);
+        if(hdr->args[e->type][1][0] != '\0')
+            printf(" %.*s=%ld", FLIGHT_NAME_LEN, hdr->args[e->type][1],
+                   (long) e->b);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *const argv[]) {
+    char path[PATH_MAX] = DEFAULT_FLIGHT_PATH;
+    long last = -1;
+    int32_t tid = 0;
+    recording_t rec;
+    flight_event_t *events;
+    size_t n, first;
+    int c;
+
+    while((c = getopt(argc, argv, "n:t:")) != -1) {
+        switch(c) {
+        case 'n':
+            last = strtol(optarg, NULL, 10);
+            break;
+        case 't':
+            tid = strtol(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n last_events] [-t tid]"
+                    " [flight_path]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(optind < argc) strncpy(path, argv[optind++], PATH_MAX - 1);
+    if(recording_open(&rec, path) != 0) return 1;
+
+    recording_calibrate(&rec);
+    print_outcome(&rec);
+    if((events = recording_events(&rec, &n, tid)) == NULL) {
+        perror("Reading the events");
+        munmap((void *) rec.hdr, rec.size);
+        return 1;
+    }
+    qsort(events, n, sizeof(flight_event_t), by_ticks);
+    first = last >= 0 && (size_t) last < n ? n - last : 0;
+    for(size_t i = first; i < n; i++)
+        print_event(&rec, &events[i], to_ns(&rec, events[n - 1].ticks));
+    free(events);
+    munmap((void *) rec.hdr, rec.size);
+    return 0;
+}
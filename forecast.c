@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "forecast.h"
+
+// ========== Holt smoothing ==========
+
+void holt_init(holt_t *h, double alpha, double beta) {
+    h->alpha = alpha;
+    h->beta = beta;
+    h->level = 0;
+    h->trend = 0;
+    h->samples = 0;
+}
+
+void holt_update(holt_t *h, double x, double dt) {
+    double prev = h->level;
+    // Nothing to take a trend from yet
+    if (h->samples++ == 0 || dt <= 0) {
+        h->level = h->samples == 1 ? x : h->alpha * x
+                                         + (1 - h->alpha) * h->level;
+        return;
+    }
+    h->level = h->alpha * x + (1 - h->alpha) * (prev + h->trend * dt);
+    h->trend = h->beta * (h->level - prev) / dt + (1 - h->beta) * h->trend;
+}
+
+double holt_forecast(holt_t *h, double ahead) {
+    return h->level + h->trend * ahead;
+}
+
+// ========== Load series ==========
+
+int load_series_init(load_series_t *s, int capacity) {
+    s->samples = calloc(capacity, sizeof(load_sample_t));
+    s->capacity = capacity;
+    s->next = 0;
+    s->len = 0;
+    s->abs_error_sum = 0;
+    s->scored = 0;
+    return s->samples == NULL ? -1 : 0;
+}
+
+void load_series_destroy(load_series_t *s) {
+    free(s->samples);
+    s->samples = NULL;
+}
+
+void load_series_add(load_series_t *s, const load_sample_t *sample,
+                     uint64_t horizon_ns) {
+    load_sample_t *old;
+    // Newest first, so the walk stops at the first one already scored
+    for (int k = 0; k < s->len; k++) {
+        old = &s->samples[(s->next - 1 - k + s->capacity) % s->capacity];
+        if (old->t_ns + horizon_ns > sample->t_ns) continue;
+        if (old->scored) break;
+        old->scored = 1;
+        s->abs_error_sum += fabs(old->forecast - sample->arrival_rate);
+        s->scored++;
+    }
+    s->samples[s->next] = *sample;
+    s->samples[s->next].scored = 0;
+    s->next = (s->next + 1) % s->capacity;
+    if (s->len < s->capacity) s->len++;
+}
+
+double load_series_mae(load_series_t *s) {
+    return s->scored == 0 ? 0 : s->abs_error_sum / s->scored;
+}
+
+// ========== Queueing model ==========
+
+int erlang_c_servers(double lambda, double mu, double target, double tail,
+                     int max_servers) {
+    double a, erlang_b = 1, erlang_c;
+    if (lambda <= 0 || mu <= 0) return 1;
+    // Offered load in servers
+    a = lambda / mu;
+    for (int c = 1; c <= max_servers; c++) {
+        // Erlang B recurrence, stable for any load
+        erlang_b = a * erlang_b / (c + a * erlang_b);
+        if (c <= a) continue;
+        // Probability of having to wait at all
+        erlang_c = c * erlang_b / (c - a * (1 - erlang_b));
+        // The wait of those who do is exponential with rate c mu - lambda
+        if (erlang_c * exp(-(c * mu - lambda) * target) <= tail) return c;
+    }
+    return max_servers;
+}
@@ -0,0 +1,74 @@
+#ifndef forecast_h_INCLUDED
+#define forecast_h_INCLUDED
+
+#include <stdint.h>
+
+// Load forecasting for the manager.
+//
+// holt_t is Holt's linear exponential smoothing (Holt-Winters without
+// a seasonal term) over samples taken at irregular times: the level
+// and the trend per second are updated with weights alpha and beta.
+//
+// load_series_t keeps the last samples of the arrival rate and of the
+// customers in line with the forecast made at each of them, and scores
+// every forecast once its horizon has passed.
+
+typedef struct holt_s {
+    double alpha;
+    double beta;
+    double level;
+    // Change of the level per second
+    double trend;
+    long samples;
+} holt_t;
+
+void holt_init(holt_t *h, double alpha, double beta);
+
+/* Fold in sample x, taken dt seconds after the previous one */
+void holt_update(holt_t *h, double x, double dt);
+
+/* Expected value ahead seconds from the last sample */
+double holt_forecast(holt_t *h, double ahead);
+
+typedef struct load_sample_s {
+    uint64_t t_ns;
+    // Customers per second joining a line
+    double arrival_rate;
+    long queued;
+    // Arrival rate forecast for t_ns + horizon, scored once reached
+    double forecast;
+    int scored;
+} load_sample_t;
+
+typedef struct load_series_s {
+    load_sample_t *samples;
+    int capacity;
+    // Index of the next sample to write, and samples held
+    int next;
+    int len;
+    // Forecast errors, for the log
+    double abs_error_sum;
+    long scored;
+} load_series_t;
+
+/* Returns -1 on failure */
+int load_series_init(load_series_t *s, int capacity);
+
+void load_series_destroy(load_series_t *s);
+
+/* Record a sample, then score the forecasts whose horizon has passed
+ * against its arrival rate */
+void load_series_add(load_series_t *s, const load_sample_t *sample,
+                     uint64_t horizon_ns);
+
+/* Mean absolute error of the scored forecasts, 0 if none */
+double load_series_mae(load_series_t *s);
+
+/* Fewest of at most max_servers M/M/c servers, each serving mu
+ * customers per second, that keep P(wait > target seconds) within
+ * tail under lambda arrivals per second, as given by Erlang C.
+ * Returns max_servers if even those are not enough */
+int erlang_c_servers(double lambda, double mu, double target, double tail,
+                     int max_servers);
+
+#endif // forecast_h_INCLUDED
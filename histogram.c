@@ -0,0 +1,64 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "histogram.h"
+
+static int bucket_of(uint64_t v) {
+    return v == 0 ? 0 : 64 - __builtin_clzll(v);
+}
+
+void histogram_init(histogram_t *h) {
+    memset(h, 0, sizeof(histogram_t));
+}
+
+void histogram_record(histogram_t *h, uint64_t v) {
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[bucket_of(v)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+    while(v > max && !__atomic_compare_exchange_n(&h->max, &max, v, true,
+                                                  __ATOMIC_RELAXED,
+                                                  __ATOMIC_RELAXED));
+}
+
+uint64_t histogram_percentile(histogram_t *h, double p) {
+    uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    uint64_t rank, seen = 0, upper;
+    if(count == 0) return 0;
+    rank = (uint64_t) (p / 100.0 * count);
+    if(rank == 0) rank = 1;
+    for(int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        if(seen >= rank) {
+            upper = b == 0 ? 0 : (b >= 64 ? UINT64_MAX : (1ull << b) - 1);
+            return upper < max ? upper : max;
+        }
+    }
+    return max;
+}
+
+double histogram_mean(histogram_t *h) {
+    uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    if(count == 0) return 0;
+    return (double) __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / count;
+}
+
+void histogram_merge(histogram_t *dst, histogram_t *src) {
+    for(int b = 0; b < HISTOGRAM_BUCKETS; b++)
+        __atomic_fetch_add(&dst->buckets[b],
+                           __atomic_load_n(&src->buckets[b], __ATOMIC_RELAXED),
+                           __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dst->count,
+                       __atomic_load_n(&src->count, __ATOMIC_RELAXED),
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dst->sum,
+                       __atomic_load_n(&src->sum, __ATOMIC_RELAXED),
+                       __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED),
+             dmax = __atomic_load_n(&dst->max, __ATOMIC_RELAXED);
+    while(max > dmax && !__atomic_compare_exchange_n(&dst->max, &dmax, max,
+                                                     true, __ATOMIC_RELAXED,
+                                                     __ATOMIC_RELAXED));
+}
@@ -0,0 +1,33 @@
+#ifndef histogram_h_INCLUDED
+#define histogram_h_INCLUDED
+
+#include <stdint.h>
+
+// Log2 bucketed histogram of unsigned values: bucket b counts the
+// values v with 2^(b-1) <= v < 2^b, bucket 0 counts zeros.
+// Counters are updated with relaxed atomics, so any thread may record
+// and a reporter may read at any time.
+
+#define HISTOGRAM_BUCKETS 65
+
+typedef struct histogram_s {
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} histogram_t;
+
+void histogram_init(histogram_t *h);
+
+void histogram_record(histogram_t *h, uint64_t v);
+
+/* Upper bound of the bucket holding the p-th percentile (0 < p <= 100),
+ * clamped to the largest recorded value. 0 if empty */
+uint64_t histogram_percentile(histogram_t *h, double p);
+
+double histogram_mean(histogram_t *h);
+
+/* Add the counts of src into dst */
+void histogram_merge(histogram_t *dst, histogram_t *src);
+
+#endif // histogram_h_INCLUDED
@@ -0,0 +1,185 @@
+// syscall(2) is not exposed under strict POSIX
+#define _DEFAULT_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "config.h"
+#include "lock.h"
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Sleep while *addr == val, until an absolute CLOCK_MONOTONIC time if
+// abstime is not NULL. The bitset variant takes absolute timeouts
+static int futex_wait_until(uint32_t *addr, uint32_t val,
+                            const struct timespec *abstime) {
+    return syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE, val, abstime,
+                   NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+void lock_futex_wake(uint32_t *addr, int n) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+// ========== Futex and adaptive mutexes ==========
+
+void lock_futex_wait(lock_word_t *l) {
+    // From now on the lock is marked as having waiters, the one that
+    // finds it free takes it that way and wakes the next on release
+    while(__atomic_exchange_n(&l->state, 2, __ATOMIC_ACQUIRE) != 0)
+        futex_wait_until(&l->state, 2, NULL);
+}
+
+void lock_adaptive_wait(lock_word_t *l) {
+    uint32_t free_;
+    for(int i = 0; i < LOCK_SPIN; i++) {
+        cpu_relax();
+        free_ = 0;
+        if(__atomic_load_n(&l->state, __ATOMIC_RELAXED) == 0
+           && __atomic_compare_exchange_n(&l->state, &free_, 1, false,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+    }
+    lock_futex_wait(l);
+}
+
+// ========== Ticket lock ==========
+
+void lock_ticket_wait(lock_word_t *l, uint32_t ticket) {
+    uint32_t serving;
+    for(int i = 0; i < LOCK_SPIN; i++) {
+        cpu_relax();
+        if(__atomic_load_n(&l->serving, __ATOMIC_ACQUIRE) == ticket) return;
+    }
+    // Pairs with the increment and load in lock_ticket_release
+    __atomic_fetch_add(&l->waiters, 1, __ATOMIC_SEQ_CST);
+    while((serving = __atomic_load_n(&l->serving, __ATOMIC_SEQ_CST))
+          != ticket)
+        futex_wait_until(&l->serving, serving, NULL);
+    __atomic_fetch_sub(&l->waiters, 1, __ATOMIC_RELAXED);
+}
+
+void lock_ticket_release(lock_word_t *l) {
+    __atomic_fetch_add(&l->serving, 1, __ATOMIC_SEQ_CST);
+    // Parked threads each check for their own ticket
+    if(__atomic_load_n(&l->waiters, __ATOMIC_SEQ_CST) != 0)
+        lock_futex_wake(&l->serving, INT_MAX);
+}
+
+// ========== Futex condition variable ==========
+
+int lock_futex_cond_wait(lock_futex_cond_t *c, lock_word_t *l,
+                         void (*acquire)(lock_word_t *),
+                         void (*release)(lock_word_t *),
+                         const struct timespec *abstime) {
+    // Read under the lock: a signal sent after it changes seq, and the
+    // futex does not sleep on a stale value
+    uint32_t seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+    int timedout;
+    release(l);
+    timedout = futex_wait_until(&c->seq, seq, abstime) != 0
+        && errno == ETIMEDOUT;
+    acquire(l);
+    return timedout ? ETIMEDOUT : 0;
+}
+
+void lock_futex_cond_wake(lock_futex_cond_t *c, int n) {
+    __atomic_fetch_add(&c->seq, 1, __ATOMIC_RELEASE);
+    lock_futex_wake(&c->seq, n);
+}
+
+// ========== Backend of the build ==========
+
+#if LOCK_BACKEND == LOCK_PTHREAD
+
+int lock_init(lock_t *l) {
+    return pthread_mutex_init(l, NULL);
+}
+
+int lock_destroy(lock_t *l) {
+    return pthread_mutex_destroy(l);
+}
+
+int lock_cond_init(lock_cond_t *c) {
+    pthread_condattr_t attr;
+    int err;
+    if((err = pthread_condattr_init(&attr)) != 0) return err;
+    if((err = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)) == 0)
+        err = pthread_cond_init(c, &attr);
+    pthread_condattr_destroy(&attr);
+    return err;
+}
+
+int lock_cond_destroy(lock_cond_t *c) {
+    return pthread_cond_destroy(c);
+}
+
+int lock_cond_wait(lock_cond_t *c, lock_t *l) {
+    return pthread_cond_wait(c, l);
+}
+
+int lock_cond_timedwait(lock_cond_t *c, lock_t *l,
+                        const struct timespec *abstime) {
+    return pthread_cond_timedwait(c, l, abstime);
+}
+
+int lock_cond_signal(lock_cond_t *c) {
+    return pthread_cond_signal(c);
+}
+
+int lock_cond_broadcast(lock_cond_t *c) {
+    return pthread_cond_broadcast(c);
+}
+
+#else
+
+int lock_init(lock_t *l) {
+    memset(l, 0, sizeof(lock_t));
+    return 0;
+}
+
+int lock_destroy(lock_t *l) {
+    return 0;
+}
+
+int lock_cond_init(lock_cond_t *c) {
+    c->seq = 0;
+    return 0;
+}
+
+int lock_cond_destroy(lock_cond_t *c) {
+    return 0;
+}
+
+int lock_cond_wait(lock_cond_t *c, lock_t *l) {
+    return lock_futex_cond_wait(c, l, lock_word_acquire, lock_word_release,
+                                NULL);
+}
+
+int lock_cond_timedwait(lock_cond_t *c, lock_t *l,
+                        const struct timespec *abstime) {
+    return lock_futex_cond_wait(c, l, lock_word_acquire, lock_word_release,
+                                abstime);
+}
+
+int lock_cond_signal(lock_cond_t *c) {
+    lock_futex_cond_wake(c, 1);
+    return 0;
+}
+
+int lock_cond_broadcast(lock_cond_t *c) {
+    lock_futex_cond_wake(c, INT_MAX);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,187 @@
+#ifndef lock_h_INCLUDED
+#define lock_h_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+// Locks and condition variables behind the synchronization macros of
+// util.h. The implementation is picked at build time with
+// make LOCK_BACKEND=<backend>:
+//
+// LOCK_PTHREAD   pthread_mutex_t and pthread_cond_t, the default
+// LOCK_FUTEX     three state futex mutex: 0 free, 1 taken, 2 taken
+//                with waiters, so an uncontended release is one atomic
+// LOCK_ADAPTIVE  the futex mutex spinning LOCK_SPIN times before it
+//                parks, for critical sections shorter than a syscall
+// LOCK_TICKET    FIFO ticket lock, spinning then parking on a futex
+//
+// Every backend but pthread shares lock_word_t and the futex condition
+// variable. Their functions are always built, so that bench_locks can
+// run all of them in the same process.
+
+#define LOCK_PTHREAD 0
+#define LOCK_FUTEX 1
+#define LOCK_ADAPTIVE 2
+#define LOCK_TICKET 3
+
+#ifndef LOCK_BACKEND
+#define LOCK_BACKEND LOCK_PTHREAD
+#endif
+
+typedef struct lock_word_s {
+    // Futex and adaptive: 0 free, 1 taken, 2 taken with waiters.
+    // Ticket: next ticket to hand out
+    uint32_t state;
+    // Ticket: ticket being served, and threads parked on it
+    uint32_t serving;
+    uint32_t waiters;
+} lock_word_t;
+
+// Bumped by every signal, waiters sleep on the value they saw
+typedef struct lock_futex_cond_s {
+    uint32_t seq;
+} lock_futex_cond_t;
+
+#define LOCK_WORD_INITIALIZER { 0, 0, 0 }
+
+void lock_futex_wait(lock_word_t *l);
+
+void lock_futex_wake(uint32_t *addr, int n);
+
+void lock_adaptive_wait(lock_word_t *l);
+
+void lock_ticket_wait(lock_word_t *l, uint32_t ticket);
+
+static inline void lock_futex_acquire(lock_word_t *l) {
+    uint32_t free_ = 0;
+    if(!__atomic_compare_exchange_n(&l->state, &free_, 1, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        lock_futex_wait(l);
+}
+
+static inline int lock_futex_tryacquire(lock_word_t *l) {
+    uint32_t free_ = 0;
+    return __atomic_compare_exchange_n(&l->state, &free_, 1, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)
+        ? 0 : EBUSY;
+}
+
+/* Also releases the adaptive lock */
+static inline void lock_futex_release(lock_word_t *l) {
+    if(__atomic_exchange_n(&l->state, 0, __ATOMIC_RELEASE) == 2)
+        lock_futex_wake(&l->state, 1);
+}
+
+static inline void lock_adaptive_acquire(lock_word_t *l) {
+    uint32_t free_ = 0;
+    if(!__atomic_compare_exchange_n(&l->state, &free_, 1, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        lock_adaptive_wait(l);
+}
+
+static inline void lock_ticket_acquire(lock_word_t *l) {
+    uint32_t ticket = __atomic_fetch_add(&l->state, 1, __ATOMIC_RELAXED);
+    if(__atomic_load_n(&l->serving, __ATOMIC_ACQUIRE) != ticket)
+        lock_ticket_wait(l, ticket);
+}
+
+static inline int lock_ticket_tryacquire(lock_word_t *l) {
+    uint32_t serving = __atomic_load_n(&l->serving, __ATOMIC_ACQUIRE);
+    return __atomic_compare_exchange_n(&l->state, &serving, serving + 1,
+                                       false, __ATOMIC_ACQUIRE,
+                                       __ATOMIC_RELAXED) ? 0 : EBUSY;
+}
+
+void lock_ticket_release(lock_word_t *l);
+
+/* Condition variable over any lock_word_t backend. Deadlines are
+ * absolute CLOCK_MONOTONIC times, NULL for none */
+int lock_futex_cond_wait(lock_futex_cond_t *c, lock_word_t *l,
+                         void (*acquire)(lock_word_t *),
+                         void (*release)(lock_word_t *),
+                         const struct timespec *abstime);
+
+void lock_futex_cond_wake(lock_futex_cond_t *c, int n);
+
+// ========== Backend of the build ==========
+
+#if LOCK_BACKEND == LOCK_PTHREAD
+
+typedef pthread_mutex_t lock_t;
+typedef pthread_cond_t lock_cond_t;
+#define LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+
+static inline int lock_acquire(lock_t *l) {
+    return pthread_mutex_lock(l);
+}
+
+static inline int lock_tryacquire(lock_t *l) {
+    return pthread_mutex_trylock(l);
+}
+
+static inline int lock_release(lock_t *l) {
+    return pthread_mutex_unlock(l);
+}
+
+#else
+
+typedef lock_word_t lock_t;
+typedef lock_futex_cond_t lock_cond_t;
+#define LOCK_INITIALIZER LOCK_WORD_INITIALIZER
+
+#if LOCK_BACKEND == LOCK_FUTEX
+#define lock_word_acquire lock_futex_acquire
+#define lock_word_tryacquire lock_futex_tryacquire
+#define lock_word_release lock_futex_release
+#elif LOCK_BACKEND == LOCK_ADAPTIVE
+#define lock_word_acquire lock_adaptive_acquire
+#define lock_word_tryacquire lock_futex_tryacquire
+#define lock_word_release lock_futex_release
+#elif LOCK_BACKEND == LOCK_TICKET
+#define lock_word_acquire lock_ticket_acquire
+#define lock_word_tryacquire lock_ticket_tryacquire
+#define lock_word_release lock_ticket_release
+#else
+#error "Unknown LOCK_BACKEND"
+#endif
+
+static inline int lock_acquire(lock_t *l) {
+    lock_word_acquire(l);
+    return 0;
+}
+
+static inline int lock_tryacquire(lock_t *l) {
+    return lock_word_tryacquire(l);
+}
+
+static inline int lock_release(lock_t *l) {
+    lock_word_release(l);
+    return 0;
+}
+
+#endif
+
+/* Same return values as their pthread counterparts */
+int lock_init(lock_t *l);
+
+int lock_destroy(lock_t *l);
+
+/* Timed waits of every backend follow CLOCK_MONOTONIC */
+int lock_cond_init(lock_cond_t *c);
+
+int lock_cond_destroy(lock_cond_t *c);
+
+int lock_cond_wait(lock_cond_t *c, lock_t *l);
+
+/* ETIMEDOUT once abstime, on CLOCK_MONOTONIC, has passed */
+int lock_cond_timedwait(lock_cond_t *c, lock_t *l,
+                        const struct timespec *abstime);
+
+int lock_cond_signal(lock_cond_t *c);
+
+int lock_cond_broadcast(lock_cond_t *c);
+
+#endif // lock_h_INCLUDED
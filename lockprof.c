@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "lockprof.h"
+
+typedef struct lockprof_held_s {
+    lock_t *mtx;
+    lockprof_site_t *site;
+    uint64_t since_ns;
+} lockprof_held_t;
+
+static lockprof_site_t *lockprof_sites = NULL;
+static int lockprof_at_exit = 0;
+
+// Locks held by the calling thread, innermost last
+static __thread lockprof_held_t held[LOCKPROF_HELD_MAX];
+static __thread int nheld = 0;
+
+static void lockprof_report_at_exit(void) {
+    lockprof_report(stderr);
+}
+
+static void lockprof_register(lockprof_site_t *s) {
+    int expected = 0;
+    if(__atomic_load_n(&s->registered, __ATOMIC_ACQUIRE)
+       || !__atomic_compare_exchange_n(&s->registered, &expected, 1, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return;
+    s->next = __atomic_load_n(&lockprof_sites, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&lockprof_sites, &s->next, s, true,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    expected = 0;
+    if(__atomic_compare_exchange_n(&lockprof_at_exit, &expected, 1, false,
+                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        atexit(lockprof_report_at_exit);
+}
+
+static void lockprof_max(uint64_t *max, uint64_t v) {
+    uint64_t cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while(v > cur && !__atomic_compare_exchange_n(max, &cur, v, true,
+                                                  __ATOMIC_RELAXED,
+                                                  __ATOMIC_RELAXED));
+}
+
+// Stop the clock of the innermost hold of mtx, returning its slot
+static int lockprof_release(lock_t *mtx, uint64_t now) {
+    lockprof_held_t *h;
+    for(int i = nheld - 1; i >= 0; i--) {
+        h = &held[i];
+        if(h->mtx != mtx) continue;
+        __atomic_fetch_add(&h->site->hold_ns, now - h->since_ns,
+                           __ATOMIC_RELAXED);
+        lockprof_max(&h->site->max_hold_ns, now - h->since_ns);
+        return i;
+    }
+    return -1;
+}
+
+int lockprof_lock(lock_t *mtx, lockprof_site_t *site) {
+    uint64_t start, now;
+    int err;
+    lockprof_register(site);
+    if((err = lock_tryacquire(mtx)) == EBUSY) {
+        start = now_ns();
+        if((err = lock_acquire(mtx)) != 0) return err;
+        now = now_ns();
+        __atomic_fetch_add(&site->contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&site->wait_ns, now - start, __ATOMIC_RELAXED);
+        lockprof_max(&site->max_wait_ns, now - start);
+    } else if(err != 0) {
+        return err;
+    } else {
+        now = now_ns();
+    }
+    __atomic_fetch_add(&site->acquisitions, 1, __ATOMIC_RELAXED);
+    if(nheld < LOCKPROF_HELD_MAX) {
+        held[nheld].mtx = mtx;
+        held[nheld].site = site;
+        held[nheld].since_ns = now;
+        nheld++;
+    }
+    return 0;
+}
+
+int lockprof_unlock(lock_t *mtx) {
+    int i = lockprof_release(mtx, now_ns());
+    if(i >= 0) {
+        for(; i < nheld - 1; i++) held[i] = held[i + 1];
+        nheld--;
+    }
+    return lock_release(mtx);
+}
+
+int lockprof_cond_wait(lock_cond_t *ev, lock_t *mtx) {
+    int i = lockprof_release(mtx, now_ns()), err;
+    err = lock_cond_wait(ev, mtx);
+    if(i >= 0) held[i].since_ns = now_ns();
+    return err;
+}
+
+int lockprof_cond_timedwait(lock_cond_t *ev, lock_t *mtx,
+                            const struct timespec *abstime) {
+    int i = lockprof_release(mtx, now_ns()), err;
+    err = lock_cond_timedwait(ev, mtx, abstime);
+    if(i >= 0) held[i].since_ns = now_ns();
+    return err;
+}
+
+static int lockprof_by_wait(const void *a, const void *b) {
+    const lockprof_site_t *x = *(lockprof_site_t * const *) a,
+                          *y = *(lockprof_site_t * const *) b;
+    uint64_t wx = __atomic_load_n(&x->wait_ns, __ATOMIC_RELAXED),
+             wy = __atomic_load_n(&y->wait_ns, __ATOMIC_RELAXED);
+    if(wx == wy) {
+        wx = __atomic_load_n(&x->hold_ns, __ATOMIC_RELAXED);
+        wy = __atomic_load_n(&y->hold_ns, __ATOMIC_RELAXED);
+    }
+    return wx < wy ? 1 : (wx > wy ? -1 : 0);
+}
+
+void lockprof_report(FILE *f) {
+    // Sites registered from now on go in front of head
+    lockprof_site_t *head, *s, **sorted;
+    size_t n = 0, i;
+    char where[64];
+    head = __atomic_load_n(&lockprof_sites, __ATOMIC_ACQUIRE);
+    for(s = head; s != NULL; s = s->next) n++;
+    if(n == 0) {
+        fprintf(f, "lockprof: no lock sites, build with make lockprof\n");
+        return;
+    }
+    if((sorted = calloc(n, sizeof(lockprof_site_t *))) == NULL) return;
+    for(i = 0, s = head; s != NULL; s = s->next) sorted[i++] = s;
+    qsort(sorted, n, sizeof(lockprof_site_t *), lockprof_by_wait);
+    fprintf(f, "lockprof: %-24s %-28s %10s %10s %10s %12s %10s %12s\n",
+            "site", "lock", "acquired", "contended", "wait_ms",
+            "max_wait_us", "hold_ms", "max_hold_us");
+    for(i = 0; i < n; i++) {
+        s = sorted[i];
+        snprintf(where, sizeof(where), "%s:%d", s->file, s->line);
+        fprintf(f, "lockprof: %-24s %-28s %10lu %10lu %10.3f %12.1f "
+                "%10.3f %12.1f\n", where, s->lock,
+                __atomic_load_n(&s->acquisitions, __ATOMIC_RELAXED),
+                __atomic_load_n(&s->contended, __ATOMIC_RELAXED),
+                __atomic_load_n(&s->wait_ns, __ATOMIC_RELAXED) / 1e6,
+                __atomic_load_n(&s->max_wait_ns, __ATOMIC_RELAXED) / 1e3,
+                __atomic_load_n(&s->hold_ns, __ATOMIC_RELAXED) / 1e6,
+                __atomic_load_n(&s->max_hold_ns, __ATOMIC_RELAXED) / 1e3);
+    }
+    free(sorted);
+}
@@ -0,0 +1,55 @@
+#ifndef lockprof_h_INCLUDED
+#define lockprof_h_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+#include "lock.h"
+
+// Lock contention profiler behind the synchronization macros of util.h,
+// built in with make lockprof. Every place that takes a lock is a site
+// of its own, a static lockprof_site_t registered the first time it is
+// reached. A site counts its acquisitions, the ones that found the lock
+// taken and how long they waited, and how long the lock was then held,
+// wherever it was released. Waiting on a condition variable does not
+// count as holding the lock.
+//
+// The report ranks the sites by total wait. It is printed at exit, and
+// on SIGUSR1 by the supermarket and the manager.
+
+// Locks a thread can hold at once and still have their hold time taken
+#define LOCKPROF_HELD_MAX 16
+
+typedef struct lockprof_site_s {
+    const char *file;
+    int line;
+    // The lock expression as written at the site
+    const char *lock;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
+    uint64_t hold_ns;
+    uint64_t max_hold_ns;
+    int registered;
+    struct lockprof_site_s *next;
+} lockprof_site_t;
+
+// Static site of the calling line, one per macro expansion
+#define LOCKPROF_SITE(lock) ({ \
+    static lockprof_site_t lockprof_site_ = { __FILE__, __LINE__, lock }; \
+    &lockprof_site_; })
+
+/* Drop in replacements of the lock.h calls, same return values */
+int lockprof_lock(lock_t *mtx, lockprof_site_t *site);
+
+int lockprof_unlock(lock_t *mtx);
+
+int lockprof_cond_wait(lock_cond_t *ev, lock_t *mtx);
+
+int lockprof_cond_timedwait(lock_cond_t *ev, lock_t *mtx,
+                            const struct timespec *abstime);
+
+/* Print the sites reached so far, most waited on first */
+void lockprof_report(FILE *f);
+
+#endif // lockprof_h_INCLUDED
@@ -80,3 +80,29 @@ int lqueue_remove_index(lqueue_t* q, void** val, int ind) {
     }
     return 0;
 }
+
+node_t* lqueue_take_all(lqueue_t* q, int* count) {
+    node_t *head = q->head;
+    if (count) *count = q->count;
+    q->head = NULL;
+    q->count = 0;
+    return head;
+}
+
+int lqueue_splice_tail(lqueue_t* q, node_t* head, node_t* tail, int count) {
+    if(LQUEUE_CLOSED(q)) {
+        LOG_NEVER("queue %p was closed in splice", (void*) q);
+        return -2;
+    }
+    if (head == NULL) return 0;
+    tail->next = NULL;
+    if (q->head == NULL) {
+        q->head = head;
+    } else {
+        node_t *curr = q->head;
+        while(curr->next != NULL) curr = curr->next;
+        curr->next = head;
+    }
+    q->count += count;
+    return 0;
+}
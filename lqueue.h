@@ -36,4 +36,12 @@ void lqueue_free(lqueue_t* q);
 /* Remove an element at position ind */
 int lqueue_remove_index(lqueue_t* q, void** val, int ind);
 
+/* Detach the whole list from the queue, leaving it empty.
+ * The number of detached elements is stored in count */
+node_t* lqueue_take_all(lqueue_t* q, int* count);
+
+/* Append an already linked list of count elements ending in tail.
+ * Returns -2 if the queue is closed */
+int lqueue_splice_tail(lqueue_t* q, node_t* head, node_t* tail, int count);
+
 #endif
@@ -7,10 +7,14 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/un.h>
+#include <netinet/in.h>
 #include <errno.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <math.h>
+#include <poll.h>
 
 #include "globals.h"
 #include "conc_lqueue.h"
@@ -18,6 +22,12 @@
 #include "cashcust.h"
 #include "config.h"
 #include "util.h"
+#include "policy.h"
+#include "tsdb.h"
+#include "metrics.h"
+#include "trace.h"
+#include "lockprof.h"
+#include "flight.h"
 
 // ========== Signal Handler ==========
 
@@ -27,7 +37,7 @@ typedef struct signal_worker_opt_s {
     sigset_t sigset;
     // Array of client pids
     pid_t *client_pids;
-    pthread_mutex_t* client_pids_mtx;
+    lock_t* client_pids_mtx;
     int manager_pool_size;
 } signal_worker_opt_t;
 
@@ -44,6 +54,11 @@ void* signal_worker (void* arg) {
         // Forward SIGHUP (gentle quit) and SIGINT/SIGQUIT (brutal)
         // To connected clients
         LOG_DEBUG("Intercepted Signal %d\n", signum);
+        flight_record(FLIGHT_SIGNAL, signum, 0);
+        if (signum == SIGUSR1) {
+            lockprof_report(stderr);
+            continue;
+        }
         if (signum == SIGHUP || signum == SIGQUIT || signum == SIGINT) {
             MTX_LOCK_DIE(opt.client_pids_mtx);
             for(int i = 0; i < opt.manager_pool_size; i++)
@@ -63,6 +78,319 @@ void* signal_worker (void* arg) {
 }
 
 
+// ========== Exit Leases ==========
+
+// Every exit request is approved, so instead of confirming each one the
+// manager lets the supermarket approve up to a quota of exits on its
+// own for a while. The supermarket reports the customers it let out and
+// returns the lease when it is used up or over, and a new one is
+// granted. Reporting more exits than granted revokes the lease for good:
+// from then on every exit goes through want_out again.
+typedef struct exit_lease_s {
+    long quota;
+    long msec;
+    // Exits reported against the current lease
+    long used;
+    bool revoked;
+} exit_lease_t;
+
+static int exit_lease_grant(int fd, exit_lease_t *lease) {
+    char msgbuf[MSG_SIZE] = {0};
+    if(lease->quota <= 0 || lease->revoked) return 0;
+    lease->used = 0;
+    snprintf(msgbuf, MSG_SIZE, "%s %s %ld %ld\n", MSG_LEASE_HEADER,
+             MSG_LEASE_GRANT, lease->quota, lease->msec);
+    LOG_DEBUG("Sending message: %s", msgbuf);
+    return sendn(fd, msgbuf, MSG_SIZE, 0) <= 0 ? -1 : 0;
+}
+
+static int exit_lease_revoke(int fd, exit_lease_t *lease) {
+    char msgbuf[MSG_SIZE] = {0};
+    lease->revoked = true;
+    snprintf(msgbuf, MSG_SIZE, "%s %s\n", MSG_LEASE_HEADER, MSG_LEASE_REVOKE);
+    LOG_DEBUG("Sending message: %s", msgbuf);
+    return sendn(fd, msgbuf, MSG_SIZE, 0) <= 0 ? -1 : 0;
+}
+
+// Account for a report or a return of the supermarket
+static int exit_lease_handle(int fd, exit_lease_t *lease, char *msgbuf) {
+    char *remaining = &msgbuf[strlen(MSG_LEASE_HEADER)], *parsed;
+    bool returned;
+    while(*remaining == ' ') remaining++;
+    if(strncmp(remaining, MSG_LEASE_RETURN, strlen(MSG_LEASE_RETURN)) == 0) {
+        returned = true;
+        remaining += strlen(MSG_LEASE_RETURN);
+    } else if(strncmp(remaining, MSG_LEASE_REPORT,
+                      strlen(MSG_LEASE_REPORT)) == 0) {
+        returned = false;
+        remaining += strlen(MSG_LEASE_REPORT);
+    } else {
+        LOG_DEBUG("Unrecognised message\n");
+        return 0;
+    }
+    // Should now do any additional checks on the IDs
+    for(;;) {
+        strtol(remaining, &parsed, 10);
+        if(parsed == remaining) break;
+        remaining = parsed;
+        lease->used++;
+    }
+    if(lease->revoked) return 0;
+    if(lease->used > lease->quota) {
+        ERR("Exit lease overrun: %ld exits of %ld, revoking\n",
+            lease->used, lease->quota);
+        return exit_lease_revoke(fd, lease);
+    }
+    return returned ? exit_lease_grant(fd, lease) : 0;
+}
+
+
+// ========== Admission Control ==========
+
+// The manager sets the rate at which the supermarket lets customers
+// in: what the open cashiers serve per second, plus the room left in
+// the lines before they hold backlog customers per open cashier, to be
+// filled (or drained, if negative) over a second. A new rate is only
+// pushed if it differs by more than a tenth from the last one.
+typedef struct admission_s {
+    long backlog;
+    long burst;
+    // Last rate pushed, negative if none
+    double rate;
+    uint64_t sent_ns;
+} admission_t;
+
+static int admission_push(int fd, admission_t *adm, policy_t *policy) {
+    char msgbuf[MSG_SIZE] = {0};
+    double rate, capacity;
+    uint64_t now = now_ns();
+    // The service time is known once some customers were served
+    if(adm->backlog <= 0 || policy->service_ms <= 0) return 0;
+    if(now - adm->sent_ns < ADMISSION_MIN_INTERVAL * 1000000ull) return 0;
+    capacity = policy->open_count * 1000.0 / policy->service_ms;
+    rate = capacity + adm->backlog * policy->open_count - policy->queued;
+    if(rate < 0) rate = 0;
+    if(adm->rate >= 0 && fabs(rate - adm->rate) <= adm->rate / 10) return 0;
+    adm->rate = rate;
+    adm->sent_ns = now;
+    snprintf(msgbuf, MSG_SIZE, "%s %.2f %ld\n", MSG_ADMISSION,
+             rate, adm->burst);
+    LOG_DEBUG("Sending message: %s", msgbuf);
+    return sendn(fd, msgbuf, MSG_SIZE, 0) <= 0 ? -1 : 0;
+}
+
+
+// ========== Local Queries ==========
+
+// Besides the supermarkets the manager serves a few local sockets, all
+// answered by one thread, one request per connection. A slow client
+// only delays the next ones, never a connection worker.
+typedef struct query_listener_s {
+    int fd;
+    void (*answer)(int fd, void *arg);
+    void *arg;
+} query_listener_t;
+
+typedef struct query_opt_s {
+    query_listener_t listeners[QUERY_LISTENERS];
+    int count;
+} query_opt_t;
+
+// Returns the listening socket, or -1
+static int query_listen(int domain, struct sockaddr *addr, socklen_t len) {
+    int fd, err, on = 1;
+    SYSCALL_SET_GOTO(fd, socket(domain, SOCK_STREAM, 0),
+                     "Creating query socket\n", err, query_listen_fail);
+    if(domain == AF_INET)
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    SYSCALL_SET_GOTO(err, bind(fd, addr, len),
+                     "Binding query socket\n", err, query_listen_close);
+    SYSCALL_SET_GOTO(err, listen(fd, SOMAXCONN),
+                     "Listening on query socket\n", err, query_listen_close);
+    return fd;
+query_listen_close:
+    close(fd);
+query_listen_fail:
+    return -1;
+}
+
+static void* query_worker(void *arg) {
+    query_opt_t *opt = (query_opt_t *) arg;
+    struct pollfd pfd[QUERY_LISTENERS];
+    struct timeval timeout = { 1, 0 };
+    int fd;
+    for(int i = 0; i < opt->count; i++) {
+        pfd[i].fd = opt->listeners[i].fd;
+        pfd[i].events = POLLIN;
+    }
+    while(!should_quit) {
+        if(poll(pfd, opt->count, QUERY_POLL_INTERVAL) <= 0) continue;
+        for(int i = 0; i < opt->count; i++) {
+            if(!(pfd[i].revents & POLLIN)) continue;
+            if((fd = accept(pfd[i].fd, NULL, 0)) == -1) continue;
+            // Do not let a silent or stuck client hold up the next ones
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            opt->listeners[i].answer(fd, opt->listeners[i].arg);
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+
+// ========== Queue Size History ==========
+
+// Every queue size the manager hears of is kept in a compressed store
+// per supermarket. A query is a line "<minutes> [cashier]" and the
+// answer a line "<worker> <cashier> <t_ms> <queue size>" per sample of
+// the last minutes, oldest first within a cashier, and a summary line
+// starting with '#'. Times are ms on the monotonic clock, like now_ms
+// in the summary.
+typedef struct history_opt_s {
+    tsdb_t **history;
+    int count;
+} history_opt_t;
+
+typedef struct history_out_s {
+    FILE *out;
+    int worker;
+} history_out_t;
+
+static void history_visit(void *arg, int series, uint64_t t_ms,
+                          double value) {
+    history_out_t *h = (history_out_t *) arg;
+    fprintf(h->out, "%d %d %lu %.0f\n", h->worker, series, t_ms, value);
+}
+
+static void history_answer(int fd, void *arg) {
+    history_opt_t *opt = (history_opt_t *) arg;
+    char query[64] = {0}, usage[] = "# usage: <minutes> [cashier]\n";
+    char *buf = NULL;
+    size_t len = 0, got = 0;
+    ssize_t nread;
+    long minutes = 0, matched = 0;
+    int cashier = -1;
+    uint64_t start = now_ns(), now_ms = start / 1000000ull, since,
+             samples = 0, bits = 0, s, b;
+    history_out_t h;
+
+    while(got < sizeof(query) - 1 && strchr(query, '\n') == NULL) {
+        if((nread = recv(fd, query + got, sizeof(query) - 1 - got, 0)) <= 0)
+            break;
+        got += nread;
+    }
+    if(sscanf(query, "%ld %d", &minutes, &cashier) < 1 || minutes <= 0) {
+        if(sendn(fd, usage, strlen(usage), MSG_NOSIGNAL) <= 0)
+            LOG_DEBUG("Sending the history usage\n");
+        return;
+    }
+    since = now_ms > (uint64_t) minutes * 60000 ?
+        now_ms - (uint64_t) minutes * 60000 : 0;
+    if((h.out = open_memstream(&buf, &len)) == NULL) {
+        ERR("Allocating the history answer\n");
+        return;
+    }
+    for(int i = 0; i < opt->count; i++) {
+        h.worker = i;
+        matched += tsdb_query(opt->history[i], cashier, since,
+                              history_visit, &h);
+        tsdb_stats(opt->history[i], &s, &b);
+        samples += s;
+        bits += b;
+    }
+    fprintf(h.out, "# matched %ld samples %lu bytes_per_sample %.2f"
+            " query_us %lu now_ms %lu\n", matched, samples,
+            samples > 0 ? bits / 8.0 / samples : 0,
+            (now_ns() - start) / 1000, now_ms);
+    fclose(h.out);
+    if(sendn(fd, buf, len, MSG_NOSIGNAL) <= 0)
+        LOG_DEBUG("Sending the history answer\n");
+    free(buf);
+}
+
+
+// ========== Metrics ==========
+
+// Answers any request, such as an HTTP GET from a Prometheus scraper,
+// with the current metrics of the connection workers
+typedef struct metrics_opt_s {
+    worker_metrics_t *metrics;
+    int count;
+} metrics_opt_t;
+
+static void metrics_answer(int fd, void *arg) {
+    metrics_opt_t *opt = (metrics_opt_t *) arg;
+    char request[1024], header[256];
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *out;
+    int hlen;
+
+    // The request itself does not matter
+    recv(fd, request, sizeof(request), 0);
+    if((out = open_memstream(&buf, &len)) == NULL) {
+        ERR("Allocating the metrics answer\n");
+        return;
+    }
+    metrics_write(out, opt->metrics, opt->count);
+    fclose(out);
+    hlen = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                    "Content-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: %zu\r\n\r\n", len);
+    if(sendn(fd, header, hlen, MSG_NOSIGNAL) <= 0
+       || sendn(fd, buf, len, MSG_NOSIGNAL) <= 0)
+        LOG_DEBUG("Sending the metrics answer\n");
+    free(buf);
+}
+
+
+// ========== Scaling ==========
+
+// Act on the current policy decision. Returns -1 if sending failed
+static int policy_apply(int fd, policy_t *policy, worker_metrics_t *metrics) {
+    char msgbuf[MSG_SIZE] = {0};
+    int id;
+    // The policy assumes the order is carried out until the next report
+    // says otherwise, so the same cashier is not picked again meanwhile
+    switch(policy_decide(policy, &id)) {
+    case POLICY_CLOSE:
+        snprintf(msgbuf, MSG_SIZE, "%s %d %s\n",
+                 MSG_CASH_HEADER, id, MSG_CLOSE_CASH);
+        metrics_add(&metrics->closed, 1);
+        flight_record(FLIGHT_DECIDE_CLOSE, id, policy->open_count);
+        trace_instant("decision", "close_cashier", TRACE_TRACK_THREAD,
+                      "cashier", id);
+        break;
+    case POLICY_OPEN:
+        snprintf(msgbuf, MSG_SIZE, "%s %d %s\n",
+                 MSG_CASH_HEADER, id, MSG_OPEN_CASH);
+        metrics_add(&metrics->opened, 1);
+        flight_record(FLIGHT_DECIDE_OPEN, id, policy->open_count);
+        trace_instant("decision", "open_cashier", TRACE_TRACK_THREAD,
+                      "cashier", id);
+        break;
+    case POLICY_NONE:
+        return 0;
+    }
+    metrics_set(&metrics->open_count, policy->open_count);
+    LOG_DEBUG("Sending message: %s\n", msgbuf);
+    if(sendn(fd, msgbuf, MSG_SIZE, 0) <= 0) {
+        ERR("Error sending message\n");
+        return -1;
+    }
+    return 0;
+}
+
+// A report has been acted on: time it from when it was received
+static void decision_done(worker_metrics_t *metrics, const char *report,
+                          uint64_t recv_ns) {
+    uint64_t end = now_ns();
+    histogram_record(&metrics->decision_ns, end - recv_ns);
+    trace_span("decision", report, TRACE_TRACK_THREAD, recv_ns, end,
+               NULL, 0);
+}
+
 // Contains options passed to connection workers
 typedef struct conn_opt_s {
     // File descriptor
@@ -71,19 +399,30 @@ typedef struct conn_opt_s {
     int id;
     // Array of client_pids 
     pid_t *client_pids;
-    pthread_mutex_t* client_pids_mtx;
+    lock_t* client_pids_mtx;
     // Signals to be ignored (already handled)
     sigset_t sigset;
     // Count of running processes
     int* running_count;
-    pthread_mutex_t *count_mtx;
-    pthread_cond_t *can_spawn_thread_event;
+    lock_t *count_mtx;
+    lock_cond_t *can_spawn_thread_event;
     // Other data
     int num_cashiers;
     long undercrowded_cash_treshold;
     long overcrowded_cash_treshold;
+    policy_mode_t scaling_policy;
+    policy_smooth_t scaling_smooth;
+    policy_slo_t scaling_slo;
+    policy_predict_t scaling_predict;
+    long admission_backlog;
+    long admission_burst;
+    // Queue size history of this supermarket
+    tsdb_t *history;
+    worker_metrics_t *metrics;
     int *running_arr;
     int initial_open_cashiers;
+    long exit_lease_quota;
+    long exit_lease_ms;
 } conn_opt_t;
 
 void* conn_worker(void* arg) {
@@ -91,15 +430,16 @@ void* conn_worker(void* arg) {
     char msgbuf[MSG_SIZE] = {0};
     ssize_t nread = 0, nwrote;
     int err = 0;
-    // // printf("CASHIERS NUM = %d\n", opt->num_cashiers);
-    long *queue_size_arr = calloc(opt->num_cashiers, sizeof(long));
+    policy_t *policy = policy_init(opt->num_cashiers,
+                                   opt->initial_open_cashiers,
+                                   opt->undercrowded_cash_treshold,
+                                   opt->overcrowded_cash_treshold);
+    exit_lease_t lease = { opt->exit_lease_quota, opt->exit_lease_ms, 0, false };
+    admission_t admission = { opt->admission_backlog, opt->admission_burst,
+                              -1, 0 };
+    worker_metrics_t *m = opt->metrics;
+    uint64_t recv_ns;
 
-    for(size_t i = 0; i < opt->num_cashiers; i++) {
-        queue_size_arr[i] = -1;
-    }
-    for(int i = 0; i < opt->initial_open_cashiers; i++) {
-        queue_size_arr[i] = 0;
-    }
     if(pthread_sigmask(SIG_BLOCK, &opt->sigset, NULL) < 0)
         ERR_DIE("Masking signals in connection thread");
 
@@ -109,13 +449,28 @@ void* conn_worker(void* arg) {
     opt->running_arr[opt->id] = 1; 
     MTX_UNLOCK_DIE(opt->count_mtx);
 
+    if(policy == NULL
+       || (opt->scaling_policy == POLICY_SMOOTH
+           && policy_set_smooth(policy, &opt->scaling_smooth) != 0)
+       || (opt->scaling_policy == POLICY_SLO
+           && policy_set_slo(policy, &opt->scaling_slo) != 0)
+       || (opt->scaling_policy == POLICY_PREDICT
+           && policy_set_predict(policy, &opt->scaling_slo,
+                                 &opt->scaling_predict) != 0)) {
+        ERR("Allocating the scaling policy\n");
+        goto conn_worker_exit;
+    }
+
     LOG_DEBUG("Worker %d socket connected\n", opt->id);
     while(!should_quit) {
     if ((nread = recvn(opt->fd, msgbuf, MSG_SIZE, MSG_DONTWAIT) > 0)) {
         LOG_DEBUG("Worker %d fd %d received message: %s",
                     opt->id, opt->fd, msgbuf);
+        recv_ns = now_ns();
+        flight_record_text(FLIGHT_MSG_IN, msgbuf);
         
         if(strcmp(msgbuf, HELLO_BOSS) == 0) {
+            metrics_add(&m->received[METRICS_MSG_HELLO], 1);
             LOG_DEBUG("Received connection request\n");
             // Read the supermarket process pid and store it in the array.
             // It is needed to forward signals.
@@ -125,6 +480,7 @@ void* conn_worker(void* arg) {
                 pid_t pid = (pid_t) strtol(msgbuf, NULL, 10);
                 if (pid <= 0) {
                     LOG_DEBUG("Could not convert PID msg to int. Ignoring\n");
+                    metrics_add(&m->parse_errors, 1);
                     continue;
                 }
                 MTX_LOCK_GOTO(opt->client_pids_mtx, conn_worker_exit);
@@ -147,13 +503,77 @@ void* conn_worker(void* arg) {
                 memset(msgbuf, 0, MSG_SIZE);
                 LOG_DEBUG("Worker %d successfully connected to process %d\n",
                     opt->id, opt->client_pids[opt->id]);
+                metrics_set(&m->connected, 1);
+                metrics_set(&m->open_count, policy->open_count);
                 MTX_UNLOCK_GOTO(opt->client_pids_mtx, conn_worker_exit);
+                if(exit_lease_grant(opt->fd, &lease) != 0) {
+                    ERR("Granting exit lease\n");
+                    goto conn_worker_exit;
+                }
             }
             
+        // ========== Handle exit lease reports ==========
+
+        } else if (strncmp(msgbuf, MSG_LEASE_HEADER,
+                           strlen(MSG_LEASE_HEADER)) == 0) {
+            metrics_add(&m->received[METRICS_MSG_LEASE], 1);
+            if(exit_lease_handle(opt->fd, &lease, msgbuf) != 0) {
+                ERR("Error sending message\n");
+                goto conn_worker_exit;
+            }
+
+        // ========== Handle batched customer exit requests ==========
+
+        } else if (strncmp(msgbuf, MSG_CUST_BATCH_HEADER,
+                           strlen(MSG_CUST_BATCH_HEADER)) == 0) {
+        metrics_add(&m->received[METRICS_MSG_CUST_BATCH], 1);
+        // Confirm the whole batch with a single message
+        char reply[MSG_SIZE] = {0};
+        char *remaining = &msgbuf[strlen(MSG_CUST_BATCH_HEADER)], *parsed;
+        long cust_id = 0;
+        int len, count = 0;
+        while(*remaining == ' ') remaining++;
+        if(strncmp(remaining, MSG_WANT_OUT, strlen(MSG_WANT_OUT)) != 0) {
+            LOG_DEBUG("Unrecognised message\n");
+            metrics_add(&m->parse_errors, 1);
+            memset(msgbuf, 0, MSG_SIZE);
+            continue;
+        }
+        remaining += strlen(MSG_WANT_OUT);
+        len = snprintf(reply, MSG_SIZE, "%s %s",
+                       MSG_CUST_BATCH_HEADER, MSG_GET_OUT);
+        while(count < EXIT_BATCH_MAX_IDS) {
+            errno = 0;
+            cust_id = strtol(remaining, &parsed, 10);
+            if(parsed == remaining) break;
+            remaining = parsed;
+            if(cust_id < 0 || errno == ERANGE) {
+                LOG_DEBUG("Received invalid customer ID: %ld\n", cust_id);
+                metrics_add(&m->parse_errors, 1);
+                continue;
+            }
+            // Should now do any additional checks
+            len += snprintf(reply + len, MSG_SIZE - len, " %ld", cust_id);
+            count++;
+        }
+        if(count == 0) {
+            LOG_DEBUG("Malformed message: no cust ID\n");
+            metrics_add(&m->parse_errors, 1);
+            memset(msgbuf, 0, MSG_SIZE);
+            continue;
+        }
+        snprintf(reply + len, MSG_SIZE - len, "\n");
+
+        if((nwrote = sendn(opt->fd, reply, MSG_SIZE, 0)) <= 0) {
+            ERR("Error sending message\n");
+            goto conn_worker_exit;
+        }
+
         // ========== Handle customer exit requests ==========
             
         } else if (strncmp(msgbuf, MSG_CUST_HEADER,
                            strlen(MSG_CUST_HEADER)) == 0) {
+        metrics_add(&m->received[METRICS_MSG_CUST], 1);
                                
         char *remaining = NULL;
         long cust_id = 0; 
@@ -162,10 +582,12 @@ void* conn_worker(void* arg) {
                &remaining, 10); 
         if(cust_id < 0 || errno == ERANGE) {
             LOG_DEBUG("Received invalid customer ID: %ld\n", cust_id);
+            metrics_add(&m->parse_errors, 1);
             memset(msgbuf, 0, MSG_SIZE);
             continue;
         } else if (msgbuf == remaining) {
             LOG_DEBUG("Malformed message: no cust ID\n");
+            metrics_add(&m->parse_errors, 1);
             memset(msgbuf, 0, MSG_SIZE);
             continue;
         }
@@ -192,6 +614,9 @@ void* conn_worker(void* arg) {
             char *after_parsing = NULL;
             int received = 0;
             long queue_size = 0;
+            uint64_t now_ms = recv_ns / 1000000ull;
+
+            metrics_add(&m->received[METRICS_MSG_QUEUE_SIZE], 1);
 
 
             while(received < opt->num_cashiers) {
@@ -201,84 +626,91 @@ void* conn_worker(void* arg) {
                 errno = 0;
                 queue_size= strtol(before_parsing, &after_parsing, 10); 
                 if(queue_size < -1 || errno == ERANGE) {
+                    metrics_add(&m->parse_errors, 1);
                     ERR_SET_GOTO(conn_worker_exit, err,
                       "Received invalid queue_size %ld\n", queue_size);
                     
                 } else if (before_parsing == after_parsing) {
+                    metrics_add(&m->parse_errors, 1);
                     should_quit = 1;
                     ERR_SET_GOTO(conn_worker_exit, err,
                       "Not enough cashiers in size poll\n");
                 }
 
-                queue_size_arr[received] = queue_size;
+                policy_update(policy, received, queue_size, -1);
+                tsdb_append(opt->history, received, now_ms, queue_size);
+                metrics_set(&m->queue_size[received], queue_size);
                 before_parsing = after_parsing;
                 received++;
             }
 
-            int overcrowded_cashier = -1, first_closed = -1,
-                least_crowded = -1, least_crowded_size = INT_MAX;
-            int undercrowded_count = 0, open_cashiers = 1;
+            if(policy_apply(opt->fd, policy, m) != 0) goto conn_worker_exit;
+            decision_done(m, MSG_QUEUE_SIZE, recv_ns);
+
+        // ========== Handle size changes ==========
 
-           
-            for(int i = 0; i < opt->num_cashiers; i++) {
-                if (queue_size_arr[i] == -1 && first_closed == -1) {
-                    first_closed = i;
+        } else if (strncmp(msgbuf, MSG_QUEUE_DELTA,
+                          strlen(MSG_QUEUE_DELTA)) == 0) {
+
+            // Cashier ID, queue size and estimated wait,
+            // only for what changed
+            char *before_parsing = &msgbuf[strlen(MSG_QUEUE_DELTA)];
+            char *after_parsing = NULL;
+            long id, queue_size, wait;
+            uint64_t now_ms = recv_ns / 1000000ull;
+
+            metrics_add(&m->received[METRICS_MSG_QUEUE_DELTA], 1);
+
+            for(;;) {
+                errno = 0;
+                id = strtol(before_parsing, &after_parsing, 10);
+                if(before_parsing == after_parsing) break;
+                before_parsing = after_parsing;
+                queue_size = strtol(before_parsing, &after_parsing, 10);
+                if(before_parsing != after_parsing) {
+                    before_parsing = after_parsing;
+                    wait = strtol(before_parsing, &after_parsing, 10);
                 }
-                else {
-                    if (queue_size_arr[i] >= 0
-                        && (least_crowded == -1
-                            || queue_size_arr[i] < least_crowded_size)) {
-                        least_crowded = i;
-                        least_crowded_size = queue_size_arr[i];
-                    }
-                    open_cashiers++;
-                } 
-                if(queue_size_arr[i] > 0 &&
-                   queue_size_arr[i] >= opt->overcrowded_cash_treshold) {
-                    overcrowded_cashier = i;
-                } else if(queue_size_arr[i] >= 0 && 
-                          queue_size_arr[i] <= 1) {
-                    undercrowded_count++;
+                if(before_parsing == after_parsing || errno == ERANGE
+                   || id < 0 || id >= opt->num_cashiers || queue_size < -1
+                   || wait < -1) {
+                    metrics_add(&m->parse_errors, 1);
+                    ERR_SET_GOTO(conn_worker_exit, err,
+                      "Received invalid queue_delta for cashier %ld\n", id);
                 }
+                before_parsing = after_parsing;
+                policy_update(policy, id, queue_size, wait);
+                tsdb_append(opt->history, id, now_ms, queue_size);
+                metrics_set(&m->queue_size[id], queue_size);
             }
 
-            // printf("first_closed = %d, undercrowded_count = %d, tresh = %ld\n, open_cash %d, least_cr %d\n",
-             // first_closed, undercrowded_count, opt->undercrowded_cash_treshold, open_cashiers, least_crowded);
-             if (undercrowded_count >=
-                       opt->undercrowded_cash_treshold) {
-                LOG_DEBUG("SHOULD CLOSEW!!!!!\n");
-                if(open_cashiers > 1) {
-                    if(least_crowded == -1) {
-                        ERR("Internal logic error\n");
-                        goto conn_worker_exit;
-                    }
-                    memset(msgbuf, 0, MSG_SIZE);
-                    snprintf(msgbuf, MSG_SIZE, "%s %d %s\n", 
-                         MSG_CASH_HEADER, least_crowded, MSG_CLOSE_CASH);
-
-                    LOG_DEBUG("Sending message: %s\n", msgbuf);
-
-                    if((nwrote = sendn(opt->fd, msgbuf, MSG_SIZE, 0)) <= 0) {
-                        // err = errno;
-                        ERR("Error sending message\n");
-                        goto conn_worker_exit;
-                    }
-                }
-            } else if(first_closed != -1 && overcrowded_cashier >= 0) {
-                memset(msgbuf, 0, MSG_SIZE);
-                snprintf(msgbuf, MSG_SIZE, "%s %d %s\n", 
-                         MSG_CASH_HEADER, first_closed, MSG_OPEN_CASH);
+            if(policy_apply(opt->fd, policy, m) != 0
+               || admission_push(opt->fd, &admission, policy) != 0)
+                goto conn_worker_exit;
+            decision_done(m, MSG_QUEUE_DELTA, recv_ns);
 
-                LOG_DEBUG("Sending message: %s\n", msgbuf);
-                if((nwrote = sendn(opt->fd, msgbuf, MSG_SIZE, 0)) <= 0) {
-                    // err = errno;
-                    ERR("Error sending message\n");
-                    goto conn_worker_exit;
-                }
+        // ========== Handle load counters ==========
+
+        } else if (strncmp(msgbuf, MSG_QUEUE_LOAD,
+                          strlen(MSG_QUEUE_LOAD)) == 0) {
+
+            long arrivals, served, service_ms;
+            metrics_add(&m->received[METRICS_MSG_QUEUE_LOAD], 1);
+            if(sscanf(&msgbuf[strlen(MSG_QUEUE_LOAD)], "%ld %ld %ld",
+                      &arrivals, &served, &service_ms) != 3) {
+                metrics_add(&m->parse_errors, 1);
+                ERR_SET_GOTO(conn_worker_exit, err,
+                  "Received invalid queue_load\n");
             }
+            policy_load(policy, arrivals, served, service_ms);
+            if(policy_apply(opt->fd, policy, m) != 0
+               || admission_push(opt->fd, &admission, policy) != 0)
+                goto conn_worker_exit;
+            decision_done(m, MSG_QUEUE_LOAD, recv_ns);
         } else {
         // ========== Other cases  ==========
             LOG_DEBUG("Unrecognised message\n");
+            metrics_add(&m->received[METRICS_MSG_OTHER], 1);
         }
         // Reset buffer after reading
         memset(msgbuf, 0, MSG_SIZE);
@@ -296,6 +728,7 @@ void* conn_worker(void* arg) {
     
     
 conn_worker_exit:
+    metrics_set(&m->connected, 0);
     MTX_LOCK_EXT(opt->count_mtx);
     // Negative pids are ignored when forwarding signals
     MTX_LOCK_EXT(opt->client_pids_mtx);
@@ -306,7 +739,18 @@ conn_worker_exit:
     COND_SIGNAL_EXT(opt->can_spawn_thread_event);
     MTX_UNLOCK_EXT(opt->count_mtx);
     close(opt->fd);
-    free(queue_size_arr);
+    if(policy != NULL)
+        LOG_NOTICE("Worker %d scaling policy %s opened %ld closed %ld"
+                   " peak_queue %ld\n",
+                   opt->id, policy_mode_names[opt->scaling_policy],
+                   policy->opened, policy->closed_count,
+                   policy->peak_queue);
+    if(policy != NULL && policy->mode == POLICY_PREDICT)
+        LOG_NOTICE("Worker %d forecast samples %d scored %ld mae %.2f/s"
+                   " service_ms %.1f\n", opt->id, policy->series.len,
+                   policy->series.scored, load_series_mae(&policy->series),
+                   policy->service_ms);
+    policy_destroy(policy);
     pthread_exit(NULL);
 }
 
@@ -323,10 +767,14 @@ int main(int argc, char *const argv[]) {
     sigset_t sigset;
     int *running_count = calloc(1, sizeof(int));
     *running_count = 0;
-    pthread_mutex_t *client_pids_mtx = calloc(1, sizeof(pthread_mutex_t)),
-                    *count_mtx = calloc(1, sizeof(pthread_mutex_t));
-    pthread_cond_t *can_spawn_thread_event = calloc(1, sizeof(pthread_cond_t));
+    lock_t *client_pids_mtx = calloc(1, sizeof(lock_t)),
+                    *count_mtx = calloc(1, sizeof(lock_t));
+    lock_cond_t *can_spawn_thread_event = calloc(1, sizeof(lock_cond_t));
     char socket_path[UNIX_MAX_PATH] = {0}, 
+         tsdb_socket_path[UNIX_MAX_PATH] = {0},
+         metrics_socket_path[UNIX_MAX_PATH] = {0},
+         trace_path[PATH_MAX] = DEFAULT_MANAGER_TRACE_PATH,
+         flight_path[PATH_MAX] = DEFAULT_MANAGER_FLIGHT_PATH,
          config_path[PATH_MAX] = {0};
     bool curr_accepted = false;
 
@@ -334,6 +782,37 @@ int main(int argc, char *const argv[]) {
     long undercrowded_cash_treshold = DEFAULT_UNDERCROWDED_CASH_TRESHOLD;
     long overcrowded_cash_treshold = DEFAULT_OVERCROWDED_CASH_TRESHOLD;
     int initial_open_cashiers = DEFAULT_INITIAL_OPEN_CASHIERS;
+    long exit_lease_quota = DEFAULT_EXIT_LEASE_QUOTA;
+    long exit_lease_ms = DEFAULT_EXIT_LEASE_MS;
+    char scaling_policy[16] = DEFAULT_SCALING_POLICY;
+    policy_smooth_t scaling_smooth = {
+        DEFAULT_SCALING_EWMA_ALPHA, DEFAULT_SCALING_EWMA_PERIOD,
+        DEFAULT_SCALING_OPEN_TRESHOLD,
+        DEFAULT_SCALING_CLOSE_TRESHOLD, DEFAULT_SCALING_COOLDOWN
+    };
+    policy_slo_t scaling_slo = {
+        DEFAULT_SLO_P95_WAIT, DEFAULT_SLO_CLOSE_FRACTION,
+        DEFAULT_SCALING_COOLDOWN
+    };
+    policy_predict_t scaling_predict = {
+        DEFAULT_FORECAST_INTERVAL, DEFAULT_FORECAST_HORIZON,
+        DEFAULT_FORECAST_ALPHA, DEFAULT_FORECAST_BETA
+    };
+    policy_mode_t scaling_mode = POLICY_SNAPSHOT;
+    long admission_backlog = DEFAULT_ADMISSION_BACKLOG;
+    long admission_burst = DEFAULT_ADMISSION_BURST;
+    int tsdb_blocks = DEFAULT_TSDB_BLOCKS;
+    tsdb_t **history = NULL;
+    history_opt_t history_opt = { NULL, 0 };
+    worker_metrics_t *metrics = NULL;
+    metrics_opt_t metrics_opt = { NULL, 0 };
+    int metrics_port = DEFAULT_METRICS_PORT;
+    long trace_events = DEFAULT_TRACE_EVENTS;
+    long flight_events = DEFAULT_FLIGHT_EVENTS;
+    struct sockaddr_in inet_addr;
+    query_opt_t query_opt = { .count = 0 };
+    pthread_t query_tid;
+    bool query_running = false;
 
     conn_opt_t *opt = NULL;
 
@@ -345,6 +824,7 @@ int main(int argc, char *const argv[]) {
     sigaddset(&sigset, SIGHUP);
     sigaddset(&sigset, SIGQUIT);
     sigaddset(&sigset, SIGINT);
+    sigaddset(&sigset, SIGUSR1);
     if(pthread_sigmask(SIG_BLOCK, &sigset, NULL) < 0)
         ERR_DIE("Masking signals in main thread\n");
 
@@ -367,6 +847,8 @@ int main(int argc, char *const argv[]) {
 
     // Set default strings
     strncpy(socket_path, DEFAULT_SOCK_PATH, UNIX_MAX_PATH);
+    strncpy(tsdb_socket_path, DEFAULT_TSDB_SOCK_PATH, UNIX_MAX_PATH);
+    strncpy(metrics_socket_path, DEFAULT_METRICS_SOCK_PATH, UNIX_MAX_PATH);
 
     if(access(config_path, F_OK) == -1) {
         err = errno;
@@ -411,9 +893,156 @@ int main(int argc, char *const argv[]) {
         ini_free(config);
         goto main_exit_1;
     }
+    ini_sget(config, NULL, "exit_lease_quota", "%ld", &exit_lease_quota);
+    if(exit_lease_quota < 0) {
+        ERR("exit_lease_quota must be a non negative integer\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "exit_lease_ms", "%ld", &exit_lease_ms);
+    if(exit_lease_ms <= 0) {
+        ERR("exit_lease_ms must be a positive integer\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "scaling_policy", "%15s", &scaling_policy);
+    while(scaling_mode <= POLICY_PREDICT
+          && strcmp(scaling_policy, policy_mode_names[scaling_mode]) != 0)
+        scaling_mode++;
+    if(scaling_mode > POLICY_PREDICT) {
+        ERR("scaling_policy must be snapshot, smooth, slo or predict\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "scaling_ewma_alpha", "%lf",
+             &scaling_smooth.alpha);
+    if(scaling_smooth.alpha <= 0 || scaling_smooth.alpha > 1) {
+        ERR("scaling_ewma_alpha must be in (0, 1]\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "scaling_ewma_period", "%ld",
+             &scaling_smooth.period);
+    if(scaling_smooth.period <= 0) {
+        ERR("scaling_ewma_period must be a positive integer\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "scaling_open_treshold", "%lf",
+             &scaling_smooth.open_treshold);
+    ini_sget(config, NULL, "scaling_close_treshold", "%lf",
+             &scaling_smooth.close_treshold);
+    if(scaling_smooth.close_treshold < 0
+       || scaling_smooth.open_treshold <= scaling_smooth.close_treshold) {
+        ERR("scaling_open_treshold must be greater than"
+            " scaling_close_treshold, which must be non negative\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "scaling_cooldown", "%ld",
+             &scaling_smooth.cooldown);
+    if(scaling_smooth.cooldown < 0) {
+        ERR("scaling_cooldown must be a non negative integer\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    scaling_slo.cooldown = scaling_smooth.cooldown;
+    ini_sget(config, NULL, "slo_p95_wait", "%ld", &scaling_slo.target_wait);
+    if(scaling_slo.target_wait <= 0) {
+        ERR("slo_p95_wait must be a positive integer\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "slo_close_fraction", "%lf",
+             &scaling_slo.close_fraction);
+    if(scaling_slo.close_fraction <= 0 || scaling_slo.close_fraction > 1) {
+        ERR("slo_close_fraction must be in (0, 1]\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "forecast_interval", "%ld",
+             &scaling_predict.interval);
+    ini_sget(config, NULL, "forecast_horizon", "%ld",
+             &scaling_predict.horizon);
+    if(scaling_predict.interval <= 0 || scaling_predict.horizon < 0) {
+        ERR("forecast_interval must be a positive integer and"
+            " forecast_horizon a non negative one\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "forecast_alpha", "%lf", &scaling_predict.alpha);
+    ini_sget(config, NULL, "forecast_beta", "%lf", &scaling_predict.beta);
+    if(scaling_predict.alpha <= 0 || scaling_predict.alpha > 1
+       || scaling_predict.beta < 0 || scaling_predict.beta > 1) {
+        ERR("forecast_alpha must be in (0, 1] and forecast_beta in [0, 1]\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "admission_backlog", "%ld", &admission_backlog);
+    ini_sget(config, NULL, "admission_burst", "%ld", &admission_burst);
+    if(admission_backlog < 0 || admission_burst <= 0) {
+        ERR("admission_backlog must be a non negative integer and"
+            " admission_burst a positive one\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "tsdb_socket_path", "%s", &tsdb_socket_path);
+    if(strlen(tsdb_socket_path) <= 0
+       || strcmp(tsdb_socket_path, socket_path) == 0) {
+        ERR("Invalid tsdb socket path\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "tsdb_blocks", "%d", &tsdb_blocks);
+    if(tsdb_blocks <= 0) {
+        ERR("tsdb_blocks must be a positive integer\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "metrics_socket_path", "%s",
+             &metrics_socket_path);
+    if(strlen(metrics_socket_path) <= 0
+       || strcmp(metrics_socket_path, socket_path) == 0
+       || strcmp(metrics_socket_path, tsdb_socket_path) == 0) {
+        ERR("Invalid metrics socket path\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "metrics_port", "%d", &metrics_port);
+    if(metrics_port < 0 || metrics_port > 65535) {
+        ERR("metrics_port must be a port number, or 0 for none\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "manager_trace_path", "%s", &trace_path);
+    ini_sget(config, NULL, "trace_events", "%ld", &trace_events);
+    if(trace_events <= 0) {
+        ERR("trace_events must be a positive integer\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "manager_flight_path", "%s", &flight_path);
+    ini_sget(config, NULL, "flight_events", "%ld", &flight_events);
+    if(flight_events <= 0) {
+        ERR("flight_events must be a positive integer\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
 
     ini_free(config);
 
+    if(strlen(trace_path) > 0) {
+        if(trace_init("manager", trace_events) != 0) {
+            ERR("Starting the trace\n");
+            goto main_exit_1;
+        }
+        LOG_NOTICE("Tracing to %s\n", trace_path);
+    }
+    if(strlen(flight_path) > 0
+       && flight_init(flight_path, "manager", flight_events,
+                      manager_pool_size + FLIGHT_SPARE_RINGS) != 0)
+        ERR("Starting the flight recorder at %s\n", flight_path);
+
     // ========== Data initialization ==========
 
     conn_tid = calloc(manager_pool_size, sizeof(pthread_t));
@@ -421,6 +1050,9 @@ int main(int argc, char *const argv[]) {
     client_pids = calloc(manager_pool_size, sizeof(pid_t));
     opt = calloc(manager_pool_size, sizeof(conn_opt_t));
     running_arr = calloc(manager_pool_size, sizeof(int));
+    history = calloc(manager_pool_size, sizeof(tsdb_t*));
+    if((metrics = metrics_init(manager_pool_size, num_cashiers)) == NULL)
+        ERR_DIE("Allocating metrics\n");
 
     for(int i = 0; i < manager_pool_size; i++) {
         conn_tid[i] = 0;
@@ -430,16 +1062,18 @@ int main(int argc, char *const argv[]) {
             char errs[1024] = {0}; strerror_r(err, errs, 1024);
             ERR_DIE("Initializing thread attributes: %s\n", errs);
         }
+        if((history[i] = tsdb_init(num_cashiers, tsdb_blocks)) == NULL)
+            ERR_DIE("Allocating queue size history\n");
     }
 
     // Initializing mutexes, conds and thread attributes
     if(pthread_attr_init(&sig_attr) < 0)
         ERR_DIE("Initializing thread attributes\n");
-    if(pthread_mutex_init(count_mtx, NULL) < 0)
+    if(lock_init(count_mtx) < 0)
         ERR_DIE("Allocating mutex\n");
-    if(pthread_mutex_init(client_pids_mtx, NULL) < 0)
+    if(lock_init(client_pids_mtx) < 0)
         ERR_DIE("Allocating mutex\n");
-    if(pthread_cond_init(can_spawn_thread_event, NULL) < 0)
+    if(lock_cond_init(can_spawn_thread_event) < 0)
         ERR_DIE("Allocating cond var\n");
 
     // Spawnsignal handler thread
@@ -473,6 +1107,46 @@ int main(int argc, char *const argv[]) {
     SYSCALL_SET_GOTO(err, listen(sock_fd, manager_pool_size),
                      "Listening on socket\n", err, main_exit_2);
 
+    // History and metrics queries get their own sockets and thread
+    history_opt.history = history;
+    history_opt.count = manager_pool_size;
+    metrics_opt.metrics = metrics;
+    metrics_opt.count = manager_pool_size;
+    memset(&query_opt, 0, sizeof(query_opt));
+    query_opt.listeners[0] = (query_listener_t) {
+        -1, history_answer, &history_opt
+    };
+    query_opt.listeners[1] = (query_listener_t) {
+        -1, metrics_answer, &metrics_opt
+    };
+    query_opt.listeners[2] = (query_listener_t) {
+        -1, metrics_answer, &metrics_opt
+    };
+    query_opt.count = metrics_port > 0 ? 3 : 2;
+    strncpy(addr.sun_path, tsdb_socket_path, UNIX_MAX_PATH);
+    unlink(tsdb_socket_path);
+    if((query_opt.listeners[0].fd = query_listen(AF_UNIX,
+        (struct sockaddr*) &addr, sizeof(addr))) == -1) goto main_exit_2;
+    strncpy(addr.sun_path, metrics_socket_path, UNIX_MAX_PATH);
+    unlink(metrics_socket_path);
+    if((query_opt.listeners[1].fd = query_listen(AF_UNIX,
+        (struct sockaddr*) &addr, sizeof(addr))) == -1) goto main_exit_2;
+    if(metrics_port > 0) {
+        memset(&inet_addr, 0, sizeof(inet_addr));
+        inet_addr.sin_family = AF_INET;
+        inet_addr.sin_port = htons(metrics_port);
+        inet_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if((query_opt.listeners[2].fd = query_listen(AF_INET,
+            (struct sockaddr*) &inet_addr, sizeof(inet_addr))) == -1)
+            goto main_exit_2;
+    }
+    if((err = pthread_create(&query_tid, NULL, query_worker,
+                             &query_opt)) != 0) {
+        char errs[1024] = {0}; strerror_r(err, errs, 1024);
+        ERR_SET_GOTO(main_exit_2, err, "Spawning query thread: %s", errs);
+    }
+    query_running = true;
+
     while (!should_quit) {
         for(int i = 0; i < manager_pool_size; i++) {
             if(running_arr[i] == 2) {
@@ -522,8 +1196,18 @@ int main(int argc, char *const argv[]) {
         opt[c_thr].num_cashiers = num_cashiers;
         opt[c_thr].undercrowded_cash_treshold = undercrowded_cash_treshold;
         opt[c_thr].overcrowded_cash_treshold = overcrowded_cash_treshold;
+        opt[c_thr].scaling_policy = scaling_mode;
+        opt[c_thr].scaling_smooth = scaling_smooth;
+        opt[c_thr].scaling_slo = scaling_slo;
+        opt[c_thr].scaling_predict = scaling_predict;
+        opt[c_thr].admission_backlog = admission_backlog;
+        opt[c_thr].admission_burst = admission_burst;
+        opt[c_thr].history = history[c_thr];
+        opt[c_thr].metrics = &metrics[c_thr];
         opt[c_thr].running_arr = running_arr;
         opt[c_thr].initial_open_cashiers = initial_open_cashiers;
+        opt[c_thr].exit_lease_quota = exit_lease_quota;
+        opt[c_thr].exit_lease_ms = exit_lease_ms;
         err = pthread_create(&conn_tid[c_thr], &conn_attrs[c_thr],
                              conn_worker, opt);
         if(err != 0) {
@@ -547,6 +1231,22 @@ main_exit_2:
             pthread_attr_destroy(&conn_attrs[i]);
         }
     }
+    if(query_running) pthread_join(query_tid, NULL);
+    for(int i = 0; i < query_opt.count; i++)
+        if(query_opt.listeners[i].fd != -1) close(query_opt.listeners[i].fd);
+    for(int i = 0; i < manager_pool_size; i++) {
+        uint64_t samples, bits;
+        if(history[i] == NULL) continue;
+        tsdb_stats(history[i], &samples, &bits);
+        if(samples > 0)
+            LOG_NOTICE("Worker %d history samples %lu bytes_per_sample"
+                       " %.2f\n", i, samples, bits / 8.0 / samples);
+        tsdb_destroy(history[i]);
+    }
+    free(history);
+    metrics_destroy(metrics, manager_pool_size);
+    if(trace_on() && trace_write(trace_path) != 0)
+        ERR("Writing the trace to %s\n", trace_path);
     free(opt);
     free(conn_attrs);
     free(conn_tid);
@@ -559,5 +1259,9 @@ main_exit_1:
     free(count_mtx);
     free(client_pids_mtx);
     unlink(socket_path);
+    unlink(tsdb_socket_path);
+    unlink(metrics_socket_path);
+    trace_destroy();
+    flight_destroy(0);
     return 0;
 }
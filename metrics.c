@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "metrics.h"
+
+static const char *msg_names[METRICS_MSG_KINDS] = {
+    "hello", "lease", "cust_batch", "cust",
+    "queue_size", "queue_delta", "queue_load", "other"
+};
+
+worker_metrics_t* metrics_init(int count, int num_cashiers) {
+    worker_metrics_t *m = calloc(count, sizeof(worker_metrics_t));
+    if(m == NULL) return NULL;
+    for(int i = 0; i < count; i++) {
+        if((m[i].queue_size = malloc(num_cashiers * sizeof(long))) == NULL) {
+            metrics_destroy(m, i);
+            return NULL;
+        }
+        for(int c = 0; c < num_cashiers; c++) m[i].queue_size[c] = -1;
+        m[i].num_cashiers = num_cashiers;
+        histogram_init(&m[i].decision_ns);
+    }
+    return m;
+}
+
+void metrics_destroy(worker_metrics_t *m, int count) {
+    if(m == NULL) return;
+    for(int i = 0; i < count; i++) free(m[i].queue_size);
+    free(m);
+}
+
+static uint64_t load(uint64_t *v) {
+    return __atomic_load_n(v, __ATOMIC_RELAXED);
+}
+
+static void write_counter(FILE *out, const char *name, const char *help,
+                          worker_metrics_t *m, int count, size_t offset) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for(int i = 0; i < count; i++)
+        fprintf(out, "%s{worker=\"%d\"} %lu\n", name, i,
+                load((uint64_t *) ((char *) &m[i] + offset)));
+}
+
+// Cumulative buckets up to the last non empty one, in seconds
+static void write_histogram(FILE *out, const char *name, int worker,
+                            histogram_t *h) {
+    uint64_t seen = 0, count = load(&h->count);
+    int last = 0;
+    for(int b = 0; b < HISTOGRAM_BUCKETS; b++)
+        if(load(&h->buckets[b]) > 0) last = b;
+    for(int b = 0; b <= last && b < 64; b++) {
+        seen += load(&h->buckets[b]);
+        fprintf(out, "%s_bucket{worker=\"%d\",le=\"%g\"} %lu\n", name,
+                worker, (b == 0 ? 0 : (double) ((1ull << b) - 1)) / 1e9,
+                seen);
+    }
+    // The bucket counts and count are not read at once
+    if(count < seen) count = seen;
+    fprintf(out, "%s_bucket{worker=\"%d\",le=\"+Inf\"} %lu\n", name, worker,
+            count);
+    fprintf(out, "%s_sum{worker=\"%d\"} %g\n", name, worker,
+            load(&h->sum) / 1e9);
+    fprintf(out, "%s_count{worker=\"%d\"} %lu\n", name, worker, count);
+}
+
+void metrics_write(FILE *out, worker_metrics_t *m, int count) {
+    long connected = 0, size;
+    for(int i = 0; i < count; i++)
+        connected += __atomic_load_n(&m[i].connected, __ATOMIC_RELAXED);
+    fprintf(out, "# HELP manager_supermarkets_connected"
+            " Supermarkets connected to the manager\n"
+            "# TYPE manager_supermarkets_connected gauge\n"
+            "manager_supermarkets_connected %ld\n", connected);
+
+    fprintf(out, "# HELP manager_cashiers_open Open cashiers\n"
+            "# TYPE manager_cashiers_open gauge\n");
+    for(int i = 0; i < count; i++)
+        fprintf(out, "manager_cashiers_open{worker=\"%d\"} %ld\n", i,
+                __atomic_load_n(&m[i].open_count, __ATOMIC_RELAXED));
+
+    fprintf(out, "# HELP manager_queue_size"
+            " Last reported queue size, -1 if closed\n"
+            "# TYPE manager_queue_size gauge\n");
+    for(int i = 0; i < count; i++) {
+        for(int c = 0; c < m[i].num_cashiers; c++) {
+            size = __atomic_load_n(&m[i].queue_size[c], __ATOMIC_RELAXED);
+            fprintf(out, "manager_queue_size{worker=\"%d\",cashier=\"%d\"}"
+                    " %ld\n", i, c, size);
+        }
+    }
+
+    fprintf(out, "# HELP manager_messages_received_total"
+            " Messages received from supermarkets\n"
+            "# TYPE manager_messages_received_total counter\n");
+    for(int i = 0; i < count; i++)
+        for(int k = 0; k < METRICS_MSG_KINDS; k++)
+            fprintf(out, "manager_messages_received_total"
+                    "{worker=\"%d\",type=\"%s\"} %lu\n", i, msg_names[k],
+                    load(&m[i].received[k]));
+
+    write_counter(out, "manager_parse_errors_total",
+                  "Malformed messages received", m, count,
+                  offsetof(worker_metrics_t, parse_errors));
+    write_counter(out, "manager_cashiers_opened_total",
+                  "Orders to open a cashier", m, count,
+                  offsetof(worker_metrics_t, opened));
+    write_counter(out, "manager_cashiers_closed_total",
+                  "Orders to close a cashier", m, count,
+                  offsetof(worker_metrics_t, closed));
+
+    fprintf(out, "# HELP manager_decision_seconds"
+            " Time from a queue report to the decision sent\n"
+            "# TYPE manager_decision_seconds histogram\n");
+    for(int i = 0; i < count; i++)
+        write_histogram(out, "manager_decision_seconds", i,
+                        &m[i].decision_ns);
+}
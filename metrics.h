@@ -0,0 +1,56 @@
+#ifndef metrics_h_INCLUDED
+#define metrics_h_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+#include "histogram.h"
+
+// Live state of the manager connection workers, written by each worker
+// with relaxed atomics and read by the scraper at any time, so a scrape
+// never waits on a worker nor a worker on a scrape. Values read in one
+// scrape may come from different instants.
+
+typedef enum metrics_msg_e {
+    METRICS_MSG_HELLO,
+    METRICS_MSG_LEASE,
+    METRICS_MSG_CUST_BATCH,
+    METRICS_MSG_CUST,
+    METRICS_MSG_QUEUE_SIZE,
+    METRICS_MSG_QUEUE_DELTA,
+    METRICS_MSG_QUEUE_LOAD,
+    METRICS_MSG_OTHER,
+    METRICS_MSG_KINDS
+} metrics_msg_t;
+
+typedef struct worker_metrics_s {
+    int num_cashiers;
+    // 1 while a supermarket is connected
+    long connected;
+    // Last reported queue size of every cashier, -1 if closed
+    long *queue_size;
+    long open_count;
+    uint64_t received[METRICS_MSG_KINDS];
+    uint64_t parse_errors;
+    uint64_t opened;
+    uint64_t closed;
+    // ns from receiving a report to having acted on it
+    histogram_t decision_ns;
+} worker_metrics_t;
+
+/* Returns NULL on failure */
+worker_metrics_t* metrics_init(int count, int num_cashiers);
+
+void metrics_destroy(worker_metrics_t *m, int count);
+
+static inline void metrics_add(uint64_t *counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_set(long *gauge, long value) {
+    __atomic_store_n(gauge, value, __ATOMIC_RELAXED);
+}
+
+/* Write the metrics of count workers in the Prometheus text format */
+void metrics_write(FILE *out, worker_metrics_t *m, int count);
+
+#endif // metrics_h_INCLUDED
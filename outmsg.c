@@ -0,0 +1,19 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "util.h"
+#include "outmsg.h"
+
+outmsg_t* outmsg_new(void) {
+    return calloc(1, sizeof(outmsg_t));
+}
+
+int outmsg_enqueue(conc_lqueue_t *q, outmsg_t *m) {
+    m->queued_ns = now_ns();
+    if(conc_lqueue_enqueue(q, (void*) m) != 0) {
+        ERR("Error enqueueing message: %s", m->frame);
+        free(m);
+        return -1;
+    }
+    return 0;
+}
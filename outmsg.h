@@ -0,0 +1,22 @@
+#ifndef outmsg_h_INCLUDED
+#define outmsg_h_INCLUDED
+
+#include <stdint.h>
+#include "conc_lqueue.h"
+#include "config.h"
+
+// A frame waiting to be sent to the manager. The time it was queued
+// is kept to measure how long it waited behind the others
+typedef struct outmsg_s {
+    // CLOCK_MONOTONIC ns when the message was queued
+    uint64_t queued_ns;
+    char frame[MSG_SIZE];
+} outmsg_t;
+
+/* Zeroed message, NULL on failure */
+outmsg_t* outmsg_new(void);
+
+/* Stamp and queue m. On failure m is freed and -1 is returned */
+int outmsg_enqueue(conc_lqueue_t *q, outmsg_t *m);
+
+#endif // outmsg_h_INCLUDED
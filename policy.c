@@ -0,0 +1,425 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "util.h"
+#include "config.h"
+#include "policy.h"
+
+const char *policy_mode_names[] = { "snapshot", "smooth", "slo", "predict" };
+
+// ========== Indexed heaps ==========
+
+typedef bool (*policy_less_t)(policy_t *p, int a, int b);
+
+// Open cashiers, shortest line first, ties to the lowest ID
+static bool open_less(policy_t *p, int a, int b) {
+    if (p->mode == POLICY_SMOOTH) {
+        if (p->ewma[a] != p->ewma[b]) return p->ewma[a] < p->ewma[b];
+    } else if (p->mode >= POLICY_SLO) {
+        if (p->wait[a] != p->wait[b]) return p->wait[a] < p->wait[b];
+    } else if (p->queue_size[a] != p->queue_size[b]) {
+        return p->queue_size[a] < p->queue_size[b];
+    }
+    return a < b;
+}
+
+// Closed cashiers, first closed first with cooldowns, else lowest ID
+static bool closed_less(policy_t *p, int a, int b) {
+    if (p->mode != POLICY_SNAPSHOT && p->flipped_ns[a] != p->flipped_ns[b])
+        return p->flipped_ns[a] < p->flipped_ns[b];
+    return a < b;
+}
+
+static void heap_swap(policy_heap_t *h, int i, int j) {
+    int tmp = h->ids[i];
+    h->ids[i] = h->ids[j];
+    h->ids[j] = tmp;
+    h->pos[h->ids[i]] = i;
+    h->pos[h->ids[j]] = j;
+}
+
+static void heap_up(policy_t *p, policy_heap_t *h, policy_less_t less, int i) {
+    while (i > 0 && less(p, h->ids[i], h->ids[(i - 1) / 2])) {
+        heap_swap(h, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void heap_down(policy_t *p, policy_heap_t *h, policy_less_t less,
+                      int i) {
+    int min, l, r;
+    for (;;) {
+        min = i;
+        l = 2 * i + 1;
+        r = l + 1;
+        if (l < h->len && less(p, h->ids[l], h->ids[min])) min = l;
+        if (r < h->len && less(p, h->ids[r], h->ids[min])) min = r;
+        if (min == i) return;
+        heap_swap(h, i, min);
+        i = min;
+    }
+}
+
+static void heap_push(policy_t *p, policy_heap_t *h, policy_less_t less,
+                      int id) {
+    h->ids[h->len] = id;
+    h->pos[id] = h->len++;
+    heap_up(p, h, less, h->pos[id]);
+}
+
+// The key of id changed, move it to its place
+static void heap_fix(policy_t *p, policy_heap_t *h, policy_less_t less,
+                     int id) {
+    heap_up(p, h, less, h->pos[id]);
+    heap_down(p, h, less, h->pos[id]);
+}
+
+static void heap_remove(policy_t *p, policy_heap_t *h, policy_less_t less,
+                        int id) {
+    int i = h->pos[id], moved;
+    h->pos[id] = -1;
+    if (--h->len == i) return;
+    // The last one takes its place and moves from there
+    moved = h->ids[h->len];
+    h->ids[i] = moved;
+    h->pos[moved] = i;
+    heap_fix(p, h, less, moved);
+}
+
+static int heap_init(policy_heap_t *h, int size) {
+    h->ids = calloc(size, sizeof(int));
+    h->pos = calloc(size, sizeof(int));
+    h->len = 0;
+    if (h->ids == NULL || h->pos == NULL) return -1;
+    for (int i = 0; i < size; i++) h->pos[i] = -1;
+    return 0;
+}
+
+// ========== Aggregates ==========
+
+// Add (sign 1) or remove (sign -1) the contribution of a cashier
+static void count(policy_t *p, int id, int sign) {
+    long queue_size = p->queue_size[id];
+    if (queue_size < 0) return;
+    p->open_count += sign;
+    p->queued += sign * queue_size;
+    if (p->mode == POLICY_SMOOTH) {
+        if (p->ewma[id] >= p->smooth.open_treshold)
+            p->overcrowded_count += sign;
+        else if (p->ewma[id] <= p->smooth.close_treshold)
+            p->undercrowded_count += sign;
+        return;
+    }
+    if (p->mode >= POLICY_SLO) {
+        if (p->wait[id] > p->slo.target_wait) p->overcrowded_count += sign;
+        p->wait_sum += sign * p->wait[id];
+        return;
+    }
+    // An empty line is never overcrowded, whatever the treshold
+    if (queue_size > 0 && queue_size >= p->overcrowded_treshold)
+        p->overcrowded_count += sign;
+    else if (queue_size <= 1)
+        p->undercrowded_count += sign;
+}
+
+policy_t* policy_init(int num_cashiers, int initial_open,
+                      long undercrowded_treshold, long overcrowded_treshold) {
+    policy_t *p = calloc(1, sizeof(policy_t));
+    if (p == NULL) return NULL;
+    p->mode = POLICY_SNAPSHOT;
+    // Load samples are taken in every mode, for the service time
+    p->predict.interval = DEFAULT_FORECAST_INTERVAL;
+    p->predict.horizon = DEFAULT_FORECAST_HORIZON;
+    p->predict.alpha = DEFAULT_FORECAST_ALPHA;
+    p->predict.beta = DEFAULT_FORECAST_BETA;
+    p->num_cashiers = num_cashiers;
+    p->undercrowded_treshold = undercrowded_treshold;
+    p->overcrowded_treshold = overcrowded_treshold;
+    p->queue_size = calloc(num_cashiers, sizeof(long));
+    if (p->queue_size == NULL
+        || heap_init(&p->open, num_cashiers) != 0
+        || heap_init(&p->closed, num_cashiers) != 0) {
+        policy_destroy(p);
+        return NULL;
+    }
+    for (int i = 0; i < num_cashiers; i++) {
+        p->queue_size[i] = i < initial_open ? 0 : -1;
+        count(p, i, 1);
+        if (p->queue_size[i] < 0) heap_push(p, &p->closed, closed_less, i);
+        else heap_push(p, &p->open, open_less, i);
+    }
+    return p;
+}
+
+void policy_destroy(policy_t *p) {
+    if (p == NULL) return;
+    free(p->queue_size);
+    free(p->ewma);
+    free(p->ewma_ns);
+    free(p->wait);
+    free(p->flipped_ns);
+    load_series_destroy(&p->series);
+    free(p->open.ids);
+    free(p->open.pos);
+    free(p->closed.ids);
+    free(p->closed.pos);
+    free(p);
+}
+
+int policy_set_smooth(policy_t *p, const policy_smooth_t *smooth) {
+    uint64_t now = now_ns();
+    p->ewma = calloc(p->num_cashiers, sizeof(double));
+    p->ewma_ns = calloc(p->num_cashiers, sizeof(uint64_t));
+    p->flipped_ns = calloc(p->num_cashiers, sizeof(uint64_t));
+    if (p->ewma == NULL || p->ewma_ns == NULL || p->flipped_ns == NULL)
+        return -1;
+    for (int i = 0; i < p->num_cashiers; i++) p->ewma_ns[i] = now;
+    // Every open cashier is empty yet and every flip time is 0, so the
+    // heaps are already in order for the new keys
+    for (int i = 0; i < p->num_cashiers; i++) count(p, i, -1);
+    p->mode = POLICY_SMOOTH;
+    p->smooth = *smooth;
+    p->cooldown = smooth->cooldown;
+    for (int i = 0; i < p->num_cashiers; i++) count(p, i, 1);
+    return 0;
+}
+
+int policy_set_slo(policy_t *p, const policy_slo_t *slo) {
+    p->wait = calloc(p->num_cashiers, sizeof(long));
+    p->flipped_ns = calloc(p->num_cashiers, sizeof(uint64_t));
+    if (p->wait == NULL || p->flipped_ns == NULL) return -1;
+    // As for smooth mode, no wait yet keeps the heaps in order
+    for (int i = 0; i < p->num_cashiers; i++) count(p, i, -1);
+    p->mode = POLICY_SLO;
+    p->slo = *slo;
+    p->cooldown = slo->cooldown;
+    for (int i = 0; i < p->num_cashiers; i++) count(p, i, 1);
+    return 0;
+}
+
+int policy_set_predict(policy_t *p, const policy_slo_t *slo,
+                       const policy_predict_t *predict) {
+    if (policy_set_slo(p, slo) != 0
+        || load_series_init(&p->series, FORECAST_HISTORY) != 0)
+        return -1;
+    // Same counts and keys as slo mode
+    p->mode = POLICY_PREDICT;
+    p->predict = *predict;
+    holt_init(&p->arrival_rate, predict->alpha, predict->beta);
+    return 0;
+}
+
+void policy_load(policy_t *p, long arrivals, long served, long service_ms) {
+    uint64_t now = now_ns();
+    double dt, forecast, rate;
+    load_sample_t sample;
+    dt = (now - p->load_ns) / 1e9;
+    if (p->load_ns != 0 && dt * 1000 < p->predict.interval) return;
+    // The first report, or counters from another supermarket run
+    if (p->load_ns == 0 || arrivals < p->load_arrivals
+        || served < p->load_served) {
+        p->load_ns = now;
+        p->load_arrivals = arrivals;
+        p->load_served = served;
+        p->load_service_ms = service_ms;
+        return;
+    }
+    if (served > p->load_served) {
+        double sample_ms = (double) (service_ms - p->load_service_ms)
+            / (served - p->load_served);
+        p->service_ms = p->service_ms == 0 ? sample_ms
+            : p->service_ms + p->predict.alpha * (sample_ms - p->service_ms);
+    }
+    if (p->mode != POLICY_PREDICT) goto policy_load_exit;
+    holt_update(&p->arrival_rate, (arrivals - p->load_arrivals) / dt, dt);
+    forecast = holt_forecast(&p->arrival_rate, p->predict.horizon / 1000.0);
+    if (forecast < 0) forecast = 0;
+    // A rising trend opens cashiers early, a falling one waits for the
+    // level to come down before closing them
+    rate = forecast > p->arrival_rate.level
+        ? forecast : p->arrival_rate.level;
+    sample.t_ns = now;
+    sample.arrival_rate = (arrivals - p->load_arrivals) / dt;
+    sample.queued = p->queued;
+    sample.forecast = forecast;
+    load_series_add(&p->series, &sample,
+                    (uint64_t) p->predict.horizon * 1000000ull);
+    if (p->service_ms > 0)
+        p->desired = erlang_c_servers(rate, 1000.0 / p->service_ms,
+                                      p->slo.target_wait / 1000.0, 0.05,
+                                      p->num_cashiers);
+policy_load_exit:
+    p->load_ns = now;
+    p->load_arrivals = arrivals;
+    p->load_served = served;
+    p->load_service_ms = service_ms;
+}
+
+// Pull the average of cashier id toward the size it held since it was
+// last brought up to date, by alpha for every period ms
+static void smooth_age(policy_t *p, int id, long held, uint64_t now) {
+    double periods;
+    if (now <= p->ewma_ns[id]) return;
+    periods = (now - p->ewma_ns[id]) / (p->smooth.period * 1e6);
+    p->ewma[id] += (1 - pow(1 - p->smooth.alpha, periods))
+        * (held - p->ewma[id]);
+    p->ewma_ns[id] = now;
+}
+
+// Fold a new report into the average of cashier id: the old size
+// lasted until now, the new one counts from now on
+static void smooth_update(policy_t *p, int id, long old, long queue_size) {
+    uint64_t now = now_ns();
+    if (old < 0 && queue_size >= 0) {
+        // A new line starts from what it has, not from before closing
+        p->ewma[id] = queue_size;
+        p->flipped_ns[id] = now;
+    } else if (old >= 0 && queue_size < 0) {
+        p->flipped_ns[id] = now;
+    } else if (queue_size >= 0) {
+        smooth_age(p, id, old, now);
+    }
+    p->ewma_ns[id] = now;
+}
+
+static void slo_update(policy_t *p, int id, long old, long queue_size,
+                       long wait) {
+    if ((old < 0) != (queue_size < 0)) {
+        p->flipped_ns[id] = now_ns();
+        p->wait[id] = 0;
+    }
+    if (queue_size >= 0 && wait >= 0) p->wait[id] = wait;
+}
+
+void policy_update(policy_t *p, int id, long queue_size, long wait) {
+    long old;
+    if (id < 0 || id >= p->num_cashiers) return;
+    if (queue_size < -1) queue_size = -1;
+    old = p->queue_size[id];
+    // The wait of an open cashier may have changed
+    if (old == queue_size && (queue_size < 0
+                              || p->mode == POLICY_SMOOTH
+                              || p->mode == POLICY_SNAPSHOT
+                              || (p->mode >= POLICY_SLO
+                                  && (wait < 0 || wait == p->wait[id]))))
+        return;
+    count(p, id, -1);
+    p->queue_size[id] = queue_size;
+    if (p->mode == POLICY_SMOOTH) smooth_update(p, id, old, queue_size);
+    else if (p->mode >= POLICY_SLO)
+        slo_update(p, id, old, queue_size, wait);
+    count(p, id, 1);
+    if (queue_size > p->peak_queue) p->peak_queue = queue_size;
+    if (old < 0) {
+        heap_remove(p, &p->closed, closed_less, id);
+        heap_push(p, &p->open, open_less, id);
+    } else if (queue_size < 0) {
+        heap_remove(p, &p->open, open_less, id);
+        heap_push(p, &p->closed, closed_less, id);
+    } else {
+        heap_fix(p, &p->open, open_less, id);
+    }
+}
+
+static policy_action_t snapshot_decide(policy_t *p, int *id) {
+    if (p->undercrowded_count >= p->undercrowded_treshold) {
+        if (p->open_count > 1) {
+            *id = p->open.ids[0];
+            return POLICY_CLOSE;
+        }
+    } else if (p->closed.len > 0 && p->overcrowded_count > 0) {
+        *id = p->closed.ids[0];
+        return POLICY_OPEN;
+    }
+    return POLICY_NONE;
+}
+
+static bool cooled_down(policy_t *p, int id, uint64_t now) {
+    return now - p->flipped_ns[id] >= (uint64_t) p->cooldown * 1000000ull;
+}
+
+static policy_action_t smooth_decide(policy_t *p, int *id) {
+    uint64_t now = now_ns();
+    int open_id;
+    // A line that stopped changing sends no report, its average still
+    // has to move toward the size it keeps. Every key moved, so the
+    // open heap is built again
+    for (int i = 0; i < p->open.len; i++) {
+        open_id = p->open.ids[i];
+        count(p, open_id, -1);
+        smooth_age(p, open_id, p->queue_size[open_id], now);
+        count(p, open_id, 1);
+    }
+    for (int i = p->open.len / 2 - 1; i >= 0; i--)
+        heap_down(p, &p->open, open_less, i);
+    if (p->overcrowded_count > 0) {
+        if (p->closed.len > 0 && cooled_down(p, p->closed.ids[0], now)) {
+            *id = p->closed.ids[0];
+            return POLICY_OPEN;
+        }
+    } else if (p->undercrowded_count >= p->undercrowded_treshold
+               && p->open_count > 1 && cooled_down(p, p->open.ids[0], now)) {
+        *id = p->open.ids[0];
+        return POLICY_CLOSE;
+    }
+    return POLICY_NONE;
+}
+
+static policy_action_t slo_decide(policy_t *p, int *id) {
+    uint64_t now = now_ns();
+    // More than 5% of the lines are late, so is the p95
+    if (p->overcrowded_count * 20 > p->open_count) {
+        if (p->closed.len > 0 && cooled_down(p, p->closed.ids[0], now)) {
+            *id = p->closed.ids[0];
+            return POLICY_OPEN;
+        }
+    } else if (p->overcrowded_count == 0 && p->open_count > 1
+               && p->wait_sum <= p->slo.close_fraction * p->slo.target_wait
+                                 * (p->open_count - 1)
+               && cooled_down(p, p->open.ids[0], now)) {
+        *id = p->open.ids[0];
+        return POLICY_CLOSE;
+    }
+    return POLICY_NONE;
+}
+
+static policy_action_t predict_decide(policy_t *p, int *id) {
+    uint64_t now = now_ns();
+    // Enough cashiers for the forecast, and to serve the lines
+    // already there within the target
+    long desired = (p->wait_sum + p->slo.target_wait - 1)
+        / p->slo.target_wait;
+    if (desired < p->desired) desired = p->desired;
+    if (desired < 1) desired = 1;
+    if (p->open_count < desired
+        || p->overcrowded_count * 20 > p->open_count) {
+        if (p->closed.len > 0 && cooled_down(p, p->closed.ids[0], now)) {
+            *id = p->closed.ids[0];
+            return POLICY_OPEN;
+        }
+    } else if (p->open_count > desired && p->overcrowded_count == 0
+               && cooled_down(p, p->open.ids[0], now)) {
+        *id = p->open.ids[0];
+        return POLICY_CLOSE;
+    }
+    return POLICY_NONE;
+}
+
+policy_action_t policy_decide(policy_t *p, int *id) {
+    policy_action_t action;
+    switch (p->mode) {
+    case POLICY_SMOOTH: action = smooth_decide(p, id); break;
+    case POLICY_SLO: action = slo_decide(p, id); break;
+    case POLICY_PREDICT: action = predict_decide(p, id); break;
+    default: action = snapshot_decide(p, id); break;
+    }
+    if (action == POLICY_OPEN) {
+        policy_update(p, *id, 0, 0);
+        p->opened++;
+    } else if (action == POLICY_CLOSE) {
+        policy_update(p, *id, -1, -1);
+        p->closed_count++;
+    }
+    return action;
+}
@@ -0,0 +1,193 @@
+#ifndef policy_h_INCLUDED
+#define policy_h_INCLUDED
+
+// Scaling policy of the manager. The aggregates a decision needs are
+// kept up to date on every queue size change instead of being
+// recomputed from all the cashiers, so both an update and a decision
+// cost O(log num_cashiers) at most:
+//  - counts of open, undercrowded (0 or 1 customer) and overcrowded
+//    (at least overcrowded_treshold customers) cashiers
+//  - an indexed min heap of the open cashiers by (queue size, id)
+//  - an indexed min heap of the closed cashiers by id
+//
+// In smooth mode the counts and the open heap use an EWMA of the
+// reported queue sizes instead of the last one. It is weighted by how
+// long each size lasted rather than by report, since a line only
+// reports when it changes, and a decision first brings the averages of
+// all the open cashiers up to date and rebuilds the open heap, in
+// O(num_cashiers).
+// A cashier is
+// overcrowded above open_treshold and undercrowded below
+// close_treshold, and a cashier that was just opened or closed is left
+// alone for cooldown ms. The closed heap is ordered by closing time, so
+// its top is the first cashier out of cooldown.
+//
+// In slo mode the supermarket also reports the estimated wait of every
+// line, and the open heap is ordered by it. A cashier is overcrowded
+// when its wait is above the target: a cashier is opened when more than
+// 5% of the open ones are, so that the p95 of the waits a newcomer finds
+// stays below the target. One is closed when none is late and the
+// whole wait spread over one less cashier stays within close_fraction
+// of the target. Cooldowns apply as in smooth mode.
+//
+// Predict mode works as slo mode and also sizes the cashiers ahead of
+// time: the supermarket reports how many customers arrived and were
+// served so far, the arrival rate is forecast horizon ms ahead with
+// Holt smoothing, and an M/M/c model of the forecast load gives the
+// cashiers needed to meet the target then. Those needed to serve the
+// lines already formed within the target count as well.
+
+#include <stdint.h>
+#include "forecast.h"
+
+typedef enum policy_mode_e {
+    // Act on the last reported queue sizes
+    POLICY_SNAPSHOT,
+    // Act on smoothed queue sizes, with hysteresis and cooldowns
+    POLICY_SMOOTH,
+    // Act on the estimated waits, against a p95 target
+    POLICY_SLO,
+    // As POLICY_SLO, plus a forecast of the load
+    POLICY_PREDICT
+} policy_mode_t;
+
+// Indexed by policy_mode_t, as in the scaling_policy config key
+extern const char *policy_mode_names[];
+
+typedef struct policy_smooth_s {
+    // Weight in the average of a size held for period ms, in (0, 1]
+    double alpha;
+    long period;
+    // Smoothed size at which a cashier is overcrowded
+    double open_treshold;
+    // Smoothed size at which a cashier is undercrowded,
+    // below open_treshold
+    double close_treshold;
+    // ms a cashier stays as it is after being opened or closed
+    long cooldown;
+} policy_smooth_t;
+
+typedef struct policy_slo_s {
+    // ms the p95 of the waits should stay under
+    long target_wait;
+    // Share of the target the average wait must stay within after a
+    // close, in (0, 1]
+    double close_fraction;
+    // ms a cashier stays as it is after being opened or closed
+    long cooldown;
+} policy_slo_t;
+
+typedef struct policy_predict_s {
+    // ms between two load samples at least
+    long interval;
+    // ms ahead to size the cashiers for
+    long horizon;
+    // Holt weights of the level and of the trend
+    double alpha;
+    double beta;
+} policy_predict_t;
+
+typedef enum policy_action_e {
+    POLICY_NONE,
+    POLICY_OPEN,
+    POLICY_CLOSE
+} policy_action_t;
+
+// Binary heap of cashier IDs with the position of each ID, so that
+// any of them can be moved or removed in O(log n)
+typedef struct policy_heap_s {
+    int *ids;
+    // Position of every cashier in ids, -1 if not in the heap
+    int *pos;
+    int len;
+} policy_heap_t;
+
+typedef struct policy_s {
+    policy_mode_t mode;
+    int num_cashiers;
+    // Last known queue size of every cashier, -1 if closed
+    long *queue_size;
+    long undercrowded_treshold;
+    long overcrowded_treshold;
+    // Smooth mode only
+    policy_smooth_t smooth;
+    double *ewma;
+    // When every average was last brought up to date
+    uint64_t *ewma_ns;
+    // Slo and predict modes
+    policy_slo_t slo;
+    // Last known estimated wait of every open cashier, and their sum
+    long *wait;
+    long long wait_sum;
+    // Smooth and slo modes: when every cashier was last opened or
+    // closed, and for how long it then stays as it is
+    uint64_t *flipped_ns;
+    long cooldown;
+    // Predict mode only, but for the service time
+    policy_predict_t predict;
+    holt_t arrival_rate;
+    load_series_t series;
+    // Counters of the last load sample and when it was taken
+    uint64_t load_ns;
+    long load_arrivals;
+    long load_served;
+    long load_service_ms;
+    // Smoothed service time of a customer
+    double service_ms;
+    // Cashiers the model asks for at the horizon
+    int desired;
+    // Customers in the open lines, and the most seen in a single line
+    long queued;
+    long peak_queue;
+    // Decisions taken
+    long opened;
+    long closed_count;
+    int open_count;
+    int undercrowded_count;
+    int overcrowded_count;
+    policy_heap_t open;
+    policy_heap_t closed;
+} policy_t;
+
+/* The first initial_open cashiers start open and empty.
+ * Returns NULL on failure */
+policy_t* policy_init(int num_cashiers, int initial_open,
+                      long undercrowded_treshold, long overcrowded_treshold);
+
+void policy_destroy(policy_t *p);
+
+/* Switch to smooth mode. Must be called before the first update.
+ * Returns -1 on failure */
+int policy_set_smooth(policy_t *p, const policy_smooth_t *smooth);
+
+/* Switch to slo mode. Must be called before the first update.
+ * Returns -1 on failure */
+int policy_set_slo(policy_t *p, const policy_slo_t *slo);
+
+/* Switch to predict mode, with slo as the target.
+ * Must be called before the first update. Returns -1 on failure */
+int policy_set_predict(policy_t *p, const policy_slo_t *slo,
+                       const policy_predict_t *predict);
+
+/* Record the counters of a load report: customers that joined a line,
+ * customers served and the ms spent serving them. Every mode keeps the
+ * service time, predict mode forecasts the load as well */
+void policy_load(policy_t *p, long arrivals, long served, long service_ms);
+
+/* Record the queue size of cashier id, -1 if it is closed, and its
+ * estimated wait in ms, -1 if it was not reported */
+void policy_update(policy_t *p, int id, long queue_size, long wait);
+
+/* What to do next and to which cashier. The decision is assumed to be
+ * carried out, as if the cashier reported being closed or empty.
+ * Slo mode is described above.
+ * Snapshot mode closes the least crowded cashier when enough of them
+ * are undercrowded and another one stays open, otherwise opens the
+ * first closed cashier if any is overcrowded.
+ * Smooth mode opens first: a closed cashier out of cooldown if any is
+ * overcrowded, otherwise it closes the least crowded cashier when it
+ * is out of cooldown, enough of them are undercrowded and another one
+ * stays open */
+policy_action_t policy_decide(policy_t *p, int *id);
+
+#endif // policy_h_INCLUDED
@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "util.h"
+#include "stats.h"
+
+// Prints the live counters of a running supermarket every interval,
+// like vmstat: customers in each state, totals as rates per second
+// over the interval, and the open cashiers with their queues. The
+// first line has the rates since the supermarket started. Nothing in
+// the supermarket is locked or slowed down to read them.
+//
+// usage: smstat [-f stats_path] [interval_ms] [count]
+
+#define HEADER_EVERY 20
+
+typedef struct segment_s {
+    const stats_header_t *hdr;
+    size_t size;
+} segment_t;
+
+static int segment_open(segment_t *seg, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    const stats_header_t *hdr;
+    if(fd == -1) {
+        perror(path);
+        return -1;
+    }
+    if(fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(stats_header_t)) {
+        fprintf(stderr, "%s: not a stats segment\n", path);
+        close(fd);
+        return -1;
+    }
+    hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(hdr == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    if(__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC
+       || hdr->version != STATS_VERSION
+       || hdr->num_counters > STATS_COUNTERS
+       || hdr->slots_offset + (uint64_t) hdr->num_slots * hdr->slot_size
+          > hdr->queues_offset
+       || hdr->queues_offset + hdr->num_cashiers * sizeof(long)
+          > (uint64_t) st.st_size) {
+        fprintf(stderr, "%s: not a version %d stats segment\n", path,
+                STATS_VERSION);
+        munmap((void *) hdr, st.st_size);
+        return -1;
+    }
+    seg->hdr = hdr;
+    seg->size = st.st_size;
+    return 0;
+}
+
+// Sum every counter over the slots
+static void segment_read(segment_t *seg, int64_t *sum) {
+    const char *slots = (const char *) seg->hdr + seg->hdr->slots_offset;
+    const int64_t *slot;
+    memset(sum, 0, seg->hdr->num_counters * sizeof(int64_t));
+    for(uint32_t i = 0; i < seg->hdr->num_slots; i++) {
+        slot = (const int64_t *) (slots + i * seg->hdr->slot_size);
+        for(uint32_t c = 0; c < seg->hdr->num_counters; c++)
+            sum[c] += __atomic_load_n(&slot[c], __ATOMIC_RELAXED);
+    }
+}
+
+// Room for the name of counter c, "/s" for rates, and two spaces
+static int width(segment_t *seg, uint32_t c) {
+    int len = strlen(seg->hdr->names[c]) + (seg->hdr->gauge[c] ? 2 : 4);
+    return len < 8 ? 8 : len;
+}
+
+static void print_header(segment_t *seg) {
+    char name[STATS_NAME_LEN + 3];
+    for(uint32_t c = 0; c < seg->hdr->num_counters; c++) {
+        snprintf(name, sizeof(name), "%s%s", seg->hdr->names[c],
+                 seg->hdr->gauge[c] ? "" : "/s");
+        printf("%*s", width(seg, c), name);
+    }
+    printf("%8s%8s%8s\n", "open", "queued", "maxq");
+}
+
+static void print_row(segment_t *seg, int64_t *now, int64_t *prev,
+                      double secs) {
+    const long *queues = (const long *) ((const char *) seg->hdr
+                                         + seg->hdr->queues_offset);
+    long len, open = 0, queued = 0, maxq = 0;
+    for(uint32_t c = 0; c < seg->hdr->num_counters; c++) {
+        if(seg->hdr->gauge[c])
+            printf("%*ld", width(seg, c), (long) now[c]);
+        else
+            printf("%*.1f", width(seg, c),
+                   secs > 0 ? (now[c] - prev[c]) / secs : 0);
+    }
+    for(uint32_t i = 0; i < seg->hdr->num_cashiers; i++) {
+        len = __atomic_load_n(&queues[i], __ATOMIC_RELAXED);
+        if(len < 0) continue;
+        open++;
+        queued += len;
+        if(len > maxq) maxq = len;
+    }
+    printf("%8ld%8ld%8ld\n", open, queued, maxq);
+    fflush(stdout);
+}
+
+int main(int argc, char *const argv[]) {
+    char path[PATH_MAX] = DEFAULT_STATS_PATH;
+    long interval = 1000, count = -1;
+    segment_t seg;
+    int64_t sums[2][STATS_COUNTERS] = {{0}};
+    int64_t *now = sums[0], *prev = sums[1], *tmp;
+    uint64_t now_t, prev_t;
+    int c;
+
+    while((c = getopt(argc, argv, "f:")) != -1) {
+        switch(c) {
+        case 'f':
+            strncpy(path, optarg, PATH_MAX - 1);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-f stats_path] [interval_ms]"
+                    " [count]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(optind < argc) interval = strtol(argv[optind++], NULL, 10);
+    if(optind < argc) count = strtol(argv[optind++], NULL, 10);
+    if(interval <= 0) {
+        fprintf(stderr, "interval must be a positive number of ms\n");
+        return 1;
+    }
+    if(segment_open(&seg, path) != 0) return 1;
+
+    // Rates since the start first
+    prev_t = seg.hdr->start_ns;
+    for(long row = 0; count < 0 || row < count; row++) {
+        if(row > 0) msleep(interval);
+        if(kill(seg.hdr->pid, 0) == -1 && errno == ESRCH) {
+            fprintf(stderr, "supermarket %ld exited\n", (long) seg.hdr->pid);
+            break;
+        }
+        now_t = now_ns();
+        segment_read(&seg, now);
+        if(row % HEADER_EVERY == 0) print_header(&seg);
+        print_row(&seg, now, prev, (now_t - prev_t) / 1e9);
+        tmp = prev;
+        prev = now;
+        now = tmp;
+        prev_t = now_t;
+    }
+    munmap((void *) seg.hdr, seg.size);
+    return 0;
+}
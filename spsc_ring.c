@@ -0,0 +1,85 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+
+#include "util.h"
+#include "spsc_ring.h"
+
+spsc_ring_t* spsc_ring_init(size_t capacity, size_t elem_size) {
+    spsc_ring_t *r = NULL;
+    size_t cap = 1;
+    while(cap < capacity) cap <<= 1;
+    if(posix_memalign((void**) &r, CACHE_LINE_SIZE, sizeof(spsc_ring_t)) != 0)
+        return NULL;
+    memset(r, 0, sizeof(spsc_ring_t));
+    if((r->buf = calloc(cap, elem_size)) == NULL) {
+        free(r);
+        return NULL;
+    }
+    r->mask = cap - 1;
+    r->elem_size = elem_size;
+    return r;
+}
+
+void spsc_ring_destroy(spsc_ring_t *r) {
+    if(r == NULL) return;
+    free(r->buf);
+    free(r);
+}
+
+static void spsc_ring_wake(spsc_ring_t *r) {
+    // Pairs with the waiting store and recheck in spsc_ring_pop_wait
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&r->waiting, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&r->seq, 1, __ATOMIC_RELEASE);
+        futex_wake(&r->seq, INT_MAX);
+    }
+}
+
+int spsc_ring_push(spsc_ring_t *r, const void *elem) {
+    size_t head = r->head;
+    if(head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > r->mask)
+        return -1;
+    memcpy(r->buf + (head & r->mask) * r->elem_size, elem, r->elem_size);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    spsc_ring_wake(r);
+    return 0;
+}
+
+int spsc_ring_pop(spsc_ring_t *r, void *elem) {
+    size_t tail = r->tail;
+    if(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+        return -1;
+    memcpy(elem, r->buf + (tail & r->mask) * r->elem_size, r->elem_size);
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int spsc_ring_pop_wait(spsc_ring_t *r, void *elem) {
+    uint32_t seq;
+    while(spsc_ring_pop(r, elem) != 0) {
+        if(__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)) {
+            // A push may have landed right before the close
+            return spsc_ring_pop(r, elem);
+        }
+        seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&r->waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail
+           && !__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+            futex_wait(&r->seq, seq, -1);
+        __atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+void spsc_ring_close(spsc_ring_t *r) {
+    __atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+    spsc_ring_wake(r);
+}
+
+size_t spsc_ring_size(spsc_ring_t *r) {
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)
+        - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
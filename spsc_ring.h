@@ -0,0 +1,48 @@
+#ifndef spsc_ring_h_INCLUDED
+#define spsc_ring_h_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include "util.h"
+
+// Bounded lock-free ring for exactly one producer and one consumer.
+// Elements are copied in and out, so nothing is allocated per element.
+// The producer and consumer indexes live on separate cache lines.
+// A consumer with nothing to read can block on a futex, and the
+// producer only pays for the wakeup when someone is blocked.
+typedef struct spsc_ring_s {
+    size_t mask;
+    size_t elem_size;
+    char *buf;
+    // Next slot to write, only written by the producer
+    size_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+    // Next slot to read, only written by the consumer
+    size_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    // Bumped on every push and on close while the consumer sleeps
+    uint32_t seq __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint32_t waiting;
+    int closed;
+} spsc_ring_t;
+
+/* Capacity is rounded up to a power of two. Returns NULL on failure */
+spsc_ring_t* spsc_ring_init(size_t capacity, size_t elem_size);
+
+void spsc_ring_destroy(spsc_ring_t *r);
+
+/* Copy elem in. Returns 0, or -1 if the ring is full */
+int spsc_ring_push(spsc_ring_t *r, const void *elem);
+
+/* Copy the oldest element out. Returns 0, or -1 if the ring is empty */
+int spsc_ring_pop(spsc_ring_t *r, void *elem);
+
+/* Like spsc_ring_pop but blocks while the ring is empty.
+ * Returns -1 once the ring is closed and drained */
+int spsc_ring_pop_wait(spsc_ring_t *r, void *elem);
+
+/* No more pushes will come: wake the consumer */
+void spsc_ring_close(spsc_ring_t *r);
+
+/* Number of elements in the ring, exact only for producer or consumer */
+size_t spsc_ring_size(spsc_ring_t *r);
+
+#endif // spsc_ring_h_INCLUDED
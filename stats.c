@@ -0,0 +1,76 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "util.h"
+#include "stats.h"
+
+#define ROUND_UP(n, a) (((n) + (a) - 1) / (a) * (a))
+
+static const char *counter_names[STATS_COUNTERS] = {
+    "wait_buy", "buy", "wait_pay", "paying", "terminated", "can_exit",
+    "entered", "exited", "services", "products", "requeues",
+    "msgs_in", "msgs_out"
+};
+
+stats_t* stats_init(const char *path, int num_cashiers) {
+    stats_t *s = calloc(1, sizeof(stats_t));
+    size_t slot_size = ROUND_UP(STATS_COUNTERS * sizeof(int64_t),
+                                CACHE_LINE_SIZE);
+    size_t slots_offset = ROUND_UP(sizeof(stats_header_t), CACHE_LINE_SIZE);
+    size_t queues_offset = slots_offset + STATS_SLOTS * slot_size;
+    int fd, err;
+    if(s == NULL) return NULL;
+    strncpy(s->path, path, PATH_MAX - 1);
+    s->size = queues_offset + num_cashiers * sizeof(long);
+    // A new file, so a reader of the old one never sees it shrink
+    unlink(path);
+    SYSCALL_SET_GOTO(fd, open(path, O_RDWR | O_CREAT | O_EXCL, 0644),
+                     "Creating stats segment\n", err, stats_init_fail);
+    SYSCALL_SET_GOTO(err, ftruncate(fd, s->size),
+                     "Sizing stats segment\n", err, stats_init_close);
+    s->hdr = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(s->hdr == MAP_FAILED) {
+        ERR("Mapping stats segment\n");
+        goto stats_init_close;
+    }
+    close(fd);
+    s->slots = (char *) s->hdr + slots_offset;
+    s->queues = (long *) ((char *) s->hdr + queues_offset);
+    for(int i = 0; i < num_cashiers; i++) s->queues[i] = -1;
+    s->hdr->num_counters = STATS_COUNTERS;
+    s->hdr->num_slots = STATS_SLOTS;
+    s->hdr->num_cashiers = num_cashiers;
+    s->hdr->slot_size = slot_size;
+    s->hdr->slots_offset = slots_offset;
+    s->hdr->queues_offset = queues_offset;
+    s->hdr->pid = getpid();
+    s->hdr->start_ns = now_ns();
+    for(int c = 0; c < STATS_COUNTERS; c++) {
+        strncpy(s->hdr->names[c], counter_names[c], STATS_NAME_LEN - 1);
+        s->hdr->gauge[c] = c <= STATS_CUST_CAN_EXIT;
+    }
+    s->hdr->version = STATS_VERSION;
+    // Readers check the magic last written
+    __atomic_store_n(&s->hdr->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    return s;
+
+stats_init_close:
+    close(fd);
+    unlink(path);
+stats_init_fail:
+    free(s);
+    return NULL;
+}
+
+void stats_destroy(stats_t *s) {
+    if(s == NULL) return;
+    munmap(s->hdr, s->size);
+    unlink(s->path);
+    free(s);
+}
@@ -0,0 +1,89 @@
+#ifndef stats_h_INCLUDED
+#define stats_h_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include "config.h"
+#include "util.h"
+#include "counter.h"
+
+// Live counters of the supermarket in a file mapped shared, so that
+// smstat can read them while the supermarket runs, without a lock on
+// either side. Every thread adds to the slot of its counter shard
+// (see counter.h), readers sum the slots. Queue lengths are one word
+// per cashier, -1 when closed.
+//
+// The layout is described by the header, readers check the magic and
+// version and then only rely on the sizes and offsets found there.
+
+#define STATS_MAGIC 0x534d5354u
+#define STATS_VERSION 1
+#define STATS_NAME_LEN 24
+
+typedef enum stats_counter_e {
+    // Customers currently in each customer_state_t, in the same order
+    STATS_CUST_WAIT_BUY,
+    STATS_CUST_BUY,
+    STATS_CUST_WAIT_PAY,
+    STATS_CUST_PAYING,
+    STATS_CUST_TERMINATED,
+    STATS_CUST_CAN_EXIT,
+    // Totals
+    STATS_CUST_ENTERED,
+    STATS_CUST_EXITED,
+    STATS_SERVICES,
+    STATS_PRODUCTS,
+    STATS_REQUEUES,
+    STATS_MSGS_IN,
+    STATS_MSGS_OUT,
+    STATS_COUNTERS
+} stats_counter_t;
+
+typedef struct stats_header_s {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_counters;
+    uint32_t num_slots;
+    uint32_t num_cashiers;
+    // Bytes between two slots
+    uint32_t slot_size;
+    uint64_t slots_offset;
+    uint64_t queues_offset;
+    int64_t pid;
+    // CLOCK_MONOTONIC ns when the segment was created
+    uint64_t start_ns;
+    char names[STATS_COUNTERS][STATS_NAME_LEN];
+    // 1 for counters that go up and down
+    uint8_t gauge[STATS_COUNTERS];
+} stats_header_t;
+
+typedef struct stats_s {
+    stats_header_t *hdr;
+    size_t size;
+    char *slots;
+    long *queues;
+    char path[PATH_MAX];
+} stats_t;
+
+/* Create the segment at path, replacing any stale one.
+ * Returns NULL on failure */
+stats_t* stats_init(const char *path, int num_cashiers);
+
+/* Unmap and remove the segment */
+void stats_destroy(stats_t *s);
+
+/* NULL-safe, so code shared with the benchmarks needs no segment */
+static inline void stats_add(stats_t *s, stats_counter_t c, int64_t n) {
+    int64_t *slot;
+    if(s == NULL) return;
+    slot = (int64_t *) (s->slots + counter_shard() * s->hdr->slot_size);
+    __atomic_fetch_add(&slot[c], n, __ATOMIC_RELAXED);
+}
+
+static inline void stats_queue(stats_t *s, int cashier, long len) {
+    if(s == NULL) return;
+    __atomic_store_n(&s->queues[cashier], len, __ATOMIC_RELAXED);
+}
+
+#endif // stats_h_INCLUDED
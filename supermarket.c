@@ -10,6 +10,11 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
 #include <limits.h>
 
 
@@ -19,95 +24,528 @@
 #include "util.h"
 #include "conc_lqueue.h"
 #include "cashcust.h"
+#include "atomic_bitmap.h"
+#include "coro.h"
+#include "twheel.h"
+#include "spsc_ring.h"
+#include "histogram.h"
+#include "exit_batch.h"
+#include "outmsg.h"
+#include "token_bucket.h"
+#include "stats.h"
+#include "counter.h"
+#include "trace.h"
+#include "lockprof.h"
+#include "flight.h"
+
+
+// ========== Customer spawning ==========
+
+// Customers run either on their own thread or, when a coroutine
+// scheduler is given, as coroutines. Slot i keeps its coroutine
+// for the whole run and recycles it on every respawn, which only comes
+// once the last state transition let go of the slot, so no unpark meant
+// for the previous customer is still on its way
+static int customer_spawn(coro_sched_t *sched, size_t i,
+                          pthread_t *tid_arr, pthread_attr_t *attr_arr,
+                          coro_t **coro_arr, customer_opt_t *opt_arr) {
+    if(sched == NULL)
+        return pthread_create(&tid_arr[i], &attr_arr[i],
+                              customer_worker, &opt_arr[i]);
+    if(coro_arr[i] != NULL)
+        return coro_respawn(coro_arr[i], customer_worker, &opt_arr[i]);
+    if((coro_arr[i] = coro_spawn(sched, customer_worker, &opt_arr[i])) == NULL)
+        return -1;
+    return 0;
+}
 
+static void customer_join(coro_sched_t *sched, size_t i,
+                          pthread_t *tid_arr, coro_t **coro_arr) {
+    if(sched == NULL) pthread_join(tid_arr[i], NULL);
+    else coro_join(coro_arr[i]);
+}
 
-// ========== Signal Handler ==========
+static double now_ms(void) {
+    return now_ns() / 1000000.0;
+}
 
-static void signal_handler(int sig) {
-    if (sig == SIGHUP) should_close = 1;
+// ========== Signal Handling ==========
+
+// When the first SIGHUP was applied, 0 before
+static double drain_start = 0;
+
+// Signals are blocked in every thread and read by the main thread
+// from a signalfd. SIGHUP starts a gentle drain, SIGUSR1 prints the
+// lock profile, anything else quits
+static void apply_signal(int sig) {
+    LOG_DEBUG("Intercepted Signal %d\n", sig);
+    flight_record(FLIGHT_SIGNAL, sig, 0);
+    if (sig == SIGHUP) {
+        // Also while still connecting, before the main loop
+        if (!should_close) drain_start = now_ms();
+        should_close = 1;
+    }
+    else if (sig == SIGUSR1) lockprof_report(stderr);
     else should_quit = 1;
 }
 
+// Wait up to msec milliseconds for a signal. Returns the signal
+// number, 0 on timeout or -1 on error
+static int wait_signal(int sig_fd, long msec) {
+    struct pollfd pfd = { .fd = sig_fd, .events = POLLIN };
+    struct signalfd_siginfo info;
+    int res;
+    if((res = poll(&pfd, 1, msec)) <= 0)
+        return (res < 0 && errno != EINTR) ? -1 : 0;
+    if(readn(sig_fd, &info, sizeof(info)) != sizeof(info))
+        return -1;
+    apply_signal(info.ssi_signo);
+    return info.ssi_signo;
+}
+
 // ========== Outbound Message Worker ==========
 
 // Contains options passed to the messaging thread
 typedef struct msg_worker_opt_s {
     // Connection socket file descriptor
     int sock_fd;
-    // message queue
+    // message queue, the bulk lane for outbound messages
     conc_lqueue_t *msgqueue;
     int cust_cap;
     customer_opt_t *customer_opt_arr;
-    int num_cashiers;
-    pthread_mutex_t *cashier_mtx_arr;
-    bool *cashier_isopen_arr;
-    cashier_opt_t *cashier_opt_arr;
-    pthread_t *cashier_tid_arr;
+    cashier_table_t *cashiers;
     long time_per_prod;
-    pthread_attr_t *cashier_attr_arr;
-    long *cashier_times_closed_arr;
     FILE *logfile;
+    // Readable once shutdown has been broadcast
+    int shutdown_fd;
+    int num_dispatchers;
+    struct inmsg_dispatcher_s *dispatchers;
+    // Complete frames returned by each read of the socket
+    histogram_t *frames_per_read;
+    exit_batch_t *exit_batch;
+    // Outbound control lane, always sent before the bulk one
+    conc_lqueue_t *ctlqueue;
+    // Microseconds outbound messages waited in each lane
+    histogram_t *ctl_wait;
+    histogram_t *bulk_wait;
+    // Futex word the outbound worker sleeps on
+    uint32_t *pending;
+    // Entry rate set by the manager
+    token_bucket_t *admission;
+    stats_t *stats;
 } msg_worker_opt_t;
 
+// A stage applying the inbound messages, fed by the reader
+typedef struct inmsg_dispatcher_s {
+    pthread_t tid;
+    spsc_ring_t *ring;
+    msg_worker_opt_t *opt;
+    // Messages in the ring right after each push
+    histogram_t depth;
+    // Microseconds between reading a message and applying it
+    histogram_t queue_wait;
+    // Microseconds spent applying a message
+    histogram_t apply_time;
+} inmsg_dispatcher_t;
+
+
+// Notify callback of the outbound queues
+static void outmsg_wake(void *arg, long count) {
+    uint32_t *pending = (uint32_t *) arg;
+    if(count > 0 && __atomic_exchange_n(pending, 1, __ATOMIC_RELEASE) == 0)
+        futex_wake(pending, 1);
+}
+
+// Next message to send: the control lane is emptied first, and
+// checked again before each bulk message
+static outmsg_t* outmsg_next(msg_worker_opt_t *opt, histogram_t **wait) {
+    outmsg_t *msg = NULL;
+    if(conc_lqueue_dequeue_nonblock(opt->ctlqueue, (void *) &msg) == 0) {
+        *wait = opt->ctl_wait;
+        return msg;
+    }
+    if(conc_lqueue_dequeue_nonblock(opt->msgqueue, (void *) &msg) == 0) {
+        *wait = opt->bulk_wait;
+        return msg;
+    }
+    return NULL;
+}
 
 void* outmsg_worker(void* arg) {
     msg_worker_opt_t opt = *(msg_worker_opt_t *)arg;
-    char *msgbuf = NULL;
-    // ssize_t sent;
+    outmsg_t *msg = NULL;
+    histogram_t *wait;
     int err;
 
     while(!should_quit) {
         // Pop messages from queue and send them
-        if (conc_lqueue_closed(opt.msgqueue)) {
+        if (conc_lqueue_closed(opt.msgqueue)
+            || conc_lqueue_closed(opt.ctlqueue)) {
             LOG_DEBUG("Detected closed queue\n");
             goto outmsg_worker_exit;  
         }
 
-        if(conc_lqueue_dequeue_nonblock(opt.msgqueue, (void *) &msgbuf) == 0) {
-            LOG_DEBUG("Sending message: %s", msgbuf);
-            if (sendn(opt.sock_fd, msgbuf, MSG_SIZE, 0) == -1) {
+        // Send everything pending before sleeping again
+        while((msg = outmsg_next(&opt, &wait)) != NULL) {
+            uint64_t start = now_ns();
+            histogram_record(wait, (start - msg->queued_ns) / 1000);
+            LOG_DEBUG("Sending message: %s", msg->frame);
+            // SIGPIPE would be pending on this thread only, where the
+            // signalfd cannot see it: handle the closed socket here
+            if (sendn(opt.sock_fd, msg->frame, MSG_SIZE, MSG_NOSIGNAL) == -1) {
                 err = errno;
-                free(msgbuf);
+                free(msg);
                 char errs[1024] = {0}; strerror_r(err, errs, 1024);
                 ERR("Error sending message: %s", errs);
+                if (err == EPIPE) should_quit = 1;
                 goto outmsg_worker_exit;
             }
-            free(msgbuf);
+            flight_record_text(FLIGHT_MSG_OUT, msg->frame);
+            if(trace_on())
+                trace_span("msg", "send", TRACE_TRACK_THREAD, start,
+                           now_ns(), "wait_us",
+                           (start - msg->queued_ns) / 1000);
+            free(msg);
+            stats_add(opt.stats, STATS_MSGS_OUT, 1);
         }
 
-        // TODO use proper passive waiting
-        msleep(2);
+        // The queues set pending when something is enqueued
+        if(__atomic_exchange_n(opt.pending, 0, __ATOMIC_ACQUIRE) == 0)
+            futex_wait(opt.pending, 0, -1);
     }
 
 outmsg_worker_exit:
     pthread_exit(NULL);
 }
 
-// ========== Inbound Message Worker ==========
+// ========== Inbound Message Pipeline ==========
+
+// The reader thread (inmsg_worker) reads the socket in chunks of
+// frames, parses them and hands them to a dispatcher. The dispatcher
+// is picked by the ID in the message, so that messages about the same
+// cashier or customer are applied in order. Applying a message may
+// block, closing a cashier joins its thread, without stalling reads.
+
+typedef enum inmsg_type_e {
+    INMSG_GET_OUT,
+    INMSG_OPEN_CASH,
+    INMSG_CLOSE_CASH
+} inmsg_type_t;
+
+static const char *inmsg_names[] = {
+    "get_out", "open_cashier", "close_cashier"
+};
+
+typedef struct inmsg_s {
+    inmsg_type_t type;
+    long id;
+    // CLOCK_MONOTONIC ns when the frame was read
+    uint64_t read_ns;
+} inmsg_t;
+
+// Turn a frame into messages, at most EXIT_BATCH_MAX_IDS.
+// Returns how many, 0 if the frame must be ignored
+static int inmsg_parse(msg_worker_opt_t *opt, char *frame, inmsg_t *msgs) {
+    char *remaining = NULL, *parsed;
+    long id = 0;
+    int n = 0;
+
+// ========== Batched Customer Exit Confirmation  ==========
+
+    if(strncmp(frame, MSG_CUST_BATCH_HEADER,
+               strlen(MSG_CUST_BATCH_HEADER)) == 0) {
+        remaining = &frame[strlen(MSG_CUST_BATCH_HEADER)];
+        while(*remaining == ' ') remaining++;
+        if(strncmp(remaining, MSG_GET_OUT, strlen(MSG_GET_OUT)) != 0) {
+            LOG_DEBUG("Unrecognized message\n");
+            return 0;
+        }
+        remaining += strlen(MSG_GET_OUT);
+        while(n < EXIT_BATCH_MAX_IDS) {
+            id = strtol(remaining, &parsed, 10);
+            if(parsed == remaining) break;
+            remaining = parsed;
+            if(id < 0 || id >= opt->cust_cap) {
+                LOG_DEBUG("Received invalid customer ID: %ld\n", id);
+                continue;
+            }
+            msgs[n].type = INMSG_GET_OUT;
+            msgs[n].id = id;
+            n++;
+        }
+        return n;
+
+// ========== Customer Exit Confirmation  ==========
+    // NOTE: customers can be kicked out by the manager
+
+    } else if(strncmp(frame, MSG_CUST_HEADER, strlen(MSG_CUST_HEADER)) == 0) {
+        id = strtol(&frame[strlen(MSG_CUST_HEADER)], &remaining, 10);
+        if(id < 0 || id >= opt->cust_cap) {
+            LOG_DEBUG("Received invalid customer ID: %ld\n", id);
+            return 0;
+        } else if (frame == remaining) {
+            LOG_DEBUG("Malformed message: no cust ID\n");
+            return 0;
+        }
+        // Remove spaces
+        while(*remaining == ' ') remaining++;
+        if(strncmp(remaining, MSG_GET_OUT, strlen(MSG_GET_OUT)) != 0) {
+            LOG_DEBUG("Unrecognized message\n");
+            return 0;
+        }
+        msgs->type = INMSG_GET_OUT;
+
+// ========== Cashier Opening/Closing ==========
+
+    } else if (strncmp(frame, MSG_CASH_HEADER,
+                       strlen(MSG_CASH_HEADER)) == 0) {
+        LOG_DEBUG("Received a cash operation\n");
+        id = strtol(&frame[strlen(MSG_CASH_HEADER)], &remaining, 10);
+        if(id < 0 || id >= opt->cashiers->size) {
+            LOG_DEBUG("Received invalid cash ID: %ld\n", id);
+            return 0;
+        } else if (frame == remaining) {
+            LOG_DEBUG("Malformed message: no cash ID\n");
+            return 0;
+        }
+        // Remove spaces
+        while(*remaining == ' ') remaining++;
+        if(strncmp(remaining, MSG_OPEN_CASH, strlen(MSG_OPEN_CASH)) == 0) {
+            msgs->type = INMSG_OPEN_CASH;
+        } else if(strncmp(remaining, MSG_CLOSE_CASH,
+                          strlen(MSG_CLOSE_CASH)) == 0) {
+            msgs->type = INMSG_CLOSE_CASH;
+        } else {
+            LOG_DEBUG("Unrecognized message\n");
+            return 0;
+        }
+    } else {
+        LOG_DEBUG("Unrecognized message\n");
+        return 0;
+    }
+    msgs->id = id;
+    return 1;
+}
+
+// Lease messages only touch the exit batch and never block, so the
+// reader applies them itself. Returns 1 if frame was one of them
+static int inmsg_lease(msg_worker_opt_t *opt, char *frame) {
+    char *remaining;
+    long quota, msec;
+    if(strncmp(frame, MSG_LEASE_HEADER, strlen(MSG_LEASE_HEADER)) != 0)
+        return 0;
+    remaining = &frame[strlen(MSG_LEASE_HEADER)];
+    while(*remaining == ' ') remaining++;
+    if(strncmp(remaining, MSG_LEASE_GRANT, strlen(MSG_LEASE_GRANT)) == 0) {
+        remaining += strlen(MSG_LEASE_GRANT);
+        quota = strtol(remaining, &remaining, 10);
+        msec = strtol(remaining, &remaining, 10);
+        LOG_DEBUG("Granted exit lease of %ld exits for %ld ms\n", quota, msec);
+        exit_batch_lease_grant(opt->exit_batch, quota, msec);
+    } else if(strncmp(remaining, MSG_LEASE_REVOKE,
+                      strlen(MSG_LEASE_REVOKE)) == 0) {
+        LOG_DEBUG("Exit lease revoked\n");
+        exit_batch_lease_revoke(opt->exit_batch);
+    } else {
+        LOG_DEBUG("Unrecognized message\n");
+    }
+    return 1;
+}
+
+// Admission rates only touch the token bucket, so the reader applies
+// them itself as well. Returns 1 if frame was one
+static int inmsg_admission(msg_worker_opt_t *opt, char *frame) {
+    char *remaining, *parsed;
+    double rate;
+    long burst;
+    if(strncmp(frame, MSG_ADMISSION, strlen(MSG_ADMISSION)) != 0) return 0;
+    remaining = &frame[strlen(MSG_ADMISSION)];
+    rate = strtod(remaining, &parsed);
+    burst = strtol(parsed, &remaining, 10);
+    if(parsed == &frame[strlen(MSG_ADMISSION)] || remaining == parsed
+       || burst <= 0) {
+        LOG_DEBUG("Malformed admission message\n");
+        return 1;
+    }
+    LOG_DEBUG("Admitting %.2f customers per second\n", rate);
+    token_bucket_set(opt->admission, rate, burst);
+    return 1;
+}
+
+// Join the last thread of cashier id if it stopped, or wait for it to
+// stop if wait is set. Returns 1 if this call joined it
+static int cashier_reap(cashier_table_t *t, int id, bool wait) {
+    cashier_slot_t *slot = &t->slots[id];
+    bool mine;
+    if(!wait && !__atomic_load_n(&slot->exited, __ATOMIC_ACQUIRE)) return 0;
+    MTX_LOCK_DIE(&slot->mtx);
+    mine = slot->joinable
+        && (wait || __atomic_load_n(&slot->exited, __ATOMIC_ACQUIRE));
+    if(mine) slot->joinable = 0;
+    MTX_UNLOCK_DIE(&slot->mtx);
+    if(!mine) return 0;
+    if(pthread_join(slot->tid, NULL) != 0)
+        ERR("Joining cashier thread %d\n", id);
+    // Over a queue change that saw the cashier still open
+    MTX_LOCK_DIE(&slot->mtx);
+    if(!atomic_bitmap_test(t->open_bm, id)) stats_queue(t->stats, id, -1);
+    MTX_UNLOCK_DIE(&slot->mtx);
+    return 1;
+}
+
+// Perform the action of a message. Returns -1 on unrecoverable errors
+static int inmsg_apply(msg_worker_opt_t *opt, inmsg_t *msg) {
+    cashier_slot_t *slot;
+    uint64_t asked;
+    switch(msg->type) {
+    case INMSG_GET_OUT:
+        asked = opt->customer_opt_arr[msg->id].want_out_ns;
+        if(asked != 0)
+            histogram_record(&opt->exit_batch->confirm_us,
+                             (now_ns() - asked) / 1000);
+        customer_set_state(&opt->customer_opt_arr[msg->id], CAN_EXIT);
+        return 0;
+
+// ========== Cashier Opening  ==========
+
+    case INMSG_OPEN_CASH:
+        slot = &opt->cashiers->slots[msg->id];
+        if(atomic_bitmap_test(opt->cashiers->open_bm, msg->id)) {
+            ERR("Cashier %ld already open\n", msg->id);
+            return 0;
+        }
+        // Two threads would serve the line if the one of the last
+        // opening were still finishing its customer. Cooldowns make it
+        // rare, the main loop has usually joined it already
+        cashier_reap(opt->cashiers, msg->id, true);
+        MTX_LOCK_DIE(&slot->mtx);
+
+        // Spawn first cashier thread
+        LOG_DEBUG("Opening cashier %ld\n", msg->id);
+
+        // The queue must exist before the cashier is seen open, and a
+        // reaper must not see it open and still exited
+        cashier_init(&slot->opt, msg->id,
+                     opt->cashiers,
+                     opt->time_per_prod,
+                     opt->logfile);
+        __atomic_store_n(&slot->exited, 0, __ATOMIC_RELEASE);
+        atomic_bitmap_set(opt->cashiers->open_bm, msg->id);
+        if(pthread_create(&slot->tid, &slot->attr,
+                          cashier_worker, &slot->opt) != 0) {
+            MTX_UNLOCK_DIE(&slot->mtx);
+            ERR("Creating cashier worker\n");
+            return -1;
+        }
+        slot->joinable = 1;
+        MTX_UNLOCK_DIE(&slot->mtx);
+        cashier_poll_kick(opt->cashiers->reporter);
+        return 0;
+
+// ========== Cashier Closing ==========
+
+    case INMSG_CLOSE_CASH:
+        slot = &opt->cashiers->slots[msg->id];
+        MTX_LOCK_DIE(&slot->mtx);
+        if(!atomic_bitmap_clear(opt->cashiers->open_bm, msg->id)) {
+            ERR("Cashier already closed %ld\n", msg->id);
+            MTX_UNLOCK_DIE(&slot->mtx);
+            return 0;
+        }
+        stats_queue(opt->cashiers->stats, msg->id, -1);
+        MTX_UNLOCK_DIE(&slot->mtx);
+
+        LOG_DEBUG("Closing cashier %ld\n", msg->id);
+
+        // Reschedule customers. The cashier thread stops after its
+        // current customer, the main loop joins it
+        if (cashier_redistribute_customers(opt->cashiers, msg->id) != 0) {
+            ERR("Rescheduling customers\n");
+            return -1;
+        }
+        cashier_poll_kick(opt->cashiers->reporter);
+        return 0;
+    }
+    return 0;
+}
+
+// Hand a message to its dispatcher, waiting for room in its ring
+static void inmsg_dispatch(msg_worker_opt_t *opt, inmsg_t *msg) {
+    inmsg_dispatcher_t *d;
+    // Cashier commands have their own dispatcher, right after the others,
+    // so they never wait behind a burst of exit confirmations
+    if(msg->type == INMSG_OPEN_CASH || msg->type == INMSG_CLOSE_CASH)
+        d = &opt->dispatchers[opt->num_dispatchers];
+    else
+        d = &opt->dispatchers[msg->id % opt->num_dispatchers];
+    while(spsc_ring_push(d->ring, msg) != 0) {
+        if(should_quit) return;
+        sched_yield();
+    }
+    histogram_record(&d->depth, spsc_ring_size(d->ring));
+}
+
+void* inmsg_dispatcher_worker(void* arg) {
+    inmsg_dispatcher_t *d = (inmsg_dispatcher_t *) arg;
+    inmsg_t msg;
+    uint64_t start, end;
+
+    while(spsc_ring_pop_wait(d->ring, &msg) == 0) {
+        start = now_ns();
+        histogram_record(&d->queue_wait, (start - msg.read_ns) / 1000);
+        if(inmsg_apply(d->opt, &msg) != 0) break;
+        end = now_ns();
+        histogram_record(&d->apply_time, (end - start) / 1000);
+        trace_span("msg", inmsg_names[msg.type], TRACE_TRACK_THREAD, start,
+                   end, "id", msg.id);
+    }
+    return NULL;
+}
 
 void* inmsg_worker(void* arg) {
     msg_worker_opt_t opt = *(msg_worker_opt_t *)arg;
-    char statbuf[MSG_SIZE];
+    size_t bufsize = INMSG_READ_FRAMES * MSG_SIZE, filled = 0, nframes;
+    char *buf = calloc(INMSG_READ_FRAMES, MSG_SIZE), *frame;
     int err;
-    char *msgbuf = NULL;
     ssize_t received;
+    uint64_t read_ns;
+    inmsg_t msgs[EXIT_BATCH_MAX_IDS];
+    int nmsgs;
+    struct pollfd pfd[2] = {
+        { .fd = opt.sock_fd, .events = POLLIN },
+        { .fd = opt.shutdown_fd, .events = POLLIN }
+    };
+
+    if(buf == NULL) {
+        ERR("Allocating inbound message buffer\n");
+        goto inmsg_worker_exit;
+    }
 
     while(!should_quit) {
 
-        received = recvn(opt.sock_fd, statbuf, MSG_SIZE, 0);
-        // if(errno == EAGAIN || errno == EWOULDBLOCK) {
-        //     sleep(10);
-        //     continue;
-        // } else 
+        // Do not stay blocked on the socket after shutdown
+        if(poll(pfd, 2, -1) < 0 && errno != EINTR) {
+            err = errno;
+            char errs[1024] = {0}; strerror_r(err, errs, 1024);
+            LOG_CRITICAL("Error while polling socket: %s\n", errs);
+            goto inmsg_worker_exit;
+        }
+        if(pfd[1].revents & POLLIN) {
+            LOG_DEBUG("Detected shutdown\n");
+            goto inmsg_worker_exit;
+        }
+        if(!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+        // Take whatever is available, a partial frame is kept for later
+        received = recv(opt.sock_fd, buf + filled, bufsize - filled, 0);
         if (received == 0) {
             LOG_DEBUG("Detected closed socket\n");
             goto inmsg_worker_exit;
         } else if (received < 0) {
             err = errno;
-            if (err != EINTR) {
-                char errs[1024] = {0}; strerror_r(err, errs, 1024);
-                LOG_CRITICAL("Error while reading socket: %s\n", errs);
-            }
+            if (err == EINTR) continue;
+            char errs[1024] = {0}; strerror_r(err, errs, 1024);
+            LOG_CRITICAL("Error while reading socket: %s\n", errs);
             goto inmsg_worker_exit;
         } 
 
@@ -115,160 +553,37 @@ void* inmsg_worker(void* arg) {
             LOG_DEBUG("Detected closed queue\n");
             goto inmsg_worker_exit;  
         } 
-        LOG_DEBUG("Received message: %s", statbuf);
-        msgbuf = calloc(1, MSG_SIZE);
-        strncpy(msgbuf, statbuf, MSG_SIZE);
 
-
-// ========== Customer Exit Confirmation  ==========
-        // NOTE: customers can be kicked out by the manager
-
-        if(strncmp(msgbuf, MSG_CUST_HEADER,
-                   strlen(MSG_CUST_HEADER)) == 0) {
-            char *remaining = NULL;
-            long cust_id = 0; 
-            errno = 0;
-            cust_id = strtol(&msgbuf[strlen(MSG_CUST_HEADER)],
-                   &remaining, 10); 
-            if(cust_id < 0 || cust_id >= opt.cust_cap) {
-                LOG_DEBUG("Received invalid customer ID: %ld\n", cust_id);
-                memset(msgbuf, 0, MSG_SIZE);
+        read_ns = now_ns();
+        filled += received;
+        nframes = filled / MSG_SIZE;
+        if(nframes == 0) continue;
+        histogram_record(opt.frames_per_read, nframes);
+        stats_add(opt.stats, STATS_MSGS_IN, nframes);
+        trace_instant("msg", "recv", TRACE_TRACK_THREAD, "frames", nframes);
+        for(size_t i = 0; i < nframes; i++) {
+            frame = buf + i * MSG_SIZE;
+            frame[MSG_SIZE - 1] = '\0';
+            LOG_DEBUG("Received message: %s", frame);
+            flight_record_text(FLIGHT_MSG_IN, frame);
+            if(inmsg_lease(&opt, frame) || inmsg_admission(&opt, frame))
                 continue;
-            } else if (msgbuf == remaining) {
-                LOG_DEBUG("Malformed message: no cust ID\n");
-                memset(msgbuf, 0, MSG_SIZE);
-                continue;
-            }
-            // Remove spaces
-            while(*remaining == ' ') remaining++;
-
-            if(strncmp(remaining, MSG_GET_OUT,
-                       strlen(MSG_GET_OUT)) == 0) {
-                MTX_LOCK_DIE(opt.customer_opt_arr[cust_id].state_mtx);
-                *(opt.customer_opt_arr[cust_id].state) = CAN_EXIT;
-                COND_SIGNAL_DIE(opt.customer_opt_arr[cust_id]
-                                .state_change_event);
-                MTX_UNLOCK_DIE(opt.customer_opt_arr[cust_id].state_mtx);
-            }
-
-        } else if (strncmp(msgbuf, MSG_CASH_HEADER,
-                           strlen(MSG_CASH_HEADER)) == 0) {
-
-// ========== Cashier Opening/Closing ==========
-
-            LOG_DEBUG("Received a cash operation\n");
-                              
-            char *remaining = NULL;
-            long cash_id = 0; 
-            errno = 0;
-            cash_id = strtol(&msgbuf[strlen(MSG_CASH_HEADER)],
-                   &remaining, 10); 
-            if(cash_id < 0 || cash_id >= opt.num_cashiers) {
-                LOG_DEBUG("Received invalid cash ID: %ld\n", cash_id);
-                memset(msgbuf, 0, MSG_SIZE);
-                continue;
-            } else if (msgbuf == remaining) {
-                LOG_DEBUG("Malformed message: no cash ID\n");
-                memset(msgbuf, 0, MSG_SIZE);
-                continue;
-            }
-            // Remove spaces
-            while(*remaining == ' ') remaining++;
-            if(strncmp(remaining, MSG_OPEN_CASH,
-                       strlen(MSG_OPEN_CASH)) == 0) {
-
-// ========== Cashier Opening  ==========
-                 
-                MTX_LOCK_DIE(&opt.cashier_mtx_arr[cash_id]);
-                if(opt.cashier_isopen_arr[cash_id]) {
-                    ERR("Cashier %ld already open\n",
-                              cash_id);
-                    MTX_UNLOCK_DIE(&opt.cashier_mtx_arr[cash_id]);
-                    continue;
-                }
-                opt.cashier_isopen_arr[cash_id] = true;
-                MTX_UNLOCK_DIE(&opt.cashier_mtx_arr[cash_id]);
-
-                // Spawn first cashier thread
-                LOG_DEBUG("Opening cashier %ld\n", cash_id);
-
-                cashier_init(&opt.cashier_opt_arr[cash_id], cash_id,
-                             &opt.cashier_isopen_arr[cash_id],
-                             &opt.cashier_mtx_arr[cash_id],
-                             opt.time_per_prod,
-                             &opt.cashier_times_closed_arr[cash_id],
-                             opt.logfile);
-
-                if(pthread_create(&opt.cashier_tid_arr[cash_id],
-                                  &opt.cashier_attr_arr[cash_id], 
-                                  cashier_worker,
-                                  &opt.cashier_opt_arr[cash_id]) < 0)
-                ERR_SET_GOTO(inmsg_worker_exit, err,
-                             "Creating cashier worker\n");
-
-
-            } else if(strncmp(remaining, MSG_CLOSE_CASH,
-                       strlen(MSG_CLOSE_CASH)) == 0) {
-
-// ========== Cashier Closing ==========
-                
-                MTX_LOCK_DIE(&opt.cashier_mtx_arr[cash_id]);
-                if(opt.cashier_isopen_arr[cash_id] == false) {
-                    ERR("Cashier already closed %ld\n",
-                              cash_id);
-                    MTX_UNLOCK_DIE(&opt.cashier_mtx_arr[cash_id]);
-                    continue;
-                }
-                opt.cashier_isopen_arr[cash_id] = false;
-                MTX_UNLOCK_DIE(&opt.cashier_mtx_arr[cash_id]);
-
-                LOG_DEBUG("Closing cashier %ld\n", cash_id);
-
-                // Reschedule customers
-                customer_opt_t *curr_cust = NULL;
-                while((err = conc_lqueue_dequeue_nonblock(
-                        opt.cashier_opt_arr[cash_id].custqueue,
-                        (void*) &curr_cust)) == 0) {
-                    customer_reschedule(curr_cust);
-                } 
-                if (err != ELQUEUEEMPTY) {
-                    ERR("Rescheduling customers\n"); 
-                    free(msgbuf);
-                    goto inmsg_worker_exit;
-                }
-
-
-                if(pthread_join(opt.cashier_tid_arr[cash_id], NULL) < 0) {
-                   ERR("Joining cashier thread %ld\n", cash_id);   
-                   free(msgbuf);
-                   goto inmsg_worker_exit;
-                }
-
-
-                MTX_LOCK_DIE(&opt.cashier_mtx_arr[cash_id]);
-                opt.cashier_isopen_arr[cash_id] = false;
-                MTX_UNLOCK_DIE(&opt.cashier_mtx_arr[cash_id]);
-
-                // cashier_destroy(&opt.cashier_opt_arr[cash_id]);
-
-            } else {
-                LOG_DEBUG("Unrecognized message\n");
+            nmsgs = inmsg_parse(&opt, frame, msgs);
+            for(int j = 0; j < nmsgs; j++) {
+                msgs[j].read_ns = read_ns;
+                inmsg_dispatch(&opt, &msgs[j]);
             }
-        } else {
-            LOG_DEBUG("Unrecognized message\n");
         }
-        free(msgbuf);
-
-        // if(conc_lqueue_enqueue(opt.msgqueue, (void*) msgbuf) != 0) {
-        //     LOG_DEBUG("Error while enqueueing message\n");
-        //     free(msgbuf);
-        //     goto inmsg_worker_exit;  
-        // }
-
+        filled -= nframes * MSG_SIZE;
+        memmove(buf, buf + nframes * MSG_SIZE, filled);
     }
 
 
 inmsg_worker_exit:
+    // Dispatchers drain what is left and stop
+    for(int i = 0; i <= opt.num_dispatchers; i++)
+        spsc_ring_close(opt.dispatchers[i].ring);
+    free(buf);
     pthread_exit(NULL);
 }
 
@@ -281,54 +596,79 @@ int main(int argc, char* const argv[]) {
     char *msgbuf, 
          statbuf[MSG_SIZE] = {0},
          config_path[PATH_MAX] = {0};
-    conc_lqueue_t *outmsgqueue = NULL, *inmsgqueue = NULL;
+    conc_lqueue_t *outmsgqueue = NULL, *inmsgqueue = NULL, *ctlmsgqueue = NULL;
     struct sockaddr_un addr;
-    struct sigaction act;
+    sigset_t sigset;
+    int sig_fd = -1, shutdown_fd = -1;
+    // CLOCK_MONOTONIC ms when the drain and the shutdown started
+    double shutdown_start = 0;
     char socket_path[UNIX_MAX_PATH];
     char log_path[PATH_MAX];
+    char stats_path[PATH_MAX];
+    char trace_path[PATH_MAX] = {0};
+    char flight_path[PATH_MAX] = {0};
 
     ini_t *config;
     size_t sent, received;
 
     pthread_t inmsg_tid, outmsg_tid;
     pthread_attr_t inmsg_attr, outmsg_attr;
+    inmsg_dispatcher_t *dispatchers = NULL;
+    uint32_t outmsg_pending = 0;
+    histogram_t frames_per_read;
 
     pthread_t *customer_tid_arr = NULL;
     pthread_attr_t *customer_attr_arr = NULL;
+    coro_t **customer_coro_arr = NULL;
+    coro_sched_t *customer_sched = NULL;
+    twheel_t *timers = NULL;
+    exit_batch_t *exit_batch = NULL;
+    token_bucket_t *admission = NULL;
+    stats_t *stats = NULL;
     customer_opt_t *customer_opt_arr = NULL;
     // Array of flags to tell which threads are joinable
     bool *customer_terminated_arr = NULL;
 
-    pthread_t *cashier_tid_arr = NULL;
-    pthread_attr_t *cashier_attr_arr = NULL;
-    pthread_mutex_t *cashier_mtx_arr = NULL;
-    cashier_opt_t *cashier_opt_arr = NULL;
-    bool *cashier_isopen_arr = NULL;
-    long *cashier_times_closed_arr = NULL;
-    pthread_mutex_t customer_count_mtx;
+    cashier_table_t *cashiers = NULL;
 
     pthread_t cashier_poller_tid;
     pthread_attr_t cashier_poller_attr;
-    cashier_poll_opt_t *cashier_poller_opt;
+    cashier_poll_opt_t *cashier_poller_opt = NULL;
     
 
     // Values read from config file with defaults
     int max_conn_attempts = DEFAULT_MAX_CONN_ATTEMPTS;
     int product_cap = DEFAULT_PRODUCT_CAP;
     long conn_attempt_delay = DEFAULT_CONN_ATTEMPT_DELAY;
-    long cashier_poll_time = DEFAULT_CASHIER_POLL_TIME;
+    long overcrowded_cash_treshold = DEFAULT_OVERCROWDED_CASH_TRESHOLD;
+    long queue_report_min_interval = DEFAULT_QUEUE_REPORT_MIN_INTERVAL;
+    long queue_report_delta = DEFAULT_QUEUE_REPORT_DELTA;
+    long queue_report_wait_band = DEFAULT_QUEUE_REPORT_WAIT_BAND;
+    long slo_p95_wait = DEFAULT_SLO_P95_WAIT;
+    long queue_report_idle = DEFAULT_QUEUE_REPORT_IDLE;
     long time_per_prod = DEFAULT_TIME_PER_PROD;
     long max_shopping_time = DEFAULT_MAX_SHOPPING_TIME;
     long supermarket_poll_time = DEFAULT_SUPERMARKET_POLL_TIME;
     int num_cashiers = DEFAULT_NUM_CASHIERS;
     size_t cust_cap = DEFAULT_CUST_CAP;
     size_t cust_batch = DEFAULT_CUST_BATCH;
+    long admitted;
     int initial_open_cashiers = DEFAULT_INITIAL_OPEN_CASHIERS;
-
-    int *total_customers_served = calloc(1, sizeof(int));
-    int *total_products_bought = calloc(1, sizeof(int));
+    int coro_carriers = DEFAULT_CORO_CARRIERS;
+    long coro_stack_size = DEFAULT_CORO_STACK_SIZE;
+    int inmsg_dispatchers = DEFAULT_INMSG_DISPATCHERS;
+    long inmsg_ring_size = DEFAULT_INMSG_RING_SIZE;
+    long exit_batch_window = DEFAULT_EXIT_BATCH_WINDOW;
+    int exit_batch_max = DEFAULT_EXIT_BATCH_MAX;
+    long trace_events = DEFAULT_TRACE_EVENTS;
+    long flight_events = DEFAULT_FLIGHT_EVENTS;
+
+    counter_t *total_customers_served = counter_init();
+    counter_t *total_products_bought = counter_init();
 
 // ========== Data initialization ==========
+    if(total_customers_served == NULL || total_products_bought == NULL)
+        ERR_SET_GOTO(main_exit_1, err, "Allocating totals\n");
     if(pthread_attr_init(&outmsg_attr) < 0)
         ERR_SET_GOTO(main_exit_1, err, "Initializing thread attributes\n");
     if(pthread_attr_init(&inmsg_attr) < 0)
@@ -336,24 +676,25 @@ int main(int argc, char* const argv[]) {
     if(pthread_attr_init(&cashier_poller_attr) < 0)
         ERR_SET_GOTO(main_exit_1, err, "Initializing thread attributes\n");
 
-    memset(&act, 0, sizeof(act));
-    act.sa_handler = signal_handler;
+    // Block the signals before any thread is created, so that all of
+    // them inherit the mask and the signals reach only the signalfd
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGINT);
+    sigaddset(&sigset, SIGQUIT);
+    sigaddset(&sigset, SIGHUP);
+    sigaddset(&sigset, SIGPIPE);
+    sigaddset(&sigset, SIGUSR1);
+    if(pthread_sigmask(SIG_BLOCK, &sigset, NULL) != 0)
+        ERR_SET_GOTO(main_exit_1, err, "Masking signals in main thread\n");
+    SYSCALL_SET_GOTO(sig_fd, signalfd(-1, &sigset, SFD_CLOEXEC),
+                     "creating signalfd\n", err, main_exit_1);
+    SYSCALL_SET_GOTO(shutdown_fd, eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK),
+                     "creating shutdown eventfd\n", err, main_exit_1);
    
     outmsgqueue = conc_lqueue_init();
+    ctlmsgqueue = conc_lqueue_init();
     inmsgqueue = conc_lqueue_init();
 
-    SYSCALL_SET_GOTO(err, sigaction(SIGINT, &act, NULL),
-                    "reg signal\n", err, main_exit_1);
-
-    SYSCALL_SET_GOTO(err, sigaction(SIGQUIT, &act, NULL),
-                    "reg signal\n", err, main_exit_1);
-
-    SYSCALL_SET_GOTO(err, sigaction(SIGHUP, &act, NULL),
-                    "reg signal\n", err, main_exit_1);
-    
-    SYSCALL_SET_GOTO(err, sigaction(SIGPIPE, &act, NULL),
-                    "reg signal\n", err, main_exit_1);
-
 // ========== Parse configuration file ==========
     int c;
     strncpy(config_path, DEFAULT_CONFIG_PATH, PATH_MAX);
@@ -379,6 +720,9 @@ int main(int argc, char* const argv[]) {
     }
     strncpy(socket_path, DEFAULT_SOCK_PATH, UNIX_MAX_PATH - 1);
     strncpy(log_path, DEFAULT_LOG_PATH, PATH_MAX - 1);
+    strncpy(stats_path, DEFAULT_STATS_PATH, PATH_MAX - 1);
+    strncpy(trace_path, DEFAULT_TRACE_PATH, PATH_MAX - 1);
+    strncpy(flight_path, DEFAULT_FLIGHT_PATH, PATH_MAX - 1);
 
     config = ini_load(config_path);
     ini_sget(config, NULL, "socket_path", "%s", &socket_path);
@@ -391,6 +735,12 @@ int main(int argc, char* const argv[]) {
         ERR("Invalid socket path\n");
         goto main_exit_1;
     }
+    ini_sget(config, NULL, "stats_path", "%s", &stats_path);
+    if(strlen(stats_path) <= 0) {
+        ERR("Invalid stats path\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
     ini_sget(config, NULL, "max_conn_attempts", "%d", &max_conn_attempts); 
     if(max_conn_attempts <= 0) {
         ERR("max_conn_attempts must be a positive integer\n");
@@ -415,9 +765,44 @@ int main(int argc, char* const argv[]) {
         ini_free(config);
         goto main_exit_1;
     }
-    ini_sget(config, NULL, "cashier_poll_time", "%ld", &cashier_poll_time);
-    if(cashier_poll_time <= 0) {
-        ERR("cashier_poll_time must be a positive integer\n");
+    // Shared with the manager, reports are sent when it matters to it
+    ini_sget(config, NULL, "overcrowded_cash_treshold", "%ld",
+             &overcrowded_cash_treshold);
+    if(overcrowded_cash_treshold <= 0) {
+        ERR("overcrowded_cash_treshold must be a positive integer\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "queue_report_min_interval", "%ld",
+             &queue_report_min_interval);
+    if(queue_report_min_interval < 0) {
+        ERR("queue_report_min_interval must be a non negative integer\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "queue_report_delta", "%ld", &queue_report_delta);
+    if(queue_report_delta <= 0) {
+        ERR("queue_report_delta must be a positive integer\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "queue_report_wait_band", "%ld",
+             &queue_report_wait_band);
+    if(queue_report_wait_band <= 0) {
+        ERR("queue_report_wait_band must be a positive integer\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    // The target of the manager, whose crossings are reported at once
+    ini_sget(config, NULL, "slo_p95_wait", "%ld", &slo_p95_wait);
+    if(slo_p95_wait <= 0) {
+        ERR("slo_p95_wait must be a positive integer\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "queue_report_idle", "%ld", &queue_report_idle);
+    if(queue_report_idle <= 0) {
+        ERR("queue_report_idle must be a positive integer\n");
         ini_free(config);
         goto main_exit_1;
     }
@@ -454,8 +839,90 @@ int main(int argc, char* const argv[]) {
         ini_free(config);
         goto main_exit_1;
     }
+    ini_sget(config, NULL, "coro_carriers", "%d", &coro_carriers);
+    if(coro_carriers < 0) {
+        ERR("coro_carriers must be a non negative integer\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "coro_stack_size", "%ld", &coro_stack_size);
+    if(coro_stack_size <= 0) {
+        ERR("coro_stack_size must be a positive integer\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "inmsg_dispatchers", "%d", &inmsg_dispatchers);
+    if(inmsg_dispatchers <= 0) {
+        ERR("inmsg_dispatchers must be a positive integer\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "inmsg_ring_size", "%ld", &inmsg_ring_size);
+    if(inmsg_ring_size <= 0) {
+        ERR("inmsg_ring_size must be a positive integer\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "exit_batch_window", "%ld", &exit_batch_window);
+    if(exit_batch_window < 0) {
+        ERR("exit_batch_window must be a non negative integer\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "exit_batch_max", "%d", &exit_batch_max);
+    if(exit_batch_max <= 0 || exit_batch_max > EXIT_BATCH_MAX_IDS) {
+        ERR("exit_batch_max must be between 1 and %d\n", EXIT_BATCH_MAX_IDS);
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "trace_path", "%s", &trace_path);
+    ini_sget(config, NULL, "trace_events", "%ld", &trace_events);
+    if(trace_events <= 0) {
+        ERR("trace_events must be a positive integer\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
+    ini_sget(config, NULL, "flight_path", "%s", &flight_path);
+    ini_sget(config, NULL, "flight_events", "%ld", &flight_events);
+    if(flight_events <= 0) {
+        ERR("flight_events must be a positive integer\n");
+        ini_free(config);
+        goto main_exit_1;
+    }
 
     ini_free(config);
+
+    if(strlen(trace_path) > 0) {
+        if(trace_init("supermarket", trace_events) != 0) {
+            ERR("Starting the trace\n");
+            goto main_exit_1;
+        }
+        LOG_NOTICE("Tracing to %s\n", trace_path);
+    }
+    if(strlen(flight_path) > 0
+       && flight_init(flight_path, "supermarket", flight_events,
+                      (coro_carriers > 0 ? coro_carriers : (int) cust_cap)
+                      + num_cashiers + FLIGHT_SPARE_RINGS) != 0)
+        ERR("Starting the flight recorder at %s\n", flight_path);
+
+    // Every sleep in the process goes through a single timer thread
+    if((timers = twheel_init()) == NULL) {
+        ERR("Starting the timing wheel\n");
+        goto main_exit_1;
+    }
+    twheel_set_default(timers);
+
+    if((exit_batch = exit_batch_init(outmsgqueue, timers, exit_batch_window,
+                                     exit_batch_max)) == NULL) {
+        ERR("Allocating the exit batch\n");
+        goto main_exit_1;
+    }
+
+    // No limit until the manager sets one
+    if((admission = token_bucket_init(-1, DEFAULT_ADMISSION_BURST)) == NULL) {
+        ERR("Allocating the admission bucket\n");
+        goto main_exit_1;
+    }
   
 
 // ========== Connect to server process  ==========
@@ -476,7 +943,7 @@ int main(int argc, char* const argv[]) {
             ERR_SET_GOTO(main_exit_1, err, "Max number of attempts exceeded\n");
         }
         conn_attempt_count++;
-        msleep(conn_attempt_delay);
+        wait_signal(sig_fd, conn_attempt_delay);
     }
 
     // Set socket to nonblocking
@@ -522,105 +989,129 @@ int main(int argc, char* const argv[]) {
 
 // ========== Creating cashiers. Only 1 is open at startup  ==========
 
-    cashier_tid_arr = calloc(num_cashiers, sizeof(pthread_t));
-    cashier_attr_arr = calloc(num_cashiers, sizeof(pthread_attr_t));
-    cashier_opt_arr = calloc(num_cashiers, sizeof(cashier_opt_t));
-    cashier_mtx_arr = calloc(num_cashiers, sizeof(pthread_mutex_t));
-    cashier_isopen_arr = calloc(num_cashiers, sizeof(bool));
-    cashier_times_closed_arr = calloc(num_cashiers, sizeof(long));
-
-    for(size_t i = 0; i < num_cashiers; i++) {
-        pthread_attr_init(&cashier_attr_arr[i]);
-        if((err = pthread_mutex_init(&cashier_mtx_arr[i], NULL)) != 0) {
-            char errs[1024] = {0}; strerror_r(err, errs, 1024);
-            ERR_SET_GOTO(main_exit_2, err, "Allocating Attr %s\n", errs);
-        }
-        if((err = pthread_attr_init(&cashier_attr_arr[i])) != 0) {
-            char errs[1024] = {0}; strerror_r(err, errs, 1024);
-            ERR_SET_GOTO(main_exit_2, err, "Allocating Mutex %s\n", errs);
-        }
-
-        cashier_isopen_arr[i] = false;
-    }
+    if((cashiers = cashier_table_init(num_cashiers)) == NULL)
+        ERR_SET_GOTO(main_exit_2, err, "Allocating cashiers\n");
+    if((stats = stats_init(stats_path, num_cashiers)) == NULL)
+        ERR_SET_GOTO(main_exit_2, err, "Creating stats segment %s\n",
+                     stats_path);
+    cashiers->stats = stats;
+    // Queues notify the reporter from the first customer on
+    if((cashier_poller_opt = cashier_poll_init(cashiers, ctlmsgqueue,
+                                               overcrowded_cash_treshold,
+                                               queue_report_delta,
+                                               slo_p95_wait,
+                                               queue_report_wait_band,
+                                               queue_report_min_interval,
+                                               queue_report_idle)) == NULL)
+        ERR_SET_GOTO(main_exit_2, err, "Allocating queue reporter\n");
 
     for(int i = 0; i < initial_open_cashiers; i++) {
         // Spawn first cashier thread
-        cashier_isopen_arr[i] = true;
-        cashier_init(&cashier_opt_arr[i], i,
-                     &cashier_isopen_arr[i],
-                     &cashier_mtx_arr[i],
+        cashier_init(&cashiers->slots[i].opt, i,
+                     cashiers,
                      time_per_prod,
-                     &cashier_times_closed_arr[i],
                      logfile
                      );
-        if(pthread_create(&cashier_tid_arr[i], &cashier_attr_arr[i], 
-                          cashier_worker, &cashier_opt_arr[i]) < 0)
+        atomic_bitmap_set(cashiers->open_bm, i);
+        if(pthread_create(&cashiers->slots[i].tid, &cashiers->slots[i].attr,
+                          cashier_worker, &cashiers->slots[i].opt) != 0)
             ERR_SET_GOTO(main_exit_2, err, "Creating cashier worker\n");
+        cashiers->slots[i].joinable = 1;
     }
 // ========== Creating first customers ==========
 
-    if((err = pthread_mutex_init(&customer_count_mtx, NULL)) != 0) {
-        char errs[1024] = {0}; strerror_r(err, errs, 1024);
-        ERR_SET_GOTO(main_exit_2, err, "Allocating Mutex %s", errs);
-    }
     customer_tid_arr = calloc(cust_cap, sizeof(pthread_t));
     customer_attr_arr = calloc(cust_cap, sizeof(pthread_attr_t));
     customer_opt_arr = calloc(cust_cap, sizeof(customer_opt_t));
     customer_terminated_arr = calloc(cust_cap, sizeof(bool));
+    customer_coro_arr = calloc(cust_cap, sizeof(coro_t*));
+    if(coro_carriers > 0) {
+        LOG_NOTICE("Running customers as coroutines on %d carriers\n",
+                   coro_carriers);
+        customer_sched = coro_sched_init(coro_carriers,
+                                         coro_stack_size * 1024, timers);
+        if(customer_sched == NULL)
+            ERR_SET_GOTO(main_exit_2, err, "Creating coroutine carriers\n");
+    }
 
     for(size_t i = 0; i < cust_cap; i++) {
         pthread_attr_init(&customer_attr_arr[i]);
         customer_terminated_arr[i] = false;
         customer_init(&customer_opt_arr[i], i,
                       &customer_count,
-                      &customer_count_mtx,
-                      cashier_opt_arr,
-                      cashier_isopen_arr,
-                      cashier_mtx_arr,
+                      cashiers,
                       &customer_terminated_arr[i],
                       max_shopping_time,
                       product_cap, 
-                      num_cashiers,
-                      outmsgqueue,
+                      exit_batch,
                       total_customers_served,
                       total_products_bought,
                       logfile
                       );
         
-        if(pthread_create(&customer_tid_arr[i], &customer_attr_arr[i], 
-                          customer_worker, &customer_opt_arr[i]) < 0)
+        if(customer_spawn(customer_sched, i, customer_tid_arr,
+                          customer_attr_arr, customer_coro_arr,
+                          customer_opt_arr) != 0)
             ERR_SET_GOTO(main_exit_2, err, "Creating customer worker\n");
-        MTX_LOCK_DIE(&customer_count_mtx);
-        customer_count++;
-        MTX_UNLOCK_DIE(&customer_count_mtx);
+        __atomic_fetch_add(&customer_count, 1, __ATOMIC_RELAXED);
     }
 
 // ========== Creating message handler threads ==========
 
+    histogram_t ctl_wait, bulk_wait;
+    histogram_init(&ctl_wait);
+    histogram_init(&bulk_wait);
     msg_worker_opt_t outmsg_opt = {
         sock_fd,
         outmsgqueue
     };
+    outmsg_opt.ctlqueue = ctlmsgqueue;
+    outmsg_opt.ctl_wait = &ctl_wait;
+    outmsg_opt.bulk_wait = &bulk_wait;
+    outmsg_opt.pending = &outmsg_pending;
+    outmsg_opt.stats = stats;
+    conc_lqueue_set_notify(outmsgqueue, outmsg_wake, &outmsg_pending);
+    conc_lqueue_set_notify(ctlmsgqueue, outmsg_wake, &outmsg_pending);
     msg_worker_opt_t inmsg_opt = {
         sock_fd,
         inmsgqueue,
         cust_cap,
         customer_opt_arr,
-        num_cashiers,
-        cashier_mtx_arr,
-        cashier_isopen_arr,
-        cashier_opt_arr,
-        cashier_tid_arr,
+        cashiers,
         time_per_prod,
-        cashier_attr_arr,
-        cashier_times_closed_arr,
-        logfile
+        logfile,
+        shutdown_fd,
+        inmsg_dispatchers,
+        NULL,
+        &frames_per_read,
+        exit_batch
     };
+    inmsg_opt.admission = admission;
+    inmsg_opt.stats = stats;
 
     if(pthread_create(&outmsg_tid, &outmsg_attr,
                       outmsg_worker, (void*) &outmsg_opt) < 0) {
         ERR_SET_GOTO(main_exit_2, err, "Creating msg worker\n");
     }
+
+    // Dispatchers first, the reader feeds them as soon as it starts
+    histogram_init(&frames_per_read);
+    if((dispatchers = calloc(inmsg_dispatchers + 1,
+                             sizeof(inmsg_dispatcher_t))) == NULL)
+        ERR_SET_GOTO(main_exit_2, err, "Allocating inmsg dispatchers\n");
+    inmsg_opt.dispatchers = dispatchers;
+    for(int i = 0; i <= inmsg_dispatchers; i++) {
+        dispatchers[i].opt = &inmsg_opt;
+        histogram_init(&dispatchers[i].depth);
+        histogram_init(&dispatchers[i].queue_wait);
+        histogram_init(&dispatchers[i].apply_time);
+        if((dispatchers[i].ring = spsc_ring_init(inmsg_ring_size,
+                                                 sizeof(inmsg_t))) == NULL)
+            ERR_SET_GOTO(main_exit_2, err, "Allocating inmsg ring\n");
+        if(pthread_create(&dispatchers[i].tid, NULL,
+                          inmsg_dispatcher_worker, &dispatchers[i]) != 0)
+            ERR_SET_GOTO(main_exit_2, err, "Creating inmsg dispatcher\n");
+    }
     if(pthread_create(&inmsg_tid, &inmsg_attr,
                       inmsg_worker, (void*) &inmsg_opt) < 0) {
         ERR_SET_GOTO(main_exit_2, err, "Creating msg worker\n");
@@ -629,14 +1120,6 @@ int main(int argc, char* const argv[]) {
 // ========== Creating additional threads ==========
 
     // Spawn cashier poll thread
-    cashier_poller_opt = calloc(1, sizeof(cashier_poll_opt_t));
-    cashier_poller_opt->cashier_arr = cashier_opt_arr;
-    cashier_poller_opt->cashier_arr_size = num_cashiers;
-    cashier_poller_opt->cashier_poll_time = cashier_poll_time;
-    cashier_poller_opt->cashier_mtx_arr = cashier_mtx_arr;
-    cashier_poller_opt->cashier_isopen_arr = cashier_isopen_arr;
-    cashier_poller_opt->outmsgqueue = outmsgqueue;
-
     if(pthread_create(&cashier_poller_tid, &cashier_poller_attr,
 
                       cashier_poll_worker, cashier_poller_opt) < 0)
@@ -648,10 +1131,7 @@ int main(int argc, char* const argv[]) {
     pthread_attr_t *customer_renqueue_attr = calloc(1, sizeof(pthread_attr_t));
     customer_renqueue_worker_t *customer_renqueue_worker_opt 
         = calloc(1, sizeof(customer_renqueue_worker_t));
-    customer_renqueue_worker_opt->cashier_arr = cashier_opt_arr;
-    customer_renqueue_worker_opt->cashier_arr_size = num_cashiers;
-    customer_renqueue_worker_opt->cashier_isopen_arr = cashier_isopen_arr;
-    customer_renqueue_worker_opt->cashier_mtx_arr = cashier_mtx_arr;
+    customer_renqueue_worker_opt->cashiers = cashiers;
 
 
     if(pthread_create(&customer_renqueue_worker_tid, customer_renqueue_attr,
@@ -662,55 +1142,61 @@ int main(int argc, char* const argv[]) {
 
     while(!should_quit) {
 
-        // Check if the number of customers has got below C - E
-        MTX_LOCK_DIE(&customer_count_mtx);
-        // LOG_DEBUG("Customer count = %d\n", customer_count);
+        // Check if the number of customers has got below C - E.
+        // Only this thread lets customers in, so the count can only
+        // drop while we look at it
+        int inside = __atomic_load_n(&customer_count, __ATOMIC_ACQUIRE);
 
         // If the process received SIGHUP, wait until there are
         // No customers left then exit gently
         if (should_close) {
-           if(customer_count == 0) {
+           if(inside == 0) {
                 should_quit = 1;
-                MTX_UNLOCK_DIE(&customer_count_mtx);
+                shutdown_start = now_ms();
+                fprintf(logfile, "drain_ms %.3f\n",
+                        shutdown_start - drain_start);
+                LOG_NOTICE("Drained the supermarket in %.3f ms\n",
+                           shutdown_start - drain_start);
                 goto main_exit_3;
            }
         }
-        // Otherwise let cust_batch customers in
-        else if((cust_cap - customer_count) > cust_batch) {
-            LOG_DEBUG("Letting more customers in\n");
-            for(int i = 0; i < cust_cap; i++) {
-            if(customer_terminated_arr[i]) {
+        // Otherwise let cust_batch customers in, as fast as the manager
+        // allows
+        else if((cust_cap - inside) > cust_batch
+                && (admitted = token_bucket_take(admission,
+                                                 cust_cap - inside))
+                   > 0) {
+            LOG_DEBUG("Letting %ld more customers in\n", admitted);
+            for(int i = 0; i < cust_cap && admitted > 0; i++) {
+            if(__atomic_load_n(&customer_terminated_arr[i],
+                               __ATOMIC_ACQUIRE)) {
+                admitted--;
                 customer_terminated_arr[i] = false;
-                pthread_join(customer_tid_arr[i], NULL);
+                customer_join(customer_sched, i, customer_tid_arr,
+                              customer_coro_arr);
                 customer_destroy(&customer_opt_arr[i]);
                 pthread_attr_destroy(&customer_attr_arr[i]);
                 pthread_attr_init(&customer_attr_arr[i]);
                 customer_init(&customer_opt_arr[i], i, 
                               &customer_count,
-                              &customer_count_mtx,
-                              cashier_opt_arr,
-                              cashier_isopen_arr,
-                              cashier_mtx_arr,
+                              cashiers,
                               &customer_terminated_arr[i],
                               max_shopping_time,
                               product_cap,
-                              num_cashiers,
-                              outmsgqueue,
+                              exit_batch,
                               total_customers_served,
                               total_products_bought,
                               logfile
                               );
-                if(pthread_create(&customer_tid_arr[i],
-                                  &customer_attr_arr[i], 
-                                  customer_worker,
-                                  &customer_opt_arr[i]) < 0)
+                if(customer_spawn(customer_sched, i, customer_tid_arr,
+                                  customer_attr_arr, customer_coro_arr,
+                                  customer_opt_arr) != 0)
                 ERR_SET_GOTO(main_exit_3, err,
                                    "Creating customer worker\n");
-                customer_count++;
+                __atomic_fetch_add(&customer_count, 1, __ATOMIC_RELAXED);
             }
             }
         }
-        MTX_UNLOCK_DIE(&customer_count_mtx);
        
         if(should_quit) {
             goto main_exit_3;
@@ -718,30 +1204,105 @@ int main(int argc, char* const argv[]) {
         }
             
 
-        msleep(supermarket_poll_time);
+        switch(wait_signal(sig_fd, supermarket_poll_time)) {
+            case 0:
+                break;
+            case SIGHUP:
+                // Customers waiting for an exit confirmation leave now
+                for(size_t i = 0; i < cust_cap; i++)
+                    customer_drain(&customer_opt_arr[i]);
+                break;
+            case SIGUSR1:
+                break;
+            case -1:
+                ERR("Error reading signals\n");
+                should_quit = 1;
+                break;
+            default:
+                shutdown_start = now_ms();
+                break;
+        }
+        // Closed cashiers whose thread stopped since
+        for(int i = 0; i < num_cashiers; i++)
+            cashier_reap(cashiers, i, false);
     }
 
 // ========== Cleanup  ==========
     main_exit_3: 
+        // Broadcast the shutdown: the eventfd releases whoever polls on
+        // it, the timing wheel everyone sleeping, and all the customers
+        // are kicked before any of them is joined, so they exit together
+        if(shutdown_start == 0) shutdown_start = now_ms();
+        should_quit = 1;
         conc_lqueue_abort_all_operations = 1;
+        if(eventfd_write(shutdown_fd, 1) != 0)
+            ERR("Writing to the shutdown eventfd\n");
+        twheel_cancel_all(timers);
+        cashier_poll_kick(cashier_poller_opt);
+        outmsg_wake(&outmsg_pending, 1);
+        for(size_t i = 0; i < cust_cap; i++)
+            customer_kick(&customer_opt_arr[i]);
+
+        // Dispatchers touch customers and cashiers, stop them first
+        pthread_join(inmsg_tid, NULL);
+        fprintf(logfile, "inmsg reads %lu frames_per_read_p50 %lu "
+                "frames_per_read_max %lu\n", frames_per_read.count,
+                histogram_percentile(&frames_per_read, 50),
+                frames_per_read.max);
+        for(int i = 0; i <= inmsg_dispatchers; i++) {
+            inmsg_dispatcher_t *d = &dispatchers[i];
+            char name[16];
+            // The last one is the control dispatcher
+            if(i == inmsg_dispatchers) snprintf(name, sizeof(name), "ctl");
+            else snprintf(name, sizeof(name), "%d", i);
+            pthread_join(d->tid, NULL);
+            fprintf(logfile, "inmsg dispatcher %s messages %lu "
+                    "depth_p50 %lu depth_p99 %lu depth_max %lu "
+                    "queue_wait_us_p50 %lu queue_wait_us_p99 %lu "
+                    "apply_us_p50 %lu apply_us_p99 %lu apply_us_max %lu\n",
+                    name, d->depth.count,
+                    histogram_percentile(&d->depth, 50),
+                    histogram_percentile(&d->depth, 99), d->depth.max,
+                    histogram_percentile(&d->queue_wait, 50),
+                    histogram_percentile(&d->queue_wait, 99),
+                    histogram_percentile(&d->apply_time, 50),
+                    histogram_percentile(&d->apply_time, 99),
+                    d->apply_time.max);
+            spsc_ring_destroy(d->ring);
+        }
+        free(dispatchers);
+
         LOG_DEBUG("Joining customer threads\n");
         for(size_t i = 0; i < cust_cap; i++) {
             LOG_DEBUG("Joining customer thread %zu\n", i);
-            MTX_LOCK_DIE(customer_opt_arr[i].state_mtx);
-            COND_SIGNAL_DIE(customer_opt_arr[i].state_change_event);
-            MTX_UNLOCK_DIE(customer_opt_arr[i].state_mtx);
-            pthread_join(customer_tid_arr[i], NULL);
+            customer_join(customer_sched, i, customer_tid_arr,
+                          customer_coro_arr);
             customer_destroy(&customer_opt_arr[i]);
             pthread_attr_destroy(&customer_attr_arr[i]);
+            coro_free(customer_coro_arr[i]);
         }
+        coro_sched_destroy(customer_sched);
 
         // Print stats
-        MTX_LOCK_DIE(&customer_count_mtx);
         fprintf(logfile, 
-            "total_customers_served %d \n", *total_customers_served);
+            "total_customers_served %ld \n",
+            (long) counter_read(total_customers_served));
         fprintf(logfile,
-            "products_bought %d \n", *total_products_bought);
-        MTX_UNLOCK_DIE(&customer_count_mtx);
+            "products_bought %ld \n",
+            (long) counter_read(total_products_bought));
+        fprintf(logfile, "exit_batch batches %lu size_p50 %lu size_max %lu "
+                "confirm_us_p50 %lu confirm_us_p99 %lu confirm_us_max %lu\n",
+                exit_batch->batch_size.count,
+                histogram_percentile(&exit_batch->batch_size, 50),
+                exit_batch->batch_size.max,
+                histogram_percentile(&exit_batch->confirm_us, 50),
+                histogram_percentile(&exit_batch->confirm_us, 99),
+                exit_batch->confirm_us.max);
+        fprintf(logfile, "exit_lease grants %lu revokes %lu exits %lu\n",
+                exit_batch->lease_grants, exit_batch->lease_revokes,
+                exit_batch->lease_exits);
+        fprintf(logfile, "admission updates %lu admitted %lu throttled %lu\n",
+                admission->updates, admission->admitted, admission->throttled);
 
         free(customer_opt_arr);
         pthread_join(customer_renqueue_worker_tid, NULL);
@@ -751,39 +1312,56 @@ int main(int argc, char* const argv[]) {
         free(customer_terminated_arr);
         free(customer_tid_arr);
         free(customer_attr_arr);
+        free(customer_coro_arr);
 
         LOG_DEBUG("Joining cashier threads\n");
         for(int i = 0; i < num_cashiers; i++) {
             LOG_DEBUG("Joining cashier thread %d\n", i);
-            if(cashier_isopen_arr[i]) {
-                pthread_join(cashier_tid_arr[i], NULL);
-                pthread_attr_destroy(&cashier_attr_arr[i]);
-            }
+            cashier_reap(cashiers, i, true);
             fprintf(logfile, "cashier %d times_closed %ld\n", i, 
-                    cashier_times_closed_arr[i]);
+                    cashiers->slots[i].times_closed);
         }
 
-        free(cashier_tid_arr);
-        free(cashier_attr_arr);
-        free(cashier_mtx_arr);
-        free(cashier_opt_arr);
-        free(cashier_isopen_arr);
+        cashier_table_destroy(cashiers);
         free(customer_renqueue_worker_opt);
-        free(cashier_poller_opt);
-        free(cashier_times_closed_arr);
-        free(total_customers_served);
-        free(total_products_bought);
+        fprintf(logfile, "queue_report sent %lu events %lu\n",
+                cashier_poller_opt->sent, cashier_poller_opt->events);
+        cashier_poll_destroy(cashier_poller_opt);
         close(sock_fd);
-        pthread_join(inmsg_tid, NULL);
         pthread_join(outmsg_tid, NULL);
+        fprintf(logfile, "outmsg ctl messages %lu wait_us_p50 %lu "
+                "wait_us_p99 %lu wait_us_max %lu\n", ctl_wait.count,
+                histogram_percentile(&ctl_wait, 50),
+                histogram_percentile(&ctl_wait, 99), ctl_wait.max);
+        fprintf(logfile, "outmsg bulk messages %lu wait_us_p50 %lu "
+                "wait_us_p99 %lu wait_us_max %lu\n", bulk_wait.count,
+                histogram_percentile(&bulk_wait, 50),
+                histogram_percentile(&bulk_wait, 99), bulk_wait.max);
+        fprintf(logfile, "shutdown_ms %.3f\n", now_ms() - shutdown_start);
+        LOG_NOTICE("Shut down in %.3f ms\n", now_ms() - shutdown_start);
+        if(trace_on() && trace_write(trace_path) != 0)
+            ERR("Writing the trace to %s\n", trace_path);
     main_exit_2:
         fclose(logfile);
         LOG_DEBUG("Closing message queue\n");
         conc_lqueue_close(outmsgqueue);
+        conc_lqueue_close(ctlmsgqueue);
         conc_lqueue_close(inmsgqueue);
         conc_lqueue_destroy(outmsgqueue);
+        conc_lqueue_destroy(ctlmsgqueue);
         conc_lqueue_destroy(inmsgqueue);
     main_exit_1:
         LOG_DEBUG("Final cleanups... \n");
+        if(sig_fd >= 0) close(sig_fd);
+        if(shutdown_fd >= 0) close(shutdown_fd);
+        exit_batch_destroy(exit_batch);
+        token_bucket_destroy(admission);
+        stats_destroy(stats);
+        counter_destroy(total_customers_served);
+        counter_destroy(total_products_bought);
+        trace_destroy();
+        flight_destroy(err);
+        twheel_set_default(NULL);
+        twheel_destroy(timers);
         exit(err);
 }
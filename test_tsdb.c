@@ -0,0 +1,75 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "tsdb.h"
+
+// Round trips timestamps through a series, with deltas of their deltas
+// on both sides of every bucket edge of the encoder.
+//
+// usage: test_tsdb
+
+typedef struct expect_s {
+    const uint64_t *t;
+    long n;
+    long seen;
+    int failed;
+} expect_t;
+
+static void check(void *arg, int series, uint64_t t_ms, double value) {
+    expect_t *e = (expect_t *) arg;
+    if(e->seen >= e->n || t_ms != e->t[e->seen]
+       || value != (double) e->seen) {
+        fprintf(stderr, "sample %ld: got t %lu value %.0f, want t %lu\n",
+                e->seen, t_ms, value,
+                e->seen < e->n ? e->t[e->seen] : 0);
+        e->failed = 1;
+    }
+    e->seen++;
+}
+
+int main(void) {
+    // Every edge of a bucket and the first value past it, each one
+    // undone by the next so that the delta stays positive
+    static const int64_t dods[] = {
+        0, 1, -1, 63, -64, 64, -65, 255, -256, 256, -257, 2047, -2048,
+        2048, -2049, 2147483647ll, -2147483648ll
+    };
+    int ndods = sizeof(dods) / sizeof(dods[0]);
+    uint64_t t[64];
+    int64_t delta = 10;
+    tsdb_t *db;
+    expect_t e = { t, 0, 0, 0 };
+
+    // Start high enough for the negative deltas to stay in range
+    t[e.n++] = 1ull << 33;
+    t[e.n] = t[e.n - 1] + delta;
+    e.n++;
+    for(int i = 0; i < ndods; i++) {
+        delta += dods[i];
+        t[e.n] = t[e.n - 1] + delta;
+        e.n++;
+        // And a repeated delta in between
+        t[e.n] = t[e.n - 1] + delta;
+        e.n++;
+    }
+
+    // Blocks enough for every sample
+    if((db = tsdb_init(1, 16)) == NULL) {
+        fprintf(stderr, "tsdb_init failed\n");
+        return 1;
+    }
+    for(long i = 0; i < e.n; i++)
+        if(tsdb_append(db, 0, t[i], (double) i) != 0) {
+            fprintf(stderr, "tsdb_append failed\n");
+            return 1;
+        }
+    tsdb_query(db, 0, 0, check, &e);
+    tsdb_destroy(db);
+    if(e.seen != e.n) {
+        fprintf(stderr, "got %ld samples, want %ld\n", e.seen, e.n);
+        e.failed = 1;
+    }
+    printf("test_tsdb %s\n", e.failed ? "FAIL" : "ok");
+    return e.failed;
+}
@@ -0,0 +1,63 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "token_bucket.h"
+
+token_bucket_t* token_bucket_init(double rate, double burst) {
+    token_bucket_t *tb = calloc(1, sizeof(token_bucket_t));
+    if (tb == NULL) return NULL;
+    if (lock_init(&tb->mtx) != 0) {
+        free(tb);
+        return NULL;
+    }
+    tb->rate = rate;
+    tb->burst = burst;
+    tb->tokens = burst;
+    tb->last_ns = now_ns();
+    return tb;
+}
+
+void token_bucket_destroy(token_bucket_t *tb) {
+    if (tb == NULL) return;
+    lock_destroy(&tb->mtx);
+    free(tb);
+}
+
+// Mutex held
+static void refill(token_bucket_t *tb) {
+    uint64_t now = now_ns();
+    if (tb->rate > 0) {
+        tb->tokens += tb->rate * (now - tb->last_ns) / 1e9;
+        if (tb->tokens > tb->burst) tb->tokens = tb->burst;
+    }
+    tb->last_ns = now;
+}
+
+void token_bucket_set(token_bucket_t *tb, double rate, double burst) {
+    MTX_LOCK_DIE(&tb->mtx);
+    // What accrued so far counts at the old rate
+    refill(tb);
+    tb->rate = rate;
+    tb->burst = burst;
+    if (tb->tokens > burst) tb->tokens = burst;
+    tb->updates++;
+    MTX_UNLOCK_DIE(&tb->mtx);
+}
+
+long token_bucket_take(token_bucket_t *tb, long want) {
+    long taken = want;
+    MTX_LOCK_DIE(&tb->mtx);
+    if (tb->rate >= 0) {
+        refill(tb);
+        if (taken > (long) tb->tokens) taken = (long) tb->tokens;
+        tb->tokens -= taken;
+    }
+    tb->admitted += taken;
+    if (taken < want) tb->throttled++;
+    MTX_UNLOCK_DIE(&tb->mtx);
+    return taken;
+}
@@ -0,0 +1,38 @@
+#ifndef token_bucket_h_INCLUDED
+#define token_bucket_h_INCLUDED
+
+#include <stdint.h>
+#include <pthread.h>
+#include "lock.h"
+
+// Token bucket rate limiter. Tokens accrue at rate per second up to
+// burst, and each admitted unit takes one. A negative rate lets
+// everything through. The rate may be changed by another thread while
+// tokens are being taken.
+typedef struct token_bucket_s {
+    lock_t mtx;
+    double rate;
+    double burst;
+    double tokens;
+    // CLOCK_MONOTONIC ns of the last refill
+    uint64_t last_ns;
+    // Counters for the log
+    uint64_t updates;
+    uint64_t admitted;
+    // Takes that got fewer tokens than they asked for
+    uint64_t throttled;
+} token_bucket_t;
+
+/* Returns NULL on failure */
+token_bucket_t* token_bucket_init(double rate, double burst);
+
+void token_bucket_destroy(token_bucket_t *tb);
+
+/* Change the rate and the burst. Tokens already there are kept, up to
+ * the new burst */
+void token_bucket_set(token_bucket_t *tb, double rate, double burst);
+
+/* Take up to want tokens. Returns how many were taken */
+long token_bucket_take(token_bucket_t *tb, long want);
+
+#endif // token_bucket_h_INCLUDED
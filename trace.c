@@ -0,0 +1,202 @@
+// syscall(2) is not exposed under strict POSIX
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "util.h"
+#include "trace.h"
+
+typedef struct trace_ring_s {
+    // Every ring ever allocated, and the ones no thread holds
+    struct trace_ring_s *next;
+    struct trace_ring_s *next_free;
+    // Events written so far, only written by the holder
+    uint64_t head;
+    trace_event_t events[];
+} trace_ring_t;
+
+int trace_enabled = 0;
+
+static lock_t trace_mtx = LOCK_INITIALIZER;
+static trace_ring_t *trace_rings = NULL, *trace_free = NULL;
+static uint64_t trace_mask = 0;
+static pthread_key_t trace_key;
+static char trace_process[64];
+
+static __thread trace_ring_t *thread_ring = NULL;
+static __thread int32_t thread_tid = 0;
+
+// Runs when a thread holding a ring exits
+static void trace_ring_release(void *arg) {
+    trace_ring_t *r = (trace_ring_t *) arg;
+    MTX_LOCK_DIE(&trace_mtx);
+    r->next_free = trace_free;
+    trace_free = r;
+    MTX_UNLOCK_DIE(&trace_mtx);
+}
+
+static trace_ring_t* trace_ring_get(void) {
+    trace_ring_t *r;
+    if(thread_ring != NULL) return thread_ring;
+    MTX_LOCK_DIE(&trace_mtx);
+    if((r = trace_free) != NULL) {
+        trace_free = r->next_free;
+    } else if((r = calloc(1, sizeof(trace_ring_t)
+                          + (trace_mask + 1) * sizeof(trace_event_t)))
+              != NULL) {
+        r->next = trace_rings;
+        trace_rings = r;
+    }
+    MTX_UNLOCK_DIE(&trace_mtx);
+    if(r == NULL) return NULL;
+    pthread_setspecific(trace_key, r);
+    thread_tid = syscall(SYS_gettid);
+    return thread_ring = r;
+}
+
+static void trace_record(const char *cat, const char *name, int track,
+                         uint64_t ts, uint64_t dur,
+                         const char *arg_name, int64_t arg) {
+    trace_ring_t *r = trace_ring_get();
+    trace_event_t *e;
+    if(r == NULL) return;
+    e = &r->events[r->head & trace_mask];
+    e->ts = ts;
+    e->dur = dur;
+    e->cat = cat;
+    e->name = name;
+    e->arg_name = arg_name;
+    e->arg = arg;
+    e->track = track;
+    e->tid = thread_tid;
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+int trace_init(const char *process_name, long ring_events) {
+    uint64_t cap = 1;
+    if(ring_events <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    while(cap < (uint64_t) ring_events) cap <<= 1;
+    if(pthread_key_create(&trace_key, trace_ring_release) != 0)
+        return -1;
+    trace_mask = cap - 1;
+    strncpy(trace_process, process_name, sizeof(trace_process) - 1);
+    __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void trace_span(const char *cat, const char *name, int track,
+                uint64_t start_ns, uint64_t end_ns,
+                const char *arg_name, int64_t arg) {
+    if(!trace_on()) return;
+    trace_record(cat, name, track, start_ns,
+                 end_ns > start_ns ? end_ns - start_ns : 0, arg_name, arg);
+}
+
+void trace_instant(const char *cat, const char *name, int track,
+                   const char *arg_name, int64_t arg) {
+    if(!trace_on()) return;
+    trace_record(cat, name, track, now_ns(), 0, arg_name, arg);
+}
+
+// ========== Chrome trace JSON ==========
+
+static void trace_write_name(FILE *f, int pid, int32_t tid,
+                             const char *kind, long id) {
+    fprintf(f, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,"
+            "\"tid\":%d,\"args\":{\"name\":\"%s %ld\"}}",
+            pid, tid, kind, id);
+}
+
+// Name the customer and cashier tracks that got events
+static void trace_write_tracks(FILE *f, int pid) {
+    long max[3] = {-1, -1, -1};
+    const char *kinds[3] = {NULL, "customer", "cashier"};
+    bool *seen[3] = {NULL, NULL, NULL};
+    uint64_t head, i;
+    for(int pass = 0; pass < 2; pass++) {
+        for(trace_ring_t *r = trace_rings; r != NULL; r = r->next) {
+            head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+            i = head > trace_mask ? head - trace_mask - 1 : 0;
+            for(; i < head; i++) {
+                int32_t track = r->events[i & trace_mask].track;
+                int kind = track >> 24;
+                long id = track & ((1 << 24) - 1);
+                if(kind < 1 || kind > 2) continue;
+                if(pass == 0 && id > max[kind]) max[kind] = id;
+                // Threads still recording may have added tracks since
+                if(pass == 1 && id <= max[kind]) seen[kind][id] = true;
+            }
+        }
+        if(pass == 1) break;
+        for(int k = 1; k < 3; k++)
+            if(max[k] >= 0
+               && (seen[k] = calloc(max[k] + 1, sizeof(bool))) == NULL)
+                goto trace_write_tracks_exit;
+    }
+    for(int k = 1; k < 3; k++)
+        for(long id = 0; id <= max[k]; id++)
+            if(seen[k][id])
+                trace_write_name(f, pid, (k << 24) | id, kinds[k], id);
+trace_write_tracks_exit:
+    for(int k = 1; k < 3; k++) free(seen[k]);
+}
+
+int trace_write(const char *path) {
+    FILE *f;
+    int pid = getpid();
+    uint64_t head, i;
+    trace_event_t *e;
+    if((f = fopen(path, "w")) == NULL) return -1;
+    MTX_LOCK_DIE(&trace_mtx);
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    fprintf(f, "\n{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,"
+            "\"args\":{\"name\":\"%s\"}}", pid, trace_process);
+    trace_write_tracks(f, pid);
+    for(trace_ring_t *r = trace_rings; r != NULL; r = r->next) {
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        i = head > trace_mask ? head - trace_mask - 1 : 0;
+        for(; i < head; i++) {
+            e = &r->events[i & trace_mask];
+            fprintf(f, ",\n{\"ph\":\"%s\",\"cat\":\"%s\",\"name\":\"%s\","
+                    "\"pid\":%d,\"tid\":%d,\"ts\":%.3f",
+                    e->dur > 0 ? "X" : "i", e->cat, e->name, pid,
+                    e->track == TRACE_TRACK_THREAD ? e->tid : e->track,
+                    e->ts / 1000.0);
+            if(e->dur > 0) fprintf(f, ",\"dur\":%.3f", e->dur / 1000.0);
+            else fprintf(f, ",\"s\":\"t\"");
+            if(e->arg_name != NULL)
+                fprintf(f, ",\"args\":{\"%s\":%ld}", e->arg_name,
+                        (long) e->arg);
+            fprintf(f, "}");
+        }
+    }
+    fprintf(f, "\n]}\n");
+    MTX_UNLOCK_DIE(&trace_mtx);
+    if(fclose(f) != 0) return -1;
+    return 0;
+}
+
+void trace_destroy(void) {
+    trace_ring_t *r, *next;
+    if(!trace_on()) return;
+    __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+    MTX_LOCK_DIE(&trace_mtx);
+    for(r = trace_rings; r != NULL; r = next) {
+        next = r->next;
+        free(r);
+    }
+    trace_rings = trace_free = NULL;
+    MTX_UNLOCK_DIE(&trace_mtx);
+    // Threads still alive keep a dangling ring pointer, hence only at exit
+    pthread_key_delete(trace_key);
+}
@@ -0,0 +1,63 @@
+#ifndef trace_h_INCLUDED
+#define trace_h_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Optional timeline of a process, written at exit in the Chrome trace
+// JSON format, which chrome://tracing and ui.perfetto.dev both open.
+// Each thread records into a ring of its own, taken on its first
+// event and handed to the next thread when it exits, so recording
+// takes no lock and a ring only keeps the latest events. Timestamps
+// are CLOCK_MONOTONIC, the traces of the supermarket and the manager
+// line up once merged.
+//
+// Events go on the track of the thread that records them, or on a
+// track of their own for things that move between threads, like a
+// customer served by a cashier or run by several carriers.
+
+#define TRACE_TRACK_THREAD 0
+#define TRACE_TRACK_CUSTOMER(id) ((1 << 24) | (id))
+#define TRACE_TRACK_CASHIER(id) ((2 << 24) | (id))
+
+typedef struct trace_event_s {
+    // CLOCK_MONOTONIC ns, duration 0 for instants
+    uint64_t ts;
+    uint64_t dur;
+    // Static strings, arg_name NULL if there is no argument
+    const char *cat;
+    const char *name;
+    const char *arg_name;
+    int64_t arg;
+    int32_t track;
+    // OS thread that recorded the event
+    int32_t tid;
+} trace_event_t;
+
+extern int trace_enabled;
+
+static inline bool trace_on(void) {
+    return __atomic_load_n(&trace_enabled, __ATOMIC_RELAXED);
+}
+
+/* Start recording, keeping the last ring_events events of each thread
+ * (rounded up to a power of two). Returns 0, or -1 on failure */
+int trace_init(const char *process_name, long ring_events);
+
+/* Event that lasted from start_ns to end_ns. No-op unless tracing */
+void trace_span(const char *cat, const char *name, int track,
+                uint64_t start_ns, uint64_t end_ns,
+                const char *arg_name, int64_t arg);
+
+/* Event that happened now. No-op unless tracing */
+void trace_instant(const char *cat, const char *name, int track,
+                   const char *arg_name, int64_t arg);
+
+/* Write what the rings hold to path. Threads still recording may
+ * lose their last events. Returns 0, or -1 and sets errno */
+int trace_write(const char *path);
+
+/* Stop recording and free the rings */
+void trace_destroy(void);
+
+#endif // trace_h_INCLUDED
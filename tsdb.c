@@ -0,0 +1,274 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "tsdb.h"
+
+// Widest sample: a 36 bit timestamp and a 77 bit value
+#define SAMPLE_MAX_BITS 113
+#define BLOCK_BITS (TSDB_BLOCK_BYTES * 8)
+
+// ========== Bit streams ==========
+
+static void put_bits(tsdb_block_t *b, uint64_t v, int n) {
+    for(int i = n - 1; i >= 0; i--, b->used++) {
+        if((v >> i) & 1)
+            b->bits[b->used / 8] |= (uint8_t) (0x80 >> (b->used % 8));
+    }
+}
+
+typedef struct bit_reader_s {
+    const tsdb_block_t *b;
+    uint32_t pos;
+} bit_reader_t;
+
+static uint64_t get_bits(bit_reader_t *r, int n) {
+    uint64_t v = 0;
+    for(int i = 0; i < n; i++, r->pos++)
+        v = (v << 1) | ((r->b->bits[r->pos / 8] >> (7 - r->pos % 8)) & 1);
+    return v;
+}
+
+static uint64_t double_bits(double d) {
+    uint64_t v;
+    memcpy(&v, &d, sizeof(v));
+    return v;
+}
+
+static double bits_double(uint64_t v) {
+    double d;
+    memcpy(&d, &v, sizeof(d));
+    return d;
+}
+
+// Sign extend the low n bits of v
+static int64_t sign_extend(uint64_t v, int n) {
+    return (int64_t) (v << (64 - n)) >> (64 - n);
+}
+
+// ========== Encoding ==========
+
+// Each bucket holds the two's complement range of its width, which is
+// what the decoder sign extends
+static void encode_dod(tsdb_block_t *b, int64_t dod) {
+    if(dod == 0) {
+        put_bits(b, 0, 1);
+    } else if(dod >= -64 && dod <= 63) {
+        put_bits(b, 0x2, 2);
+        put_bits(b, (uint64_t) dod & 0x7f, 7);
+    } else if(dod >= -256 && dod <= 255) {
+        put_bits(b, 0x6, 3);
+        put_bits(b, (uint64_t) dod & 0x1ff, 9);
+    } else if(dod >= -2048 && dod <= 2047) {
+        put_bits(b, 0xe, 4);
+        put_bits(b, (uint64_t) dod & 0xfff, 12);
+    } else {
+        put_bits(b, 0xf, 4);
+        put_bits(b, (uint64_t) dod & 0xffffffffull, 32);
+    }
+}
+
+static void encode_value(tsdb_block_t *b, uint64_t v) {
+    uint64_t x = v ^ b->last_value;
+    int leading, trailing;
+    if(x == 0) {
+        put_bits(b, 0, 1);
+        return;
+    }
+    leading = __builtin_clzll(x);
+    trailing = __builtin_ctzll(x);
+    // Only 5 bits to tell the leading zeros
+    if(leading > 31) leading = 31;
+    if(b->leading >= 0 && leading >= b->leading
+        && trailing >= b->trailing) {
+        // Fits in the window of the previous value
+        put_bits(b, 0x2, 2);
+        put_bits(b, x >> b->trailing, 64 - b->leading - b->trailing);
+    } else {
+        put_bits(b, 0x3, 2);
+        put_bits(b, leading, 5);
+        // 64 meaningful bits are written as 0, which cannot happen
+        put_bits(b, (64 - leading - trailing) & 0x3f, 6);
+        put_bits(b, x >> trailing, 64 - leading - trailing);
+        b->leading = leading;
+        b->trailing = trailing;
+    }
+}
+
+static void block_start(tsdb_block_t *b, uint64_t t, uint64_t v) {
+    memset(b, 0, sizeof(tsdb_block_t));
+    b->first_t = b->last_t = t;
+    b->last_value = v;
+    b->leading = -1;
+    put_bits(b, t, 64);
+    put_bits(b, v, 64);
+    b->count = 1;
+}
+
+static void block_append(tsdb_block_t *b, uint64_t t, uint64_t v) {
+    int64_t delta = (int64_t) (t - b->last_t);
+    encode_dod(b, delta - b->last_delta);
+    encode_value(b, v);
+    b->last_t = t;
+    b->last_delta = delta;
+    b->last_value = v;
+    b->count++;
+}
+
+// ========== Decoding ==========
+
+typedef struct block_iter_s {
+    bit_reader_t r;
+    uint32_t left;
+    uint64_t t;
+    int64_t delta;
+    uint64_t value;
+    int leading;
+    int meaningful;
+} block_iter_t;
+
+static void iter_init(block_iter_t *it, const tsdb_block_t *b) {
+    memset(it, 0, sizeof(block_iter_t));
+    it->r.b = b;
+    it->left = b->count;
+}
+
+// Returns 0 and the next sample, or -1 at the end of the block
+static int iter_next(block_iter_t *it, uint64_t *t, double *value) {
+    int trailing;
+    if(it->left == 0) return -1;
+    if(it->left-- == it->r.b->count) {
+        it->t = get_bits(&it->r, 64);
+        it->value = get_bits(&it->r, 64);
+    } else {
+        if(get_bits(&it->r, 1) == 0) {
+            // Same delta
+        } else if(get_bits(&it->r, 1) == 0) {
+            it->delta += sign_extend(get_bits(&it->r, 7), 7);
+        } else if(get_bits(&it->r, 1) == 0) {
+            it->delta += sign_extend(get_bits(&it->r, 9), 9);
+        } else if(get_bits(&it->r, 1) == 0) {
+            it->delta += sign_extend(get_bits(&it->r, 12), 12);
+        } else {
+            it->delta += sign_extend(get_bits(&it->r, 32), 32);
+        }
+        it->t += it->delta;
+        if(get_bits(&it->r, 1) == 1) {
+            if(get_bits(&it->r, 1) == 1) {
+                it->leading = get_bits(&it->r, 5);
+                it->meaningful = get_bits(&it->r, 6);
+                if(it->meaningful == 0) it->meaningful = 64;
+            }
+            trailing = 64 - it->leading - it->meaningful;
+            it->value ^= get_bits(&it->r, it->meaningful) << trailing;
+        }
+    }
+    *t = it->t;
+    *value = bits_double(it->value);
+    return 0;
+}
+
+// ========== Store ==========
+
+tsdb_t* tsdb_init(int num_series, int blocks_per_series) {
+    tsdb_t *db = calloc(1, sizeof(tsdb_t));
+    if(db == NULL) return NULL;
+    if((db->series = calloc(num_series, sizeof(tsdb_series_t))) == NULL
+        || lock_init(&db->mtx) != 0) {
+        free(db->series);
+        free(db);
+        return NULL;
+    }
+    db->num_series = num_series;
+    db->blocks_per_series = blocks_per_series;
+    for(int i = 0; i < num_series; i++) db->series[i].head = -1;
+    return db;
+}
+
+void tsdb_destroy(tsdb_t *db) {
+    if(db == NULL) return;
+    for(int i = 0; i < db->num_series; i++) free(db->series[i].blocks);
+    free(db->series);
+    lock_destroy(&db->mtx);
+    free(db);
+}
+
+int tsdb_append(tsdb_t *db, int series, uint64_t t_ms, double value) {
+    tsdb_series_t *s;
+    tsdb_block_t *b;
+    uint64_t v = double_bits(value);
+    if(series < 0 || series >= db->num_series) return -1;
+    s = &db->series[series];
+    MTX_LOCK_DIE(&db->mtx);
+    if(s->blocks == NULL) {
+        if((s->blocks = calloc(db->blocks_per_series,
+                                sizeof(tsdb_block_t))) == NULL) {
+            MTX_UNLOCK_DIE(&db->mtx);
+            return -1;
+        }
+    }
+    b = s->head < 0 ? NULL : &s->blocks[s->head];
+    // Timestamps only move forward within a series
+    if(b != NULL && t_ms < b->last_t) t_ms = b->last_t;
+    if(b == NULL || b->used + SAMPLE_MAX_BITS > BLOCK_BITS) {
+        s->head = (s->head + 1) % db->blocks_per_series;
+        b = &s->blocks[s->head];
+        if(s->len == db->blocks_per_series) {
+            db->samples -= b->count;
+            db->bits -= b->used;
+        } else {
+            s->len++;
+        }
+        block_start(b, t_ms, v);
+        db->bits += b->used;
+    } else {
+        db->bits -= b->used;
+        block_append(b, t_ms, v);
+        db->bits += b->used;
+    }
+    db->samples++;
+    MTX_UNLOCK_DIE(&db->mtx);
+    return 0;
+}
+
+void tsdb_stats(tsdb_t *db, uint64_t *samples, uint64_t *bits) {
+    MTX_LOCK_DIE(&db->mtx);
+    *samples = db->samples;
+    *bits = db->bits;
+    MTX_UNLOCK_DIE(&db->mtx);
+}
+
+long tsdb_query(tsdb_t *db, int series, uint64_t since_ms,
+                tsdb_visit_t visit, void *arg) {
+    int first = series < 0 ? 0 : series;
+    int last = series < 0 ? db->num_series - 1 : series;
+    long visited = 0;
+    tsdb_series_t *s;
+    tsdb_block_t *b;
+    block_iter_t it;
+    uint64_t t;
+    double value;
+    if(series >= db->num_series) return 0;
+    MTX_LOCK_DIE(&db->mtx);
+    for(int i = first; i <= last; i++) {
+        s = &db->series[i];
+        // Oldest block first
+        for(int k = s->len - 1; k >= 0; k--) {
+            b = &s->blocks[(s->head - k + db->blocks_per_series)
+                           % db->blocks_per_series];
+            // Skip whole blocks that are too old
+            if(b->last_t < since_ms) continue;
+            iter_init(&it, b);
+            while(iter_next(&it, &t, &value) == 0) {
+                if(t < since_ms) continue;
+                visit(arg, i, t, value);
+                visited++;
+            }
+        }
+    }
+    MTX_UNLOCK_DIE(&db->mtx);
+    return visited;
+}
@@ -0,0 +1,72 @@
+#ifndef tsdb_h_INCLUDED
+#define tsdb_h_INCLUDED
+
+#include <stdint.h>
+#include <pthread.h>
+#include "lock.h"
+#include "config.h"
+
+// In memory time series store, one series per cashier of a
+// supermarket. Samples are compressed as in Facebook's Gorilla:
+// timestamps as the delta of their delta, values as the XOR with the
+// previous one, so a sample that repeats its interval and value takes
+// two bits. Every series is a ring of blocks of TSDB_BLOCK_BYTES,
+// allocated on the first sample, the oldest block being reused once
+// the ring is full. Appends and queries may come from different
+// threads.
+
+typedef struct tsdb_block_s {
+    uint8_t bits[TSDB_BLOCK_BYTES];
+    // Bits written
+    uint32_t used;
+    uint32_t count;
+    // First sample, also encoded in bits
+    uint64_t first_t;
+    // State of the encoder after the last sample
+    uint64_t last_t;
+    int64_t last_delta;
+    uint64_t last_value;
+    int leading;
+    int trailing;
+} tsdb_block_t;
+
+typedef struct tsdb_series_s {
+    tsdb_block_t *blocks;
+    // Block being written, -1 before the first sample
+    int head;
+    // Blocks holding samples
+    int len;
+} tsdb_series_t;
+
+typedef struct tsdb_s {
+    lock_t mtx;
+    int num_series;
+    int blocks_per_series;
+    tsdb_series_t *series;
+    // Samples held and the bits encoding them
+    uint64_t samples;
+    uint64_t bits;
+} tsdb_t;
+
+/* Returns NULL on failure */
+tsdb_t* tsdb_init(int num_series, int blocks_per_series);
+
+void tsdb_destroy(tsdb_t *db);
+
+/* Append a sample at t_ms, which should not be older than the last one
+ * of the series. Returns -1 on allocation failure or a bad series */
+int tsdb_append(tsdb_t *db, int series, uint64_t t_ms, double value);
+
+/* Samples held and the bits encoding them */
+void tsdb_stats(tsdb_t *db, uint64_t *samples, uint64_t *bits);
+
+typedef void (*tsdb_visit_t)(void *arg, int series, uint64_t t_ms,
+                             double value);
+
+/* Call visit on the samples of series (all of them if -1) taken at
+ * since_ms or later, oldest first within a series.
+ * Returns how many were visited */
+long tsdb_query(tsdb_t *db, int series, uint64_t since_ms,
+                tsdb_visit_t visit, void *arg);
+
+#endif // tsdb_h_INCLUDED
@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "twheel.h"
+
+#define TICK_NS ((uint64_t) TWHEEL_TICK_MS * 1000000ull)
+#define SLOT_MASK (TWHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(lvl) ((lvl) * TWHEEL_SLOT_BITS)
+
+static twheel_t *twheel_default = NULL;
+
+// ========== Slot lists, wheel mutex held ==========
+
+static void slot_link(twheel_t *tw, twheel_timer_t *t) {
+    uint64_t delta = t->expires - tw->now;
+    int lvl = 0;
+    // Lowest level whose whole span covers the delay
+    while(lvl < TWHEEL_LEVELS - 1
+          && delta >= (1ull << LEVEL_SHIFT(lvl + 1)))
+        lvl++;
+    twheel_timer_t **head =
+        &tw->slots[lvl][(t->expires >> LEVEL_SHIFT(lvl)) & SLOT_MASK];
+    t->prev = NULL;
+    t->next = *head;
+    if(*head != NULL) (*head)->prev = t;
+    *head = t;
+}
+
+static void slot_unlink(twheel_t *tw, twheel_timer_t *t) {
+    if(t->prev != NULL) {
+        t->prev->next = t->next;
+    } else {
+        // Head of its slot, which is the one holding t at its level
+        for(int lvl = 0; lvl < TWHEEL_LEVELS; lvl++) {
+            twheel_timer_t **head = &tw->slots[lvl]
+                [(t->expires >> LEVEL_SHIFT(lvl)) & SLOT_MASK];
+            if(*head == t) {
+                *head = t->next;
+                break;
+            }
+        }
+    }
+    if(t->next != NULL) t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+}
+
+// Move the timers of a higher level slot down, now that they are closer
+static void cascade(twheel_t *tw, int lvl, int slot) {
+    twheel_timer_t *t = tw->slots[lvl][slot], *next;
+    tw->slots[lvl][slot] = NULL;
+    for(; t != NULL; t = next) {
+        next = t->next;
+        slot_link(tw, t);
+    }
+}
+
+// Advance by one tick, returning the list of timers that expired on it
+static twheel_timer_t* advance(twheel_t *tw) {
+    uint64_t t = ++tw->now;
+    int top = 0;
+    twheel_timer_t *expired;
+    while(top < TWHEEL_LEVELS - 1
+          && (t & ((1ull << LEVEL_SHIFT(top + 1)) - 1)) == 0)
+        top++;
+    // Higher levels first, so their timers can land in the lower ones
+    for(int lvl = top; lvl > 0; lvl--)
+        cascade(tw, lvl, (t >> LEVEL_SHIFT(lvl)) & SLOT_MASK);
+    expired = tw->slots[0][t & SLOT_MASK];
+    tw->slots[0][t & SLOT_MASK] = NULL;
+    for(twheel_timer_t *e = expired; e != NULL; e = e->next) {
+        __atomic_store_n(&e->state, TWHEEL_FIRING, __ATOMIC_RELAXED);
+        tw->pending--;
+    }
+    return expired;
+}
+
+// First tick worth waking up for: the next busy slot of the first
+// level, or the next cascade
+static uint64_t next_event(twheel_t *tw) {
+    uint64_t boundary = (tw->now | SLOT_MASK) + 1;
+    for(uint64_t t = tw->now + 1; t < boundary; t++)
+        if(tw->slots[0][t & SLOT_MASK] != NULL) return t;
+    return boundary;
+}
+
+// Run a fired list without the lock. The next pointer is read before
+// the callback, which may reuse the timer once it is idle again
+static void run_expired(twheel_timer_t *t) {
+    twheel_timer_t *next;
+    for(; t != NULL; t = next) {
+        next = t->next;
+        t->prev = t->next = NULL;
+        t->cb(t->arg);
+        // Leave it alone if the callback armed it again, and wake the
+        // cancels waiting for it otherwise
+        uint32_t firing = TWHEEL_FIRING;
+        if(!__atomic_compare_exchange_n(&t->state, &firing, TWHEEL_IDLE,
+                                        false, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED)
+           && firing == TWHEEL_FIRING_WAITED
+           && __atomic_compare_exchange_n(&t->state, &firing, TWHEEL_IDLE,
+                                          false, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED))
+            futex_wake(&t->state, INT_MAX);
+    }
+}
+
+// ========== Timer thread ==========
+
+static void* twheel_worker(void *arg) {
+    twheel_t *tw = (twheel_t *) arg;
+    twheel_timer_t *expired, *tail, *list;
+    struct timespec abstime;
+    uint64_t target, cur;
+
+    MTX_LOCK_DIE(&tw->mtx);
+    while(!tw->stop) {
+        cur = (now_ns() - tw->start_ns) / TICK_NS;
+        list = tail = NULL;
+        while(tw->now < cur) {
+            if((expired = advance(tw)) == NULL) continue;
+            if(list == NULL) list = expired;
+            else tail->next = expired;
+            for(tail = expired; tail->next != NULL; tail = tail->next);
+        }
+        if(list != NULL) {
+            MTX_UNLOCK_DIE(&tw->mtx);
+            run_expired(list);
+            MTX_LOCK_DIE(&tw->mtx);
+            continue;
+        }
+        if(tw->pending == 0) {
+            tw->next_wake = UINT64_MAX;
+            COND_WAIT_DIE(&tw->tick_event, &tw->mtx);
+            continue;
+        }
+        tw->next_wake = next_event(tw);
+        target = tw->start_ns + tw->next_wake * TICK_NS;
+        abstime.tv_sec = target / 1000000000ull;
+        abstime.tv_nsec = target % 1000000000ull;
+        COND_TIMEDWAIT_CALL(&tw->tick_event, &tw->mtx, &abstime);
+    }
+    MTX_UNLOCK_DIE(&tw->mtx);
+    return NULL;
+}
+
+twheel_t* twheel_init(void) {
+    twheel_t *tw = calloc(1, sizeof(twheel_t));
+    if(tw == NULL) return NULL;
+    if(lock_init(&tw->mtx) != 0) {
+        free(tw);
+        return NULL;
+    }
+    // Timed waits follow CLOCK_MONOTONIC, the same clock as the ticks
+    if(lock_cond_init(&tw->tick_event) != 0) {
+        lock_destroy(&tw->mtx);
+        free(tw);
+        return NULL;
+    }
+    tw->start_ns = now_ns();
+    tw->now = 0;
+    tw->next_wake = UINT64_MAX;
+    if(pthread_create(&tw->tid, NULL, twheel_worker, tw) != 0) {
+        lock_cond_destroy(&tw->tick_event);
+        lock_destroy(&tw->mtx);
+        free(tw);
+        return NULL;
+    }
+    return tw;
+}
+
+void twheel_destroy(twheel_t *tw) {
+    if(tw == NULL) return;
+    MTX_LOCK_DIE(&tw->mtx);
+    tw->stop = 1;
+    COND_SIGNAL_DIE(&tw->tick_event);
+    MTX_UNLOCK_DIE(&tw->mtx);
+    pthread_join(tw->tid, NULL);
+    lock_cond_destroy(&tw->tick_event);
+    lock_destroy(&tw->mtx);
+    free(tw);
+}
+
+int twheel_add(twheel_t *tw, twheel_timer_t *t, long msec,
+               void (*cb)(void*), void *arg) {
+    uint64_t elapsed, ticks;
+    if(msec < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    elapsed = now_ns() - tw->start_ns;
+    // Round up, a timer never fires before its delay has passed
+    ticks = (elapsed + (uint64_t) msec * 1000000ull + TICK_NS - 1) / TICK_NS;
+    MTX_LOCK_DIE(&tw->mtx);
+    if(tw->cancelled) {
+        MTX_UNLOCK_DIE(&tw->mtx);
+        errno = ECANCELED;
+        return -1;
+    }
+    // An empty wheel can jump over the ticks it slept through
+    if(tw->pending == 0 && elapsed / TICK_NS > tw->now)
+        tw->now = elapsed / TICK_NS;
+    if(ticks <= tw->now) ticks = tw->now + 1;
+    if(ticks - tw->now > TWHEEL_MAX_TICKS) ticks = tw->now + TWHEEL_MAX_TICKS;
+    t->expires = ticks;
+    t->cb = cb;
+    t->arg = arg;
+    t->cancelled = 0;
+    // Armed again by its own callback, while a cancel waits for it
+    if(__atomic_exchange_n(&t->state, TWHEEL_PENDING, __ATOMIC_RELEASE)
+       == TWHEEL_FIRING_WAITED)
+        futex_wake(&t->state, INT_MAX);
+    slot_link(tw, t);
+    tw->pending++;
+    if(ticks < tw->next_wake) COND_SIGNAL_DIE(&tw->tick_event);
+    MTX_UNLOCK_DIE(&tw->mtx);
+    return 0;
+}
+
+int twheel_cancel(twheel_t *tw, twheel_timer_t *t) {
+    MTX_LOCK_DIE(&tw->mtx);
+    if(__atomic_load_n(&t->state, __ATOMIC_ACQUIRE) == TWHEEL_PENDING) {
+        slot_unlink(tw, t);
+        __atomic_store_n(&t->state, TWHEEL_IDLE, __ATOMIC_RELEASE);
+        tw->pending--;
+        MTX_UNLOCK_DIE(&tw->mtx);
+        return 1;
+    }
+    MTX_UNLOCK_DIE(&tw->mtx);
+    // Sleep until a running callback returns
+    for(;;) {
+        uint32_t state = __atomic_load_n(&t->state, __ATOMIC_ACQUIRE);
+        if(state != TWHEEL_FIRING && state != TWHEEL_FIRING_WAITED) break;
+        if(state == TWHEEL_FIRING
+           && !__atomic_compare_exchange_n(&t->state, &state,
+                                           TWHEEL_FIRING_WAITED, false,
+                                           __ATOMIC_ACQUIRE,
+                                           __ATOMIC_ACQUIRE))
+            continue;
+        futex_wait(&t->state, TWHEEL_FIRING_WAITED, -1);
+    }
+    return 0;
+}
+
+void twheel_cancel_all(twheel_t *tw) {
+    twheel_timer_t *list = NULL, *t, *next;
+    MTX_LOCK_DIE(&tw->mtx);
+    tw->cancelled = 1;
+    for(int lvl = 0; lvl < TWHEEL_LEVELS; lvl++) {
+        for(int slot = 0; slot < TWHEEL_SLOTS; slot++) {
+            for(t = tw->slots[lvl][slot]; t != NULL; t = next) {
+                next = t->next;
+                __atomic_store_n(&t->state, TWHEEL_FIRING, __ATOMIC_RELAXED);
+                t->cancelled = 1;
+                t->next = list;
+                list = t;
+            }
+            tw->slots[lvl][slot] = NULL;
+        }
+    }
+    tw->pending = 0;
+    MTX_UNLOCK_DIE(&tw->mtx);
+    run_expired(list);
+}
+
+// ========== Sleeping ==========
+
+typedef struct twheel_sleeper_s {
+    twheel_timer_t timer;
+    uint32_t fired;
+} twheel_sleeper_t;
+
+static void twheel_sleeper_fire(void *arg) {
+    twheel_sleeper_t *s = (twheel_sleeper_t *) arg;
+    __atomic_store_n(&s->fired, 1, __ATOMIC_RELEASE);
+    futex_wake(&s->fired, 1);
+}
+
+int twheel_sleep(twheel_t *tw, long msec) {
+    twheel_sleeper_t s;
+    if(msec == 0 && !__atomic_load_n(&tw->cancelled, __ATOMIC_RELAXED))
+        return 0;
+    memset(&s, 0, sizeof(s));
+    if(twheel_add(tw, &s.timer, msec, twheel_sleeper_fire, &s) != 0)
+        return -1;
+    while(__atomic_load_n(&s.fired, __ATOMIC_ACQUIRE) == 0)
+        futex_wait(&s.fired, 0, -1);
+    // The timer lives on this stack: let the callback finish with it
+    twheel_cancel(tw, &s.timer);
+    if(s.timer.cancelled) {
+        errno = ECANCELED;
+        return -1;
+    }
+    return 0;
+}
+
+int twheel_cancelled(twheel_t *tw) {
+    return __atomic_load_n(&tw->cancelled, __ATOMIC_RELAXED);
+}
+
+void twheel_set_default(twheel_t *tw) {
+    __atomic_store_n(&twheel_default, tw, __ATOMIC_RELEASE);
+}
+
+twheel_t* twheel_get_default(void) {
+    return __atomic_load_n(&twheel_default, __ATOMIC_ACQUIRE);
+}
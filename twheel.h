@@ -0,0 +1,93 @@
+#ifndef twheel_h_INCLUDED
+#define twheel_h_INCLUDED
+
+#include <stdint.h>
+#include <pthread.h>
+#include "lock.h"
+
+// Hierarchical timing wheel driven by a single timer thread.
+// TWHEEL_LEVELS wheels of TWHEEL_SLOTS slots each, the first one
+// advancing every TWHEEL_TICK_MS. Timers sit in intrusive lists, so
+// insert and cancel are O(1), and a far timer is moved one level down
+// every time its wheel comes around (cascading). However many timers
+// are pending, the timer thread sleeps on a single timed wait.
+
+#define TWHEEL_TICK_MS 1
+#define TWHEEL_SLOT_BITS 6
+#define TWHEEL_SLOTS (1 << TWHEEL_SLOT_BITS)
+#define TWHEEL_LEVELS 4
+// Longer delays are clamped to this many ticks (about 4.6 hours)
+#define TWHEEL_MAX_TICKS ((1ull << (TWHEEL_SLOT_BITS * TWHEEL_LEVELS)) - 1)
+
+// Timer states
+#define TWHEEL_IDLE 0
+#define TWHEEL_PENDING 1
+#define TWHEEL_FIRING 2
+// Firing, and a twheel_cancel sleeps until the callback returns
+#define TWHEEL_FIRING_WAITED 3
+
+typedef struct twheel_timer_s {
+    struct twheel_timer_s *prev;
+    struct twheel_timer_s *next;
+    // Tick the timer expires on
+    uint64_t expires;
+    // Run on the timer thread (or on the twheel_cancel_all caller)
+    // without the wheel lock held
+    void (*cb)(void *arg);
+    void *arg;
+    // Futex word for the cancels waiting on a running callback
+    uint32_t state;
+    // Set if the timer was fired early by twheel_cancel_all
+    int cancelled;
+} twheel_timer_t;
+
+typedef struct twheel_s {
+    lock_t mtx;
+    lock_cond_t tick_event;
+    pthread_t tid;
+    // Heads of the slot lists, one array per level
+    twheel_timer_t *slots[TWHEEL_LEVELS][TWHEEL_SLOTS];
+    // Last tick processed
+    uint64_t now;
+    // Tick the timer thread is going to wake up on
+    uint64_t next_wake;
+    long pending;
+    // CLOCK_MONOTONIC time of tick 0, in ns
+    uint64_t start_ns;
+    int stop;
+    // Set by twheel_cancel_all: new timers are refused
+    int cancelled;
+} twheel_t;
+
+/* Start the timer thread. Returns NULL on failure */
+twheel_t* twheel_init(void);
+
+/* Stop the timer thread. Pending timers are dropped without firing */
+void twheel_destroy(twheel_t *tw);
+
+/* Arm an idle timer to run cb(arg) in msec milliseconds.
+ * Returns -1 with errno set to ECANCELED after twheel_cancel_all */
+int twheel_add(twheel_t *tw, twheel_timer_t *t, long msec,
+               void (*cb)(void*), void *arg);
+
+/* Disarm a timer. Returns 1 if it was pending, 0 otherwise. If the
+ * callback is running, waits for it to return, so on return the timer
+ * can be reused or freed */
+int twheel_cancel(twheel_t *tw, twheel_timer_t *t);
+
+/* Fire every pending timer now with cancelled set, and refuse new ones.
+ * Used on shutdown to release every sleeper at once */
+void twheel_cancel_all(twheel_t *tw);
+
+/* Block the calling thread for msec milliseconds. Returns 0 on expiry
+ * and -1 with errno set to ECANCELED if the wheel has been cancelled */
+int twheel_sleep(twheel_t *tw, long msec);
+
+/* Whether twheel_cancel_all ran */
+int twheel_cancelled(twheel_t *tw);
+
+/* Wheel msleep goes through when not NULL */
+void twheel_set_default(twheel_t *tw);
+twheel_t* twheel_get_default(void);
+
+#endif // twheel_h_INCLUDED
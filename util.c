@@ -1,25 +1,59 @@
+// syscall(2) is not exposed under strict POSIX
+#define _DEFAULT_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "util.h"
+#include "coro.h"
+#include "twheel.h"
 
 
 int msleep(long msec) {
     struct timespec ts;
+    twheel_t *tw;
     int res;
     if (msec < 0) {
         errno = EINVAL;
         return -1;
     }
+    // Inside a coroutine only the coroutine sleeps, not its carrier
+    if (coro_self() != NULL) return coro_sleep(msec);
+    // Once the wheel released every sleeper on shutdown, loops that
+    // sleep again do not spin
+    if ((tw = twheel_get_default()) != NULL && !twheel_cancelled(tw))
+        return twheel_sleep(tw, msec);
     ts.tv_sec = msec / 1000;
     ts.tv_nsec = (msec % 1000) * 1000000;
     do { res = nanosleep(&ts, &ts); } while (res && errno == EINTR);
     return res;
 }
 
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int futex_wait(uint32_t *addr, uint32_t val, long msec) {
+    struct timespec ts, *tsp = NULL;
+    if (msec >= 0) {
+        ts.tv_sec = msec / 1000;
+        ts.tv_nsec = (msec % 1000) * 1000000;
+        tsp = &ts;
+    }
+    return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, tsp, NULL, 0);
+}
+
+int futex_wake(uint32_t *addr, int n) {
+    return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
 
 ssize_t  /* Read "n" bytes from a descriptor */
 readn(int fd, void *ptr, size_t n) {  
@@ -2,6 +2,8 @@
 #define util_h_INCLUDED
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include "logger.h"
 
 // ========== Miscellaneous Macros  ==========
@@ -17,6 +19,11 @@
 #define ERR_SET_GOTO(lab, var, ...) {\
     ERR(__VA_ARGS__); var = EXIT_FAILURE; goto lab;}
 
+// Size of a cache line, used to pad data written by different threads
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
 // Use POSIX random because of a better distribution
 // than rand.
 #define RAND_RANGE(seed, low, up) \
@@ -45,34 +52,55 @@
     { set = errno; char errs[1024]; strerror_r(set, &errs[0], 1024);\
      ERR("%s: %s\n", msg, errs); goto lab; }
 
+// ========== Lock calls ==========
+
+// The macros below lock through lock.h, whose backend is picked at
+// build time. Built with LOCKPROF they go through lockprof.h instead,
+// which times every lock site
+#include "lock.h"
+#ifdef LOCKPROF
+#include "lockprof.h"
+#define MTX_LOCK_CALL(mtx) lockprof_lock(mtx, LOCKPROF_SITE(#mtx))
+#define MTX_UNLOCK_CALL(mtx) lockprof_unlock(mtx)
+#define COND_WAIT_CALL(ev, mtx) lockprof_cond_wait(ev, mtx)
+#define COND_TIMEDWAIT_CALL(ev, mtx, abstime) \
+    lockprof_cond_timedwait(ev, mtx, abstime)
+#else
+#define MTX_LOCK_CALL(mtx) lock_acquire(mtx)
+#define MTX_UNLOCK_CALL(mtx) lock_release(mtx)
+#define COND_WAIT_CALL(ev, mtx) lock_cond_wait(ev, mtx)
+#define COND_TIMEDWAIT_CALL(ev, mtx, abstime) \
+    lock_cond_timedwait(ev, mtx, abstime)
+#endif
+
 // ========== Synchronization macros that die on fail  ==========
 
 #define MTX_LOCK_DIE(mtx) \
-    { int err = 0; if((err = pthread_mutex_lock(mtx)) != 0) {\
+    { int err = 0; if((err = MTX_LOCK_CALL(mtx)) != 0) {\
         char errs[1024] = {0}; strerror_r(err, errs, 1024);\
         ERR("error locking resource: %s\n", errs); exit(err);\
     } LOG_NEVER("MUTEX %p locked\n", (void*)mtx);}
 
 #define MTX_UNLOCK_DIE(mtx) \
-    { int err = 0; if((err = pthread_mutex_unlock(mtx)) != 0) {\
+    { int err = 0; if((err = MTX_UNLOCK_CALL(mtx)) != 0) {\
         char errs[1024] = {0}; strerror_r(err, errs, 1024);\
         ERR("error locking resource: %s\n", errs); exit(err);\
     } LOG_NEVER("MUTEX %p unlocked\n", (void*)mtx);}
 
 #define COND_SIGNAL_DIE(ev) \
-    { int err = 0; if((err = pthread_cond_signal(ev)) != 0) {\
+    { int err = 0; if((err = lock_cond_signal(ev)) != 0) {\
         char errs[1024] = {0}; strerror_r(err, errs, 1024);\
         ERR("error signaling cond: %s\n", errs); exit(err);\
     } LOG_NEVER("COND VAR %p signaled\n", (void*)ev);}
 
 #define COND_BROADCAST_DIE(ev) \
-    { int err = 0; if((err = pthread_cond_signal(ev)) != 0) {\
+    { int err = 0; if((err = lock_cond_broadcast(ev)) != 0) {\
         char errs[1024] = {0}; strerror_r(err, errs, 1024);\
         ERR("error signaling cond: %s\n", errs); exit(err);\
     } LOG_NEVER("COND VAR %p broadcasted\n", (void*)ev);}
 
 #define COND_WAIT_DIE(event, mtx) \
-    { int err = 0; if((err = pthread_cond_wait(event, mtx)) != 0) {\
+    { int err = 0; if((err = COND_WAIT_CALL(event, mtx)) != 0) {\
         char errs[1024] = {0}; strerror_r(err, errs, 1024);\
         ERR("error waiting for cond: %s\n", errs); exit(err);\
     } LOG_NEVER("COND VAR %p waiting\n", (void*)event);}
@@ -82,31 +110,31 @@
 
 #define MTX_LOCK_RET(mtx) \
     { int err = 0; \
-    if((err = pthread_mutex_lock(mtx)) != 0) {\
+    if((err = MTX_LOCK_CALL(mtx)) != 0) {\
     LOG_CRITICAL("error locking mutex %p\n", (void*) mtx); return err;}\
     LOG_NEVER("MUTEX %p locked\n", (void*)mtx);}
 
 #define MTX_UNLOCK_RET(mtx) \
     { int err = 0; \
-    if((err = pthread_mutex_unlock(mtx)) != 0) {\
+    if((err = MTX_UNLOCK_CALL(mtx)) != 0) {\
     LOG_CRITICAL("error unlocking mutex %p\n", (void*) mtx); return err;}\
     LOG_NEVER("MUTEX %p unlocked\n", (void*)mtx);}
 
 #define COND_SIGNAL_RET(ev) \
     { int err = 0; \
-    if((err = pthread_cond_signal(ev)) != 0) {\
+    if((err = lock_cond_signal(ev)) != 0) {\
     LOG_CRITICAL("error signaling condition %p\n", (void*) ev); return err;}\
     LOG_NEVER("COND VAR %p signaled\n", (void*)ev);}
 
 #define COND_BROADCAST_RET(ev) \
     { int err = 0; \
-    if((err = pthread_cond_broadcast(ev)) != 0) {\
+    if((err = lock_cond_broadcast(ev)) != 0) {\
     LOG_CRITICAL("error broadcasting condition %p\n", (void*) ev); return err;}\
     LOG_NEVER("COND VAR %p broadcasted\n", (void*)ev);}
 
 #define COND_WAIT_RET(ev, m) \
     { int err = 0; \
-    if((err = pthread_cond_wait(ev, m)) != 0) {\
+    if((err = COND_WAIT_CALL(ev, m)) != 0) {\
     LOG_CRITICAL("error waiting condition %p\n", (void*) ev); return err;}\
     LOG_NEVER("COND VAR %p waiting\n", (void*)ev);}
 
@@ -115,31 +143,31 @@
 // ========== Synchronization macros that exit thread on fail  ==========
 
 #define MTX_LOCK_EXT(mtx) \
-    { int err = 0; if((err = pthread_mutex_lock(mtx)) != 0) {\
+    { int err = 0; if((err = MTX_LOCK_CALL(mtx)) != 0) {\
         char errs[1024] = {0}; strerror_r(err, errs, 1024);\
         ERR("error locking resource: %s\n", errs); pthread_exit((void*)&err);\
     } LOG_NEVER("MUTEX %p locked\n", (void*)mtx);}
 
 #define MTX_UNLOCK_EXT(mtx) \
-    { int err = 0; if((err = pthread_mutex_unlock(mtx)) != 0) {\
+    { int err = 0; if((err = MTX_UNLOCK_CALL(mtx)) != 0) {\
         char errs[1024] = {0}; strerror_r(err, errs, 1024);\
         ERR("error locking resource: %s\n", errs); pthread_exit((void*)&err);\
     } LOG_NEVER("MUTEX %p unlocked\n", (void*)mtx);}
 
 #define COND_SIGNAL_EXT(ev) \
-    { int err = 0; if((err = pthread_cond_signal(ev)) != 0) {\
+    { int err = 0; if((err = lock_cond_signal(ev)) != 0) {\
         char errs[1024] = {0}; strerror_r(err, errs, 1024);\
     ERR("error signaling cond: %s\n", errs); pthread_exit((void*)&err);}\
     LOG_NEVER("COND VAR %p signaled\n", (void*)ev);}
     
 #define COND_BROADCAST_EXT(ev) \
-    { int err = 0; if((err = pthread_cond_signal(ev)) != 0) {\
+    { int err = 0; if((err = lock_cond_broadcast(ev)) != 0) {\
         char errs[1024] = {0}; strerror_r(err, errs, 1024);\
         ERR("error signaling cond: %s\n", errs); pthread_exit((void*)&err);\
     } LOG_NEVER("COND VAR %p broadcasted\n", (void*)ev);}
 
 #define COND_WAIT_EXT(ev, mtx) \
-    { int err = 0; if((err = pthread_cond_wait(ev, mtx)) != 0) {\
+    { int err = 0; if((err = COND_WAIT_CALL(ev, mtx)) != 0) {\
         char errs[1024] = {0}; strerror_r(err, errs, 1024);\
         ERR("error waiting for cond: %s\n", errs); pthread_exit((void*)&err);}\
     LOG_NEVER("COND VAR %p signaled\n", (void*)ev);}
@@ -148,31 +176,31 @@
 // ========== Synchronization macros that goto a label on fail ==========
 
 #define MTX_LOCK_GOTO(mtx, lab) \
-    { int err = 0; if((err = pthread_mutex_lock(mtx)) != 0) {\
+    { int err = 0; if((err = MTX_LOCK_CALL(mtx)) != 0) {\
         char errs[1024] = {0}; strerror_r(err, errs, 1024);\
         ERR("error locking resource: %s\n", errs); goto lab;\
     } LOG_NEVER("MUTEX %p locked\n", (void*)mtx);}
 
 #define MTX_UNLOCK_GOTO(mtx, lab) \
-    { int err = 0; if((err = pthread_mutex_unlock(mtx)) != 0) {\
+    { int err = 0; if((err = MTX_UNLOCK_CALL(mtx)) != 0) {\
         char errs[1024] = {0}; strerror_r(err, errs, 1024);\
         ERR("error locking resource: %s\n", errs); goto lab;\
     } LOG_NEVER("MUTEX %p unlocked\n", (void*)mtx);}
 
 #define COND_SIGNAL_GOTO(ev, lab) \
-    { int err = 0; if((err = pthread_cond_signal(ev)) != 0) {\
+    { int err = 0; if((err = lock_cond_signal(ev)) != 0) {\
         char errs[1024] = {0}; strerror_r(err, errs, 1024);\
     ERR("error signaling cond: %s\n", errs); goto lab;}\
     LOG_NEVER("COND VAR %p signaled\n", (void*)ev);}
     
 #define COND_BROADCAST_GOTO(ev, lab) \
-    { int err = 0; if((err = pthread_cond_signal(ev)) != 0) {\
+    { int err = 0; if((err = lock_cond_broadcast(ev)) != 0) {\
         char errs[1024] = {0}; strerror_r(err, errs, 1024);\
         ERR("error signaling cond: %s\n", errs); goto lab;\
     } LOG_NEVER("COND VAR %p broadcasted\n", (void*)ev);}
 
 #define COND_WAIT_GOTO(ev, mtx, lab) \
-    { int err = 0; if((err = pthread_cond_wait(ev, mtx)) != 0) {\
+    { int err = 0; if((err = COND_WAIT_CALL(ev, mtx)) != 0) {\
         char errs[1024] = {0}; strerror_r(err, errs, 1024);\
         ERR("error waiting for cond: %s\n", errs); goto lab;}\
     LOG_NEVER("COND VAR %p signaled\n", (void*)ev);}
@@ -182,9 +210,23 @@
 
 // From https://stackoverflow.com/q/1157209/7240056
 // Sleep for msec milliseconds and resume if interrupted
-// by a syscall
+// by a syscall. Called from a coroutine, it parks the coroutine instead.
+// When a default timing wheel is set, threads sleep on it, and a sleep
+// under way when it is cancelled returns -1 with errno set to ECANCELED.
+// Later sleeps fall back to nanosleep
 int msleep(long msec);
 
+// CLOCK_MONOTONIC time in nanoseconds
+uint64_t now_ns(void);
+
+// Thin wrappers around the Linux futex(2) syscall on private mappings.
+// futex_wait blocks while *addr == val, for at most msec milliseconds
+// (forever if msec < 0). Returns -1 and sets errno on timeout (ETIMEDOUT),
+// signal (EINTR) or if the value had already changed (EAGAIN)
+int futex_wait(uint32_t *addr, uint32_t val, long msec);
+// Wake up to n threads blocked on addr, returns the number woken
+int futex_wake(uint32_t *addr, int n);
+
 // Wrappers to read and write to avoid "short" operations
 // From "Advanced Programming In the UNIX Environment" 
 